@@ -0,0 +1,223 @@
+import argparse
+import math
+import random
+import sys
+
+
+
+UNMAPPED = 4
+MATE_UNMAPPED = 8
+REVERSED = 16
+MATE_REVERSED = 32
+FIRST = 64
+LAST = 128
+SECONDARY = 256
+
+QUALS = "?5AIa"
+
+
+
+def geometric(rng, p):
+    # Number of trials up to and including the first success, mean 1 / p
+    if p >= 1:
+        return 1
+    if p <= 0:
+        return sys.maxsize
+    return 1 + int(math.log(1.0 - rng.random()) / math.log(1.0 - p))
+
+
+
+class Generator(object):
+    def __init__(self, args):
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.qname = 0
+        self.clusters = set()
+        self.contigs = [("chr{}".format(i + 1), args.contig_length) for i in range(args.contigs)]
+        # Reads whose mate lies on a later contig, keyed by contig index
+        self.pending = [[] for _ in self.contigs]
+        self.barcodes = ["".join(self.rng.choice("ACGT") for _ in range(args.umi_length)) for _ in range(64)]
+
+    def header(self, f):
+        f.write("@HD\tVN:1.6\tSO:coordinate\n")
+        for name, length in self.contigs:
+            f.write(f"@SQ\tSN:{name}\tLN:{length}\n")
+        f.write("@PG\tID:generate_sam\tPN:generate_sam.py\tCL:{}\n".format(" ".join(sys.argv[1:])))
+
+    def next_qname(self):
+        self.qname += 1
+        if self.args.illumina:
+            # Most clusters are spread across the tile, some are clustered to give optical duplicates
+            while True:
+                tile = self.rng.choice((1101, 1102, 1103, 1104))
+                x = self.rng.randint(1000, 30000)
+                y = self.rng.randint(1000, 30000)
+                if self.claim_cluster(tile, x, y):
+                    return f"M00001:1:000000000-ABCDE:1:{tile}:{x}:{y}"
+        return f"READ{self.qname}"
+
+    def optical_qname(self, qname):
+        # A neighbouring cluster on the same tile, never one already named
+        fields = qname.split(":")
+        tile, x, y = int(fields[4]), int(fields[5]), int(fields[6])
+        while True:
+            nx = x + self.rng.randint(-50, 50)
+            ny = y + self.rng.randint(-50, 50)
+            if self.claim_cluster(tile, nx, ny):
+                fields[5], fields[6] = str(nx), str(ny)
+                return ":".join(fields)
+
+    def claim_cluster(self, tile, x, y):
+        # Every pair must have its own read name, so each cluster position is handed out once
+        if (tile, x, y) in self.clusters:
+            return False
+        self.clusters.add((tile, x, y))
+        return True
+
+    def sequence(self, ref, start, length):
+        # Sequence as stored in a sam, ie reference strand, with errors at the positions between
+        # geometrically distributed gaps
+        seq = ref[start - 1:start - 1 + length]
+        i = geometric(self.rng, self.args.error_rate) - 1
+        if i < length:
+            seq = list(seq)
+            while i < length:
+                seq[i] = self.rng.choice("ACGTN")
+                i += geometric(self.rng, self.args.error_rate)
+            seq = "".join(seq)
+        return seq
+
+    def quality(self, length):
+        return "".join(self.rng.choices(QUALS, k=length))
+
+    def fragment_start(self, length):
+        args = self.args
+        if args.targets:
+            # Coverage concentrated into evenly spaced targets as from a capture panel
+            spacing = length // args.targets
+            target = self.rng.randrange(args.targets) * spacing + spacing // 2
+            return max(1, min(length - 1, target + self.rng.randint(-args.target_width, args.target_width)))
+        return self.rng.randint(1, length - 1)
+
+    def contig(self, index, f):
+        args = self.args
+        name, length = self.contigs[index]
+        rl = args.read_length
+        ref = "".join(self.rng.choices("ACGT", k=length + 2 * args.insert_size + rl))
+        reads = self.pending[index]
+        self.pending[index] = []
+
+        # Mean family size is 1 / (1 - duplication rate)
+        p = 1.0 - args.duplication_rate
+        fragments = int(args.depth * length / (2 * rl) * p)
+        for _ in range(fragments):
+            start = self.fragment_start(length)
+            insert = max(rl, int(self.rng.gauss(args.insert_size, args.insert_size / 6)))
+            end = start + insert - rl
+            barcode = "{}-{}".format(self.rng.choice(self.barcodes), self.rng.choice(self.barcodes))
+            kind = self.rng.random()
+            mate_contig = index
+            if kind < args.mate_unmapped:
+                kind = "unmapped"
+            elif kind < args.mate_unmapped + args.chimeric and index + 1 < len(self.contigs):
+                kind = "chimeric"
+                mate_contig = self.rng.randrange(index + 1, len(self.contigs))
+                end = self.rng.randint(1, self.contigs[mate_contig][1] - 1)
+            else:
+                kind = "proper"
+
+            qname = None
+            for member in range(geometric(self.rng, p)):
+                if qname is not None and args.illumina and self.rng.random() < args.optical_rate:
+                    qname = self.optical_qname(qname)
+                else:
+                    qname = self.next_qname()
+
+                # Thruplex strand B families have swapped barcode halves and read order
+                strand_b = args.umi == "thruplex" and self.rng.random() < 0.5
+                first, last = (LAST, FIRST) if strand_b else (FIRST, LAST)
+                tags = []
+                if args.umi != "none":
+                    bc = barcode
+                    if strand_b:
+                        bc = "-".join(reversed(barcode.split("-")))
+                    tags = [f"RX:Z:{bc}"]
+
+                cigar = f"{rl}M"
+                if self.rng.random() < args.clipped:
+                    cigar = f"3S{rl - 3}M"
+                seq1 = self.sequence(ref, start, rl)
+                read1 = [qname, first | MATE_REVERSED, name, start, 60, cigar, "=", end, insert, seq1, self.quality(rl)] + tags
+
+                if kind == "unmapped":
+                    read1[1] = first | MATE_UNMAPPED
+                    read2 = [qname, last | UNMAPPED, name, start, 0, "*", "=", start, 0, self.sequence(ref, end, rl), self.quality(rl)] + tags
+                    read1[7] = start
+                    read1[8] = 0
+                elif kind == "chimeric":
+                    mate_name = self.contigs[mate_contig][0]
+                    read1[6] = mate_name
+                    read1[8] = 0
+                    read2 = [qname, last | REVERSED, mate_name, end, 60, f"{rl}M", name, start, 0, self.sequence(ref, end, rl), self.quality(rl)] + tags
+                else:
+                    read2 = [qname, last | REVERSED, name, end, 60, f"{rl}M", "=", start, -insert, self.sequence(ref, end, rl), self.quality(rl)] + tags
+
+                reads.append(read1)
+                if kind == "chimeric":
+                    self.pending[mate_contig].append(read2)
+                else:
+                    reads.append(read2)
+
+                if self.rng.random() < args.secondary:
+                    secondary = list(read1)
+                    secondary[1] |= SECONDARY
+                    reads.append(secondary)
+
+        reads.sort(key=lambda r:r[3])
+        for read in reads:
+            f.write("\t".join(map(str, read)))
+            f.write("\n")
+
+    def run(self, f):
+        self.header(f)
+        for index in range(len(self.contigs)):
+            self.contig(index, f)
+
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a deterministic, coordinate sorted, paired end sam file for benchmarking elduderino.")
+    parser.add_argument("output", nargs="?", default="-", help="Output sam, - for stdout.")
+    parser.add_argument("--seed", type=int, default=1, help="Random seed, identical arguments always produce an identical file.")
+    parser.add_argument("--contigs", type=int, default=2, help="Number of contigs.")
+    parser.add_argument("--contig-length", type=int, default=1000000, help="Length of each contig.")
+    parser.add_argument("--depth", type=float, default=10, help="Mean depth of coverage, including duplicates.")
+    parser.add_argument("--duplication-rate", type=float, default=0.3, help="Fraction of read pairs that are duplicates.")
+    parser.add_argument("--optical-rate", type=float, default=0.05, help="Fraction of duplicates that are optical duplicates, requires --illumina.")
+    parser.add_argument("--umi", choices=["none", "prism", "thruplex"], default="none", help="Add RX umi tags.")
+    parser.add_argument("--umi-length", type=int, default=6, help="Length of each half of the umi.")
+    parser.add_argument("--read-length", type=int, default=150, help="Read length.")
+    parser.add_argument("--insert-size", type=int, default=300, help="Mean insert size.")
+    parser.add_argument("--error-rate", type=float, default=0.005, help="Per base sequencing error rate.")
+    parser.add_argument("--clipped", type=float, default=0.05, help="Fraction of reads with a soft clipped start.")
+    parser.add_argument("--mate-unmapped", type=float, default=0.01, help="Fraction of pairs with an unmapped mate.")
+    parser.add_argument("--chimeric", type=float, default=0.005, help="Fraction of pairs with mates on different contigs.")
+    parser.add_argument("--secondary", type=float, default=0.005, help="Fraction of reads with an additional secondary alignment.")
+    parser.add_argument("--targets", type=int, default=0, help="Concentrate coverage into this many targets per contig, 0 for uniform coverage.")
+    parser.add_argument("--target-width", type=int, default=200, help="Half width of each target.")
+    parser.add_argument("--illumina", action="store_true", help="Use Illumina query names so that optical duplicates are detected.")
+    args = parser.parse_args()
+
+    if not 0 <= args.duplication_rate < 1:
+        sys.exit("--duplication-rate must be at least 0 and less than 1")
+
+    if args.output == "-":
+        Generator(args).run(sys.stdout)
+    else:
+        with open(args.output, "wt") as f:
+            Generator(args).run(f)
+
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "hash.h"
+#include "mash.h"
+
+/*
+ * Microbenchmark of the tables used by elduderino, replaying the access patterns of main().
+ *
+ * unpaired: qnames are put when the first mate is seen and popped when the second arrives a
+ * random distance later, so the table churns around a steady size set by the insert size. Replayed
+ * both as separate pops and puts and as feed_records does, batches of hash_pop_or_put with the
+ * buckets and chains prefetched ahead.
+ *
+ * paired: waves of position keys, each with a geometric number of family members, are put and
+ * then either popped key by key as flush_closed does or emptied with mash_popall as dedupe_all does.
+ *
+ * functions: every function of HASH_FUNCTIONS hashes the same qnames and position keys, either
+ * generated or taken from the first reads of a sam, for its speed and for how evenly the keys fall
+ * into the buckets of a table of the size they would fill.
+ *
+ * usage: hashbench [reads] [window] [sam]
+ */
+
+
+typedef struct tablestats_t {
+    uint64_t ops;
+    double seconds;
+    uint32_t bucket_resizes;
+    uint32_t entry_resizes;
+    size_t peak_entries;
+    size_t peak_memory;
+    uint64_t probes[17]; // chain position of each entry, sampled at peak size, last bin is > 15
+    } TableStats;
+
+
+const size_t SPEED_KEYS = 4096;
+const size_t SPEED_REPEATS = 4096;
+
+
+double now(void);
+uint64_t xorshift(uint64_t *state);
+int cmp_uint64(const void *p1, const void *p2);
+void probe_histogram(uint32_t *buckets, uint32_t len_buckets, const uint32_t *next, size_t next_stride, uint64_t *histogram);
+void print_stats(const char *name, TableStats *ts);
+void bench_unpaired(size_t reads, size_t window, bool batched);
+void bench_paired(size_t reads, size_t window, bool popall);
+char *generate_keys(size_t n, size_t key_len, bool positions);
+size_t read_keys(const char *filename, size_t n, size_t key_len, char **qnames, char **positions);
+void bench_functions(const char *name, const char *keys, size_t n, size_t key_len);
+
+
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+    }
+
+
+
+uint64_t xorshift(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+    }
+
+
+
+int cmp_uint64(const void *p1, const void *p2) {
+    uint64_t a = *(const uint64_t *)p1, b = *(const uint64_t *)p2;
+    return (a > b) - (a < b);
+    }
+
+
+
+void probe_histogram(uint32_t *buckets, uint32_t len_buckets, const uint32_t *next, size_t next_stride, uint64_t *histogram) {
+    // Counts the number of entries compared to find each entry, ie its position within its chain
+    uint32_t bucket = 0, i = 0, n = 0;
+
+    memset(histogram, 0, 17 * sizeof(uint64_t));
+    for (bucket = 0; bucket < len_buckets; ++bucket) {
+        for (i = buckets[bucket], n = 1; i != UINT32_MAX; i = *(const uint32_t *)((const char *)next + (i * next_stride)), ++n) {
+            ++histogram[n < 16 ? n : 16];
+            }
+        }
+    }
+
+
+
+void print_stats(const char *name, TableStats *ts) {
+    uint64_t total = 0, weighted = 0;
+    int i = 0;
+
+    for (i = 1; i < 17; ++i) {
+        total += ts->probes[i];
+        weighted += i * ts->probes[i];
+        }
+
+    printf("%s\n", name);
+    printf("    ops              %llu\n", (unsigned long long)ts->ops);
+    printf("    ns/op            %.1f\n", ts->seconds * 1e9 / ts->ops);
+    printf("    bucket resizes   %u\n", ts->bucket_resizes);
+    printf("    entry resizes    %u\n", ts->entry_resizes);
+    printf("    peak entries     %zu\n", ts->peak_entries);
+    printf("    bytes/entry      %.1f\n", ts->peak_entries ? (double)ts->peak_memory / ts->peak_entries : 0);
+    printf("    mean probes      %.2f\n", total ? (double)weighted / total : 0);
+    printf("    probes           ");
+    for (i = 1; i < 17; ++i) {
+        printf("%s%llu", i > 1 ? " " : "", (unsigned long long)ts->probes[i]);
+        }
+    printf("\n");
+    }
+
+
+
+void bench_unpaired(size_t reads, size_t window, bool batched) {
+    // Each pair's first mate is seen at step i and its second at a random later step up to window
+    // away. As in main() every read is first popped and, if absent, put. Qnames are Illumina style
+    // strings held in one buffer as they would be within the mmap.
+    HashTable *ht = NULL;
+    TableStats ts = {0};
+    uint64_t state = 88172645463325252ULL, *events = NULL;
+    char *qnames = NULL, *qname = NULL, *ahead = NULL;
+    const void *popped = NULL;
+    size_t pairs = reads / 2, i = 0, len = 0, data_size = 0, qname_len = 48, batch = 32, distance = 8, j = 0;
+    uint32_t len_buckets = 0, len_entries = 0, hashes[32];
+    double start = 0;
+
+    if ((qnames = malloc(pairs * qname_len)) == NULL || (events = malloc(2 * pairs * sizeof(uint64_t))) == NULL ||
+        (ht = hash_new(64)) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+        }
+
+    // Events are encoded as step << 32 | pair so that sorting gives the order in which reads arrive
+    for (i = 0; i < pairs; ++i) {
+        snprintf(qnames + (i * qname_len), qname_len, "M00001:123:000000000-ABCDE:1:%u:%u:%u",
+                 (unsigned)(1101 + (xorshift(&state) % 20)), (unsigned)(xorshift(&state) % 30000), (unsigned)(xorshift(&state) % 30000));
+        events[2 * i] = ((uint64_t)i << 32) | i;
+        events[(2 * i) + 1] = ((uint64_t)(i + 1 + (xorshift(&state) % window)) << 32) | i;
+        }
+    qsort(events, 2 * pairs, sizeof(uint64_t), cmp_uint64);
+
+    len_buckets = ht->len_buckets;
+    len_entries = ht->len_entries;
+    start = now();
+    for (i = 0; i < 2 * pairs; ++i) {
+        qname = qnames + ((events[i] & UINT32_MAX) * qname_len);
+        len = strlen(qname);
+        if (batched) {
+            if (i % batch == 0) {
+                for (j = 0; j < batch && i + j < 2 * pairs; ++j) {
+                    ahead = qnames + ((events[i + j] & UINT32_MAX) * qname_len);
+                    hashes[j] = hash_key(ht, ahead, strlen(ahead));
+                    hash_prefetch_bucket(ht, hashes[j]);
+                    }
+                }
+            if ((i % batch) + distance < batch && i + distance < 2 * pairs) {
+                hash_prefetch_chain(ht, hashes[(i % batch) + distance]);
+                }
+            ts.ops += hash_pop_or_put(ht, hashes[i % batch], qname, len, qname, len, &popped, &data_size) == 0 ? 2 : 1;
+            }
+        else {
+            ++ts.ops;
+            if (hash_pop(ht, qname, len, &data_size) == NULL) {
+                hash_put(ht, qname, len, qname, len);
+                ++ts.ops;
+                }
+            }
+
+        if (ht->len_buckets != len_buckets) {
+            ++ts.bucket_resizes;
+            len_buckets = ht->len_buckets;
+            }
+        if (ht->len_entries != len_entries) {
+            ++ts.entry_resizes;
+            len_entries = ht->len_entries;
+            }
+        if (ht->entries_occupied > ts.peak_entries) {
+            ts.peak_entries = ht->entries_occupied;
+            ts.peak_memory = (ht->len_buckets * sizeof(uint32_t)) + (ht->len_entries * (sizeof(HashEntry) + sizeof(uint32_t)));
+            }
+
+        // Probe lengths are sampled once the table has reached its steady state
+        if (i == pairs) {
+            probe_histogram(ht->buckets, ht->len_buckets, &ht->entries->next, sizeof(HashEntry), ts.probes);
+            }
+        }
+    ts.seconds = now() - start;
+
+    print_stats(batched ? "unpaired (hash, batched)" : "unpaired (hash)", &ts);
+    hash_destroy(ht);
+    free(qnames);
+    free(events);
+    }
+
+
+
+void bench_paired(size_t reads, size_t window, bool popall) {
+    // Each wave puts window / 2 families of geometric size, mean 2, keyed by position strings in the
+    // format built by pair_segments, then removes them all.
+    MashTable *mt = NULL;
+    TableStats ts = {0};
+    uint64_t state = 88172645463325252ULL;
+    char key[64] = "", *keys = NULL, data[64] = {0};
+    const char *popped_key = NULL;
+    size_t families = window / 2, key_size = 0, data_size = 0, i = 0, j = 0, members = 0, n = 0, key_len = 64;
+    int32_t pos = 0;
+    uint32_t bucket = 0, len_buckets = 0, len_entries = 0;
+    double start = 0;
+
+    families = families ? families : 1;
+    if ((mt = mash_new(64)) == NULL || (keys = malloc(families * key_len)) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+        }
+
+    len_buckets = mt->len_buckets;
+    len_entries = mt->len_entries;
+    start = now();
+    while (n < reads / 2) {
+        for (i = 0; i < families; ++i) {
+            pos += 1 + (xorshift(&state) % 4);
+            snprintf(keys + (i * key_len), key_len, "chr1\t%010i\tchr1\t%010i\t%05u", (int)pos, (int)(pos + 150 + (xorshift(&state) % 300)), 0x63u);
+            key_size = strlen(keys + (i * key_len));
+            for (members = 1; xorshift(&state) % 2; ++members);
+            for (j = 0; j < members; ++j, ++n) {
+                if (mash_get(mt, keys + (i * key_len), key_size, &data_size) == NULL) {
+                    ++ts.ops;
+                    }
+                mash_put(mt, keys + (i * key_len), key_size, data, sizeof(data));
+                ++ts.ops;
+                if (mt->len_buckets != len_buckets) {
+                    ++ts.bucket_resizes;
+                    len_buckets = mt->len_buckets;
+                    }
+                if (mt->len_entries != len_entries) {
+                    ++ts.entry_resizes;
+                    len_entries = mt->len_entries;
+                    }
+                }
+            }
+
+        if (mt->entries_occupied > ts.peak_entries) {
+            ts.peak_entries = mt->entries_occupied;
+            ts.peak_memory = mash_memory(mt);
+            probe_histogram(mt->buckets, mt->len_buckets, &mt->entries->next, sizeof(MashEntry), ts.probes);
+            }
+
+        if (popall) {
+            bucket = 0;
+            popped_key = NULL;
+            while (mash_popall(mt, (const void **)&popped_key, &key_size, &data_size, &bucket) != NULL) {
+                ++ts.ops;
+                }
+            }
+        else {
+            for (i = 0; i < families; ++i) {
+                strcpy(key, keys + (i * key_len));
+                while (mash_pop(mt, key, strlen(key), &data_size) != NULL) {
+                    ++ts.ops;
+                    }
+                ++ts.ops;
+                }
+            }
+        }
+    ts.seconds = now() - start;
+
+    print_stats(popall ? "paired (mash, popall)" : "paired (mash, pop by key)", &ts);
+    mash_destroy(mt);
+    free(keys);
+    }
+
+
+
+char *generate_keys(size_t n, size_t key_len, bool positions) {
+    // n nul terminated keys, each in key_len bytes, in the formats of the qnames and position keys
+    // that bench_unpaired and bench_paired use
+    uint64_t state = 88172645463325252ULL;
+    char *keys = NULL;
+    int32_t pos = 0;
+    size_t i = 0;
+
+    if ((keys = malloc(n * key_len)) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+        }
+    for (i = 0; i < n; ++i) {
+        if (positions) {
+            pos += xorshift(&state) % 4;
+            snprintf(keys + (i * key_len), key_len, "chr1\t%010i\tchr1\t%010i\t%05u", (int)pos, (int)(pos + 150 + (xorshift(&state) % 300)), 0x63u);
+            }
+        else {
+            snprintf(keys + (i * key_len), key_len, "M00001:123:000000000-ABCDE:1:%u:%u:%u",
+                     (unsigned)(1101 + (xorshift(&state) % 20)), (unsigned)(xorshift(&state) % 30000), (unsigned)(xorshift(&state) % 30000));
+            }
+        }
+    return keys;
+    }
+
+
+
+size_t read_keys(const char *filename, size_t n, size_t key_len, char **qnames, char **positions) {
+    // Takes the qnames of the first mates of up to n pairs of a sam and their position keys,
+    // formatted as by pair_segments from the fields of the read and its mate, returns the number
+    // of pairs
+    FILE *fp = NULL;
+    char line[4096], *fields[8], *saveptr = NULL;
+    size_t i = 0, f = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL || (*qnames = malloc(n * key_len)) == NULL || (*positions = malloc(n * key_len)) == NULL) {
+        fprintf(stderr, "Error: Unable to read %s\n", filename);
+        exit(EXIT_FAILURE);
+        }
+    while (i < n && fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '@') {
+            continue;
+            }
+        for (f = 0, fields[0] = strtok_r(line, "\t", &saveptr); f < 7 && fields[f] != NULL; fields[++f] = strtok_r(NULL, "\t", &saveptr));
+        if (fields[f] == NULL || !(atoi(fields[1]) & 0x40)) {
+            continue;
+            }
+        snprintf(*qnames + (i * key_len), key_len, "%s", fields[0]);
+        snprintf(*positions + (i * key_len), key_len, "%s\t%010i\t%s\t%010i\t%05u", fields[2], atoi(fields[3]),
+                 strcmp(fields[6], "=") == 0 ? fields[2] : fields[6], atoi(fields[7]), (unsigned)(atoi(fields[1]) & 0xFF));
+        ++i;
+        }
+    fclose(fp);
+    return i;
+    }
+
+
+
+void bench_functions(const char *name, const char *keys, size_t n, size_t key_len) {
+    /*
+     * Speed is the time to hash the first SPEED_KEYS keys, already in cache, SPEED_REPEATS times.
+     * Distribution is of the low bits used as the bucket in a table grown as hash_put would, as the
+     * mean number of entries compared to find each key, compared with that were the buckets chosen
+     * uniformly at random, and as the chi squared statistic of the bucket counts divided by its
+     * degrees of freedom, which would be close to 1.
+     */
+    uint32_t *counts = NULL, len_buckets = 1, sink = 0;
+    size_t i = 0, j = 0, bytes = 0, *lens = NULL;
+    double start = 0, seconds = 0, probes = 0, chi2 = 0, expected = 0;
+    int f = 0;
+
+    for (; len_buckets < n / 0.7; len_buckets <<= 1);
+    if ((counts = malloc(len_buckets * sizeof(uint32_t))) == NULL || (lens = malloc(n * sizeof(size_t))) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+        }
+    for (i = 0; i < n; ++i) {
+        lens[i] = strlen(keys + (i * key_len));
+        bytes += lens[i];
+        }
+    expected = (double)n / len_buckets;
+
+    printf("%s, %zu keys of mean length %.1f, %u buckets, uniform mean probes %.3f\n", name, n, (double)bytes / n, (unsigned)len_buckets, 1 + (expected / 2));
+    for (f = 0; HASH_FUNCTIONS[f].name != NULL; ++f) {
+        start = now();
+        for (j = 0; j < SPEED_KEYS * SPEED_REPEATS; ++j) {
+            i = j % (n < SPEED_KEYS ? n : SPEED_KEYS);
+            sink += HASH_FUNCTIONS[f].function(keys + (i * key_len), lens[i], j);
+            }
+        seconds = now() - start;
+
+        memset(counts, 0, len_buckets * sizeof(uint32_t));
+        for (i = 0; i < n; ++i) {
+            ++counts[HASH_FUNCTIONS[f].function(keys + (i * key_len), lens[i], 0) & (len_buckets - 1)];
+            }
+        for (probes = 0, chi2 = 0, i = 0; i < len_buckets; ++i) {
+            probes += counts[i] * (counts[i] + 1) / 2.0;
+            chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+            }
+        printf("    %-8s ns/key %5.1f    mean probes %.3f    chi2/df %.3f\n", HASH_FUNCTIONS[f].name,
+               seconds * 1e9 / (SPEED_KEYS * SPEED_REPEATS), probes / n, chi2 / (len_buckets - 1));
+        }
+    if (sink == 1) {
+        // keeps the hashing from being optimised away
+        printf("\n");
+        }
+    free(counts);
+    free(lens);
+    }
+
+
+
+int main(int argc, char **argv) {
+    size_t reads = 4000000, window = 20000, n = 0, key_len = 256;
+    char *qnames = NULL, *positions = NULL;
+
+    if (argc > 1) {
+        reads = strtoul(argv[1], NULL, 10);
+        }
+    if (argc > 2) {
+        window = strtoul(argv[2], NULL, 10);
+        }
+    if (reads < 2 || window < 1) {
+        fprintf(stderr, "Error: Invalid reads or window\n");
+        exit(EXIT_FAILURE);
+        }
+
+    printf("%zu reads, window %zu\n", reads, window);
+    bench_unpaired(reads, window, false);
+    bench_unpaired(reads, window, true);
+    bench_paired(reads, window, false);
+    bench_paired(reads, window, true);
+
+    n = reads < 1000000 ? reads : 1000000;
+    if (argc > 3) {
+        if ((n = read_keys(argv[3], n, key_len, &qnames, &positions)) == 0) {
+            fprintf(stderr, "Error: No reads in %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+            }
+        }
+    else {
+        qnames = generate_keys(n, key_len, false);
+        positions = generate_keys(n, key_len, true);
+        }
+    bench_functions("qnames", qnames, n, key_len);
+    bench_functions("position keys", positions, n, key_len);
+    free(qnames);
+    free(positions);
+    return 0;
+    }
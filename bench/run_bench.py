@@ -0,0 +1,154 @@
+import argparse
+import hashlib
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+GENERATOR = os.path.join(BENCH_DIR, "generate_sam.py")
+
+# Each case is a generated sam and the elduderino arguments used to process it. Sizes are
+# multiplied by --scale.
+CASES = [
+    {"name": "wgs",
+     "generate": ["--contigs", "4", "--depth", "8", "--duplication-rate", "0.2", "--illumina"],
+     "args": []},
+    {"name": "targeted",
+     "generate": ["--contigs", "2", "--depth", "40", "--duplication-rate", "0.8", "--targets", "50"],
+     "args": []},
+    {"name": "prism",
+     "generate": ["--contigs", "2", "--depth", "20", "--duplication-rate", "0.6", "--umi", "prism"],
+     "args": ["--umi", "prism"]},
+    {"name": "thruplex",
+     "generate": ["--contigs", "2", "--depth", "20", "--duplication-rate", "0.6", "--umi", "thruplex", "--illumina"],
+     "args": ["--umi", "thruplex"]},
+    {"name": "spill",
+     "generate": ["--contigs", "1", "--depth", "200", "--duplication-rate", "0.95", "--targets", "5"],
+     "args": ["--max-memory", "1"]},
+    ]
+
+
+
+def dataset(case, workdir, scale):
+    # Generated files are cached in workdir under a name derived from the generator arguments
+    generate = case["generate"] + ["--contig-length", str(int(1000000 * scale))]
+    digest = hashlib.md5(" ".join(generate).encode()).hexdigest()[:8]
+    sam = os.path.join(workdir, "{}_{}.sam".format(case["name"], digest))
+    if not os.path.exists(sam):
+        print("Generating {}".format(sam), file=sys.stderr)
+        subprocess.run([sys.executable, GENERATOR, sam + ".tmp"] + generate, check=True)
+        os.rename(sam + ".tmp", sam)
+
+    with open(sam, "rb") as f:
+        reads = sum(1 for line in f if not line.startswith(b"@"))
+    return sam, reads, os.path.getsize(sam)
+
+
+
+def peak_rss(pid):
+    # VmHWM of a running process in KB, 0 if it has already exited
+    try:
+        with open("/proc/{}/status".format(pid)) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+
+def execute(binary, sam, args, stats):
+    # Returns elapsed seconds and peak rss in KB of a single run. ru_maxrss of the child includes the
+    # rss of this interpreter that it was forked from, so where /proc is available the high water
+    # mark of the process itself is sampled instead. Growth within the last interval is missed.
+    if os.path.exists(stats):
+        os.unlink(stats)
+    cmd = [binary, sam, "--output", "-", "--stats", stats] + args
+    sampled = os.path.exists("/proc/self/status")
+    rss = 0
+    start = time.perf_counter()
+    with open(os.devnull, "wb") as devnull:
+        proc = subprocess.Popen(cmd, stdout=devnull, stderr=subprocess.DEVNULL)
+        while True:
+            pid, status, rusage = os.wait4(proc.pid, os.WNOHANG if sampled else 0)
+            if pid != 0:
+                break
+            rss = max(rss, peak_rss(proc.pid))
+            time.sleep(0.002)
+    elapsed = time.perf_counter() - start
+    if status != 0:
+        sys.exit("{} failed".format(" ".join(cmd)))
+    return elapsed, rss if sampled else rusage.ru_maxrss
+
+
+
+def main():
+    parser = argparse.ArgumentParser(description="End to end elduderino throughput benchmark.")
+    parser.add_argument("--binary", default="./elduderino", help="elduderino binary to benchmark.")
+    parser.add_argument("--profile-binary", help="elduderino binary built with make PROFILE=1, used to report time per stage.")
+    parser.add_argument("--workdir", default=os.path.join(tempfile.gettempdir(), "elduderino_bench"), help="Directory to cache generated sam files.")
+    parser.add_argument("--scale", type=float, default=1.0, help="Multiplier for the size of every generated sam.")
+    parser.add_argument("--repeat", type=int, default=3, help="Runs per case, the fastest is reported.")
+    parser.add_argument("--cases", nargs="+", choices=[case["name"] for case in CASES], help="Only run these cases.")
+    parser.add_argument("--output", help="Write results as json.")
+    parser.add_argument("--compare", help="Json results of a previous run, exit with an error if any case regressed.")
+    parser.add_argument("--tolerance", type=float, default=0.1, help="Fractional slow down or rss increase treated as a regression.")
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    stats = os.path.join(args.workdir, "stats.json")
+
+    results = {}
+    print("{:<10} {:>10} {:>10} {:>12} {:>10} {:>10}".format("case", "reads", "MB", "reads/s", "seconds", "rss MB"))
+    for case in CASES:
+        if args.cases and case["name"] not in args.cases:
+            continue
+
+        sam, reads, size = dataset(case, args.workdir, args.scale)
+        runs = [execute(args.binary, sam, case["args"], stats) for _ in range(args.repeat)]
+        elapsed = min(run[0] for run in runs)
+        rss = max(run[1] for run in runs)
+        result = {"reads": reads,
+                  "bytes": size,
+                  "seconds": elapsed,
+                  "reads_per_second": reads / elapsed,
+                  "peak_rss_kb": rss}
+
+        if args.profile_binary:
+            execute(args.profile_binary, sam, case["args"] + ["--profile"], stats)
+            with open(stats) as f:
+                result["stage_seconds"] = json.load(f)["profile"]["stage_seconds"]
+
+        results[case["name"]] = result
+        print("{:<10} {:>10} {:>10.1f} {:>12.0f} {:>10.2f} {:>10.1f}".format(case["name"], reads, size / 1e6, result["reads_per_second"], elapsed, rss / 1024))
+        if "stage_seconds" in result:
+            print("           " + " ".join("{} {:.2f}".format(stage, seconds) for stage, seconds in result["stage_seconds"].items()))
+
+    if args.output:
+        with open(args.output, "wt") as f:
+            json.dump(results, f, indent=4)
+
+    if args.compare:
+        with open(args.compare) as f:
+            previous = json.load(f)
+        regressions = []
+        for name, result in results.items():
+            if name not in previous:
+                continue
+            if result["reads_per_second"] < previous[name]["reads_per_second"] * (1 - args.tolerance):
+                regressions.append("{} reads/s {:.0f} -> {:.0f}".format(name, previous[name]["reads_per_second"], result["reads_per_second"]))
+            if result["peak_rss_kb"] > previous[name]["peak_rss_kb"] * (1 + args.tolerance):
+                regressions.append("{} rss KB {} -> {}".format(name, previous[name]["peak_rss_kb"], result["peak_rss_kb"]))
+        if regressions:
+            sys.exit("Regressions:\n" + "\n".join(regressions))
+
+
+
+if __name__ == "__main__":
+    main()
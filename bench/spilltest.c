@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+/*
+ * Tests the external sort of spill.c through the runs it writes, which are not reachable from the
+ * command line. The records are put into a spill small enough to write several runs and must come
+ * back in key order. A run that cannot be read must then fail the merge rather than end it early,
+ * whether it is cut within a record or within the header of one.
+ *
+ * usage: spilltest
+ */
+
+
+const size_t RECORDS = 100;
+
+
+Spill *fill_spill(void);
+bool merge_spill(Spill *sp, size_t *popped);
+
+
+
+Spill *fill_spill(void) {
+    // The keys are a permutation of key000 to key099 so that every run needs sorting
+    Spill *sp = NULL;
+    char key[16];
+    size_t i = 0;
+
+    if ((sp = spill_new(64)) == NULL) {
+        fprintf(stderr, "Error: Unable to allocate spill\n");
+        exit(EXIT_FAILURE);
+        }
+    for (i = 0; i < RECORDS; ++i) {
+        sprintf(key, "key%03zu", (i * 37) % RECORDS);
+        if (spill_put(sp, key, strlen(key), "data", 4) == -1) {
+            fprintf(stderr, "Error: Unable to put record %zu\n", i);
+            exit(EXIT_FAILURE);
+            }
+        }
+    if (sp->runs_len < 2) {
+        fprintf(stderr, "Error: Only %zu runs written\n", sp->runs_len);
+        exit(EXIT_FAILURE);
+        }
+    return sp;
+    }
+
+
+
+bool merge_spill(Spill *sp, size_t *popped) {
+    // Pops every record, returns false if they are out of order or the merge failed
+    const void *key = NULL;
+    char previous[16] = "", current[16];
+    size_t key_size = 0, data_size = 0;
+    bool sorted = true;
+
+    for (*popped = 0; spill_pop(sp, &key, &key_size, &data_size) != NULL; ++*popped) {
+        if (key_size >= sizeof(current)) {
+            return false;
+            }
+        memcpy(current, key, key_size);
+        current[key_size] = '\0';
+        if (strcmp(previous, current) > 0) {
+            sorted = false;
+            }
+        strcpy(previous, current);
+        }
+    return sorted && !sp->failed;
+    }
+
+
+
+int main(void) {
+    Spill *sp = NULL;
+    off_t lengths[] = {10, 20};
+    size_t popped = 0, i = 0;
+    int failures = 0;
+
+    sp = fill_spill();
+    if (!merge_spill(sp, &popped) || popped != RECORDS) {
+        fprintf(stderr, "Failed: %zu of %zu records merged\n", popped, RECORDS);
+        ++failures;
+        }
+    spill_destroy(sp);
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        sp = fill_spill();
+        fflush(sp->runs[0].fp);
+        if (ftruncate(fileno(sp->runs[0].fp), lengths[i]) == -1) {
+            fprintf(stderr, "Error: Unable to truncate run\n");
+            exit(EXIT_FAILURE);
+            }
+        merge_spill(sp, &popped);
+        if (!sp->failed) {
+            fprintf(stderr, "Failed: run truncated to %lld bytes merged without error\n", (long long)lengths[i]);
+            ++failures;
+            }
+        spill_destroy(sp);
+        }
+
+    printf("%s\n", failures ? "Failed" : "Passed");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
@@ -4,19 +4,18 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <limits.h>
-#include <getopt.h>
 #include <ctype.h>
 #include <errno.h>
-#include <sys/mman.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <math.h>
+#include <time.h>
 
 #include "elduderino.h"
-#include "hash.h"
-#include "mash.h"
+#include "profile.h"
+
+
+#define INGEST_BATCH 32 // records parsed by feed_records before any is added
 
 
 const uint16_t UNMAPPED = 0x4;
@@ -27,6 +26,7 @@ const uint16_t READ1 = 0x40;
 const uint16_t READ2 = 0x80;
 const uint16_t SECONDARY = 0x100;
 const uint16_t FILTERED = 0x200;
+const uint16_t DUPLICATE = 0x400;
 const uint16_t SUPPPLEMENTARY = 0x800;
 const uint16_t NON_PRIMARY = 0x100 | 0x800; // SECONDARY | SUPPPLEMENTARY;
 const uint16_t BOTH_UNMAPPED = 0x4 | 0x8; // UNMAPPED | MATE_UNMAPPED;
@@ -36,455 +36,1362 @@ const uint16_t READX = 0x40 | 0x80; // READ1 | READ2;
 const char *CONSUMES_REF = "MDN=X";
 const char *CONSUMES_READ = "MIS=X";
 const char *bases = "ACGTN";
+const uint8_t BASE_CODES[256] = {['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4}; // 0 for any other base, used by count_errors
+const size_t DEFAULT_SORT_MEMORY = 1024 * 1024 * 1024; // budget for sorting pairs by position in --collated mode
+const size_t PROGRESS_CHECK_MASK = 4096 - 1; // the clock is only read every 4096 records
+const int DEFAULT_HEARTBEAT_INTERVAL = 60;
+const size_t PREFETCH_DISTANCE = 8; // records ahead of the one being added whose unpaired chain is fetched
+const size_t MARK_WRITE_INTERVAL = 16 * 1024 * 1024; // bytes fed between writes of marked records
+
+static __thread jmp_buf *error_jmp = NULL; // set by each api function, see dedupe_fail
+static __thread char error_message[256] = ""; // error raised outside of any context
 
-bool endswith(const char *text, const char *suffix);
 const char *parse_segment(const char *sam, const char *sam_end, Segment *segment);
 void segment_fprintf(Segment segment, FILE *fp);
 int32_t cigar_len(const char *cigar, size_t cigar_len, const char *ops);
 int cmp_cigars(const void *p1, const void *p2);
+int cmp_cigars_qnames(const void *p1, const void *p2);
 int cmp_barcodes(const void *p1, const void *p2);
+int cmp_barcodes_qnames(const void *p1, const void *p2);
 int cmp_qnames(const void *p1, const void *p2);
 int cmp_irflts(const void *p1, const void *p2);
+int cmp_irflts_qnames(const void *p1, const void *p2);
 int cmp_int(const void *p1, const void *p2);
-void dedupe_all(Dedupe *dd, MashTable *paired, dedupe_function_t dedupe_function);
+void dedupe_all(Dedupe *dd, MashTable *paired, Spill *spill, dedupe_function_t dedupe_function);
+void add_family_member(Dedupe *dd, ReadPair *readpair, size_t i);
+void dedupe_family(Dedupe *dd, const char *key, size_t key_size, size_t readpair_len, dedupe_function_t dedupe_function);
+void flush_queue_push(FlushQueue *fq, int32_t close_pos, const char *key, size_t key_size);
+void flush_queue_pop(FlushQueue *fq);
+void flush_closed(Dedupe *dd, MashTable *paired, Spill *spill, FlushQueue *fq, int32_t pos, dedupe_function_t dedupe_function);
+void flush_all(Dedupe *dd, MashTable *paired, Spill *spill, FlushQueue *fq, dedupe_function_t dedupe_function);
+MashTable *spill_window(Dedupe *dd, MashTable *paired, Spill *spill);
+void spill_readpair(Dedupe *dd, Spill *spill, const char *key, size_t key_size, ReadPair *readpair);
+void unspill_readpair(SpilledPair *spilled, ReadPair *readpair);
+void track_sources(Dedupe *dd, const RecordRun *runs, size_t runs_len);
+size_t record_source(Dedupe *dd, const char *record);
 void copy_sequence_to_buffer(Dedupe *dd, ReadPair *family, size_t family_size);
 void barcode_families(Dedupe *dd, ReadPair *family, size_t family_size);
 void connor_families(Dedupe *dd, ReadPair *family, size_t family_size);
+void duplex_families(Dedupe *dd, ReadPair *family, size_t family_size);
+void duplex_family(Dedupe *dd, ReadPair *molecule, size_t molecule_size);
+bool b_strand(const ReadPair *readpair);
+bool same_umi_half(const ReadPair *r1, const ReadPair *r2, int half);
+void umi_half(const ReadPair *readpair, int half, const char **umi, size_t *umi_len);
+void write_duplex(Dedupe *dd);
+const char *split_fastq(const char *record, const char *end, const char **lines, size_t *lens);
 void cigar_family(Dedupe *dd, ReadPair *family, size_t family_size);
 void tile_families(Dedupe *dd, ReadPair *family, size_t family_size);
+void find_irflt(ReadPair *readpair);
 size_t coordinate_families(Dedupe *dd, ReadPair *family, size_t family_size);
 void dedupe_optical(Dedupe *dd, ReadPair *family, size_t family_size);
 void dedupe_pcr(Dedupe *dd, ReadPair *family, size_t family_size);
+void call_base(int *counts, int *quals, size_t sixty_percent_family_size, char *seq, char *qual, int *mismatches, int *total);
+void call_base_likelihood(const QualityModel *model, int *counts, int *scores, char *seq, char *qual, int *mismatches, int *total);
+void quality_model_init(QualityModel *model, bool likelihood);
+void write_fastq(Dedupe *dd, Segment *segment, size_t family_size, char *seq, char *qual, size_t len);
+void consensus_add(Dedupe *dd, ReadPair *readpair);
+void consensus_finish(Dedupe *dd);
+void count_family_size(Dedupe *dd, size_t family_size, uint32_t subsample_hash);
+uint32_t subsample_hash(const char *qname, size_t qname_len);
 void trim_family(Dedupe *dd, ReadPair *family, size_t family_size);
+void count_errors(Dedupe *dd, ReadPair *family, size_t family_size);
+bool overlap_family(ReadPair *family, size_t family_size, int *left, int *right, int32_t *left_start, int32_t *right_end);
+void dedupe_single(Dedupe *dd, ReadPair *readpair);
+void read_order(ReadPair *readpair, int *r1r2);
+void write_output(Dedupe *dd, const char *data, size_t len);
 int base(char base);
 void reverse(char *start, int len);
 void reversecomplement(char *start, int len);
+void reverse_copy(char *dest, const char *src, int len);
+void reversecomplement_copy(char *dest, const char *src, int len);
 char reversebase(char base);
 const char *cigar_op(const char *cigar, const char **op, int32_t *num);
-void write_stats(const char *stats_filename, Dedupe *dd);
-int guess_optical_distance(const char *sam,  const char *sam_end);
+double monotonic_seconds(void);
+void report_progress(Progress *pg, Dedupe *dd, size_t offset, const char *rname, size_t rname_len, size_t unpaired, size_t window, bool finished);
+int32_t pair_segments(Segment mate_segment, Segment segment, uint16_t key_flags, ReadPair *readpair, char **position, size_t *position_len, size_t *max_position_len);
+int cmp_coordinates(const Segment *s1, const Segment *s2);
+void dedupe_fail(const char *format, ...);
+void dedupe_stop(Dedupe *dd);
+int leave_api(Dedupe *dd, jmp_buf *outer_jmp);
+void start_records(Dedupe *dd, const char **records, const char *records_end);
+void feed_records(Dedupe *dd, const RecordRun *runs, size_t runs_len);
+void add_collated(Dedupe *dd, Segment segment);
+void add_sorted(Dedupe *dd, Segment segment, uint32_t qname_hash);
+void mate_queue_push(MateQueue *mq, int32_t mate_pos, const char *qname, size_t qname_len);
+void mate_queue_pop(MateQueue *mq);
+void expire_unpaired(Dedupe *dd, int32_t pos);
+ContigMates *contig_mates(Dedupe *dd, const char *name, size_t name_len);
+void track_unpaired(Dedupe *dd, const Segment *segment);
+void enter_contig(Dedupe *dd, const char *rname, size_t rname_len);
+void pending_references(const Dedupe *dd, dedupe_reference_t reference, void *context);
+void keep_family_records(Dedupe *dd, const ReadPair *family, size_t family_size);
+void mark_family(Dedupe *dd, const ReadPair *kept);
+void queue_unwritten(Dedupe *dd, const RecordRun *runs, size_t runs_len);
+void add_pending_range(void *context, const char *start, const char *end);
+int cmp_ranges(const void *p1, const void *p2);
+void write_marked(Dedupe *dd, bool flushed);
+void write_records_marked(Dedupe *dd, const char *records, const char *end);
+
+
+
+void dedupe_fail(const char *format, ...) {
+    // Abandons the current api call, which returns an error with this message. Outside of an api
+    // call it exits as the command line program always has.
+    va_list args;
+    
+    va_start(args, format);
+    vsnprintf(error_message, sizeof(error_message), format, args);
+    va_end(args);
+    if (error_jmp == NULL) {
+        fprintf(stderr, "Error: %s\n", error_message);
+        exit(EXIT_FAILURE);
+        }
+    longjmp(*error_jmp, 1);
+    }
 
 
 
-int main (int argc, char **argv) {
-    /*
-     * 
-     */
-    const char *input_filename = NULL, *output_filename = NULL, *stats_filename = "stats.json";
-    
-    int sam_fd = -1;
-    size_t sam_len = 0;
-    const char *sam_start = NULL, *sam_end = NULL, *sam = NULL, *next = NULL;
-    
-    const char *mate = NULL, *current_rname = "", *sort_check_rname = "";
-    char *position = NULL;
-    size_t current_rname_len = 0, sort_check_rname_len = 0, len = 0, max_position_len = 0, position_len = 0;
-    int32_t max_pos = 0, max_pos2 = 0, sort_check_pos = 0, segment_begin = 0, mate_begin = 0;
-    HashTable *unpaired = NULL;
-    MashTable *paired = NULL, *paired2 = NULL;
-    Segment segment = {0}, mate_segment = {0}, swap_segment = {0};
-    ReadPair readpair = {0};
+void dedupe_stop(Dedupe *dd) {
+    // Abandons the current api call successfully, nothing further will be processed
+    dd->done = true;
+    if (error_jmp == NULL) {
+        exit(EXIT_SUCCESS);
+        }
+    longjmp(*error_jmp, 1);
+    }
+
+
+
+int leave_api(Dedupe *dd, jmp_buf *outer_jmp) {
+    // Called when an api call has been abandoned by dedupe_fail or dedupe_stop
+    error_jmp = outer_jmp;
+    if (dd->done) {
+        return 0;
+        }
+    dd->failed = true;
+    strcpy(dd->error_message, error_message);
+    return -1;
+    }
+
+
+
+Dedupe *dedupe_new(const DedupeOptions *options) {
+    Dedupe *dd = NULL;
+    hash_function_t hash_function = DEFAULT_HASH_FUNCTION;
     
-    bool disable_optical_duplicates = false;
-    dedupe_function_t dedupe_function = cigar_family;
-    Dedupe dd = {0};
+    if ((dd = calloc(1, sizeof(Dedupe))) == NULL) {
+        snprintf(error_message, sizeof(error_message), "Unable to allocate memory for context");
+        return NULL;
+        }
     
-    // variable needed by strtol
-    char *endptr = NULL;
-    long val = 0;
-    // variables needed by getopt_long
-    int option_index = 0, c = 0;
-    static struct option long_options[] = {{"output", required_argument, 0, 'o'},
-                                           {"stats", required_argument, 0, 's'},
-                                           {"umi", required_argument, 0, 'u'},
-                                           {"min-family-size", required_argument, 0, 'm'},
-                                           {"optical-duplicate-distance", required_argument, 0, 'p'},
-                                           {"print-family-members", required_argument, 0, 'P'},
-                                           {0, 0, 0, 0}};
-
-    // Parse optional arguments
-    while (c != -1) {
-        c = getopt_long(argc, argv, "o:s:u:m:p:P:", long_options, &option_index);
-
-        switch (c) {
-            case 'P':
-                dd.print_family_members = optarg;
-                break;
-                
-            case 'o':
-                if ((!endswith(optarg, ".fastq")) && (strcmp(optarg, "-") != 0)) {
-                    fprintf(stderr, "Error: Output file must be of type fastq\n");
-                    exit(EXIT_FAILURE);
-                    }
-                output_filename = optarg;
-                break;
-                
-            case 's':
-                if (!endswith(optarg, ".json")) {
-                    fprintf(stderr, "Error: Stats file must be of type json\n");
-                    exit(EXIT_FAILURE);
-                    }
-                stats_filename = optarg;
-                break;
-            
-            case 'm':
-                errno = 0;
-                val = strtol(optarg, &endptr, 10);
-                if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg)) {
-                    fprintf(stderr, "Error: Invalid --min-family-size\n");
-                    exit(EXIT_FAILURE);
-                    }
-                dd.min_family_size = (size_t)val;
-                break;                
-                
-            case 'p':
-                if (strcmp(optarg, "disable") == 0) {
-                    disable_optical_duplicates = true;
-                    }
-                else {
-                    errno = 0;
-                    val = strtol(optarg, &endptr, 10);
-                    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg) || val > INT_MAX - 1) {
-                        fprintf(stderr, "Error: Invalid --optical-duplicate-distance\n");
-                        exit(EXIT_FAILURE);
+    dd->dedupe_function = cigar_family;
+    if (options->umi != NULL && strcmp(options->umi, "thruplex") == 0) {
+        dd->dedupe_function = connor_families;
+        }
+    else if (options->umi != NULL && (strcmp(options->umi, "thruplex_hv") == 0 || strcmp(options->umi, "prism") == 0)) {
+        dd->dedupe_function = barcode_families;
+        }
+    else if (options->umi != NULL && strcmp(options->umi, "") != 0) {
+        snprintf(error_message, sizeof(error_message), "Unsupported umi type: %s", options->umi);
+        dedupe_destroy(dd);
+        return NULL;
+        }
+    if (options->duplex && (options->umi == NULL || strcmp(options->umi, "") == 0)) {
+        snprintf(error_message, sizeof(error_message), "Duplex consensus requires a umi");
+        dedupe_destroy(dd);
+        return NULL;
+        }
+    if (options->mark_duplicates && (options->stats_only || options->print_family_members != NULL)) {
+        snprintf(error_message, sizeof(error_message), "Duplicates cannot be marked with stats_only or print_family_members");
+        dedupe_destroy(dd);
+        return NULL;
+        }
+    if (options->hash_function != NULL && (hash_function = hash_function_named(options->hash_function)) == NULL) {
+        snprintf(error_message, sizeof(error_message), "Unsupported hash function: %s", options->hash_function);
+        dedupe_destroy(dd);
+        return NULL;
+        }
+    
+    // Both strands of a duplex molecule share a position key, they differ only in which read is first
+    dd->key_flags = READXREVERSEXUNMAPPEDX;
+    if (options->duplex) {
+        dd->dedupe_function = duplex_families;
+        dd->key_flags &= ~READX;
+        }
+    dd->duplex_strand = -1;
+    quality_model_init(&dd->model, options->likelihood_consensus);
+    
+    dd->min_family_size = options->min_family_size;
+    dd->print_family_members = options->print_family_members;
+    dd->family_index = options->family_index;
+    // Marking needs only the decisions of each family, as stats only mode does, never a consensus
+    dd->stats_only = options->stats_only || options->mark_duplicates;
+    dd->mark_duplicates = options->mark_duplicates;
+    dd->max_memory = options->max_memory;
+    dd->collated = options->collated;
+    dd->output_file = options->output_file != NULL ? options->output_file : stdout;
+    dd->output = options->output;
+    dd->output_context = options->output_context;
+    if (options->optical_duplicate_distance > 0) {
+        dd->optical_duplicate_distance = options->optical_duplicate_distance;
+        }
+    dd->guess_optical_distance = options->optical_duplicate_distance == 0;
+    
+    dd->unpaired = hash_new(64);
+    dd->paired = mash_new(64);
+    dd->contigs = hash_new(64);
+    if (dd->collated) {
+        // Every pair passes through spill to be sorted by position therefore the whole budget is used
+        dd->spill = spill_new(dd->max_memory ? dd->max_memory : DEFAULT_SORT_MEMORY);
+        }
+    else {
+        // Spilled runs are held in memory until they reach a quarter of the budget
+        dd->spill = spill_new(dd->max_memory / 4);
+        }
+    if (dd->mark_duplicates) {
+        dd->duplicates = mash_new(64);
+        }
+    if (dd->unpaired == NULL || dd->paired == NULL || dd->contigs == NULL || dd->spill == NULL || (dd->mark_duplicates && dd->duplicates == NULL)) {
+        snprintf(error_message, sizeof(error_message), "Unable to allocate memory for hash tables");
+        dedupe_destroy(dd);
+        return NULL;
+        }
+    dd->unpaired->hash_function = dd->paired->hash_function = hash_function;
+    dd->unpaired->seed = dd->paired->seed = options->hash_seed;
+    if (dd->mark_duplicates) {
+        dd->duplicates->hash_function = hash_function;
+        dd->duplicates->seed = options->hash_seed;
+        }
+    dd->spill_threshold = dd->max_memory;
+    dd->sort_check_rname = "";
+    
+    dd->progress.interval = options->progress_interval;
+    dd->progress.print = options->print_progress;
+    dd->progress.heartbeat_filename = options->heartbeat_filename;
+    if (dd->progress.heartbeat_filename != NULL && dd->progress.interval == 0) {
+        dd->progress.interval = DEFAULT_HEARTBEAT_INTERVAL;
+        }
+    dd->progress.total_bytes = options->input_size;
+    dd->progress.start = dd->progress.last = monotonic_seconds();
+    return dd;
+    }
+
+
+
+int dedupe_feed(Dedupe *dd, const char *records, size_t len) {
+    RecordRun run = {records, len, 0};
+    
+    return dedupe_feed_runs(dd, &run, 1);
+    }
+
+
+
+int dedupe_feed_runs(Dedupe *dd, const RecordRun *runs, size_t runs_len) {
+    jmp_buf env, *outer_jmp = error_jmp;
+    size_t i = 0;
+    
+    if (dd->failed) {
+        return -1;
+        }
+    if (dd->done) {
+        return 0;
+        }
+    if (setjmp(env) != 0) {
+        return leave_api(dd, outer_jmp);
+        }
+    error_jmp = &env;
+    
+    if (dd->flushed) {
+        dedupe_fail("Records fed after flush");
+        }
+    track_sources(dd, runs, runs_len);
+    if (dd->mark_duplicates) {
+        queue_unwritten(dd, runs, runs_len);
+        }
+    feed_records(dd, runs, runs_len);
+    for (i = 0; i < runs_len; ++i) {
+        dd->progress.bytes += runs[i].len;
+        dd->unwritten_fed += runs[i].len;
+        }
+    if (dd->mark_duplicates && dd->unwritten_fed >= MARK_WRITE_INTERVAL) {
+        write_marked(dd, false);
+        }
+    
+    error_jmp = outer_jmp;
+    return 0;
+    }
+
+
+
+int dedupe_flush(Dedupe *dd) {
+    // Dedupes every remaining family, no further records may be fed
+    jmp_buf env, *outer_jmp = error_jmp;
+    uint32_t i = 0;
+    
+    if (dd->failed) {
+        return -1;
+        }
+    if (dd->done || dd->flushed) {
+        return 0;
+        }
+    if (setjmp(env) != 0) {
+        return leave_api(dd, outer_jmp);
+        }
+    error_jmp = &env;
+    
+    flush_all(dd, dd->paired, dd->spill, &dd->open_families, dd->dedupe_function);
+    dd->flushed = true;
+    
+    // Reads still waiting, including those whose mates are on contigs that were never reached
+    dd->stats.orphans += dd->unpaired->entries_occupied + dd->pending;
+    for (i = 0; i < dd->contigs->len_entries; ++i) {
+        if (dd->contigs->entries[i].key != NULL) {
+            dd->stats.orphans += ((const ContigMates *)dd->contigs->entries[i].data)->len;
+            }
+        }
+    if (dd->mark_duplicates) {
+        write_marked(dd, true);
+        }
+    if (dd->progress.interval > 0) {
+        report_progress(&dd->progress, dd, dd->progress.bytes, "", 0, dd->unpaired->entries_occupied, dd->paired->entries_occupied + dd->spill->records, true);
+        }
+    
+    error_jmp = outer_jmp;
+    return 0;
+    }
+
+
+
+int dedupe_write_stats(Dedupe *dd, const char *stats_filename) {
+    jmp_buf env, *outer_jmp = error_jmp;
+    
+    if (dd->failed) {
+        return -1;
+        }
+    if (setjmp(env) != 0) {
+        return leave_api(dd, outer_jmp);
+        }
+    error_jmp = &env;
+    
+    if (stats_write(&dd->stats, stats_filename) == -1) {
+        dedupe_fail("Unable to write %s, it must be absent, empty or contain a single json object", stats_filename);
+        }
+    
+    error_jmp = outer_jmp;
+    return 0;
+    }
+
+
+
+void dedupe_references(const Dedupe *dd, dedupe_reference_t reference, void *context) {
+    // Reports every part of the fed buffers that may still be read, anything else may be released
+    // before dedupe_flush. Spilled records are reported as the single range that bounds them.
+    size_t i = 0;
+    
+    pending_references(dd, reference, context);
+    for (i = 0; i < dd->unwritten_len; ++i) {
+        reference(context, dd->unwritten[i].records, dd->unwritten[i].records + dd->unwritten[i].len);
+        }
+    if (dd->sort_check_rname_len > 0) {
+        reference(context, dd->sort_check_rname, dd->sort_check_rname + dd->sort_check_rname_len);
+        }
+    }
+
+
+
+void pending_references(const Dedupe *dd, dedupe_reference_t reference, void *context) {
+    // Reports the records of reads and families that are still waiting to be deduped
+    const HashEntry *entry = NULL;
+    const ReadPair *readpair = NULL;
+    const ContigMates *contig = NULL;
+    uint32_t bucket = 0, i = 0;
+    size_t m = 0;
+    int s = 0;
+    
+    for (bucket = 0; bucket < dd->unpaired->len_buckets; ++bucket) {
+        for (i = dd->unpaired->buckets[bucket]; i != UINT32_MAX; i = entry->next) {
+            entry = dd->unpaired->entries + i;
+            reference(context, entry->data, (const char *)entry->data + entry->data_size);
+            }
+        }
+    for (bucket = 0; bucket < dd->paired->len_buckets; ++bucket) {
+        for (i = dd->paired->buckets[bucket]; i != UINT32_MAX; i = dd->paired->entries[i].next) {
+            readpair = (const ReadPair *)((const char *)dd->paired->data + (i * dd->paired->max_data_len));
+            for (s = 0; s < 2; ++s) {
+                reference(context, readpair->segment[s].qname, readpair->segment[s].qname + readpair->segment[s].len);
+                }
+            }
+        }
+    for (i = 0; i < dd->expected_mates.len; ++i) {
+        reference(context, dd->expected_mates.mates[i].qname, dd->expected_mates.mates[i].qname + dd->expected_mates.mates[i].qname_len);
+        }
+    for (i = 0; i < dd->contigs->len_entries; ++i) {
+        if ((contig = dd->contigs->entries[i].data) != NULL) {
+            for (m = 0; m < contig->len; ++m) {
+                reference(context, contig->mates[m].record, contig->mates[m].record + contig->mates[m].len);
+                }
+            }
+        }
+    for (i = 0; dd->spill->records > 0 && i < dd->sources_len; ++i) {
+        if (dd->sources[i].spilled_start != NULL) {
+            reference(context, dd->sources[i].spilled_start, dd->sources[i].spilled_end);
+            }
+        }
+    if (dd->pending) {
+        reference(context, dd->mate_segment.qname, dd->mate_segment.qname + dd->mate_segment.len);
+        }
+    }
+
+
+
+const char *dedupe_error_message(const Dedupe *dd) {
+    // Without a context returns the reason that dedupe_new failed on this thread
+    return dd != NULL ? dd->error_message : error_message;
+    }
+
+
+
+void dedupe_destroy(Dedupe *dd) {
+    size_t i = 0;
+    
+    if (dd == NULL) {
+        return;
+        }
+    free(dd->position);
+    free(dd->record);
+    free(dd->readpairs);
+    free(dd->spilled_key);
+    free(dd->buffer);
+    free(dd->error_counts);
+    free(dd->family_records);
+    free(dd->unwritten);
+    free(dd->pending_ranges);
+    free(dd->sources);
+    free(dd->duplex_held[0]);
+    free(dd->duplex_held[1]);
+    if (dd->duplicates != NULL) {
+        mash_destroy(dd->duplicates);
+        }
+    stats_destroy(&dd->stats);
+    for (i = 0; i < dd->max_consensus_len; ++i) {
+        free(dd->consensus[i].counts);
+        free(dd->consensus[i].quals);
+        }
+    free(dd->consensus);
+    for (i = 0; i < dd->open_families.len; ++i) {
+        free(dd->open_families.families[i].key);
+        }
+    free(dd->open_families.families);
+    if (dd->unpaired != NULL) {
+        hash_destroy(dd->unpaired);
+        }
+    free(dd->expected_mates.mates);
+    if (dd->contigs != NULL) {
+        for (i = 0; i < dd->contigs->len_entries; ++i) {
+            if (dd->contigs->entries[i].key != NULL) {
+                free(((ContigMates *)dd->contigs->entries[i].data)->mates);
+                free((void *)dd->contigs->entries[i].data);
+                }
+            }
+        hash_destroy(dd->contigs);
+        }
+    if (dd->paired != NULL) {
+        mash_destroy(dd->paired);
+        }
+    if (dd->spill != NULL) {
+        spill_destroy(dd->spill);
+        }
+    free(dd);
+    }
+
+
+
+void start_records(Dedupe *dd, const char **records, const char *records_end) {
+    // Moves past the header to the first read, at which the context is started. The header may
+    // continue beyond records_end.
+    const char *sam = *records;
+    
+    // Move past all comments to first read
+    for (; sam < records_end; ++sam) {
+        if (*sam != '@') {
+            break;
+            }
+        for (; sam < records_end && *sam != '\n'; ++sam);
+        }
+    *records = sam;
+    if (sam >= records_end) {
+        return;
+        }
+    
+    if (dd->guess_optical_distance) {
+        dd->optical_duplicate_distance = guess_optical_distance(sam, records_end);
+        }
+    
+    // Grouping by umi or optical duplicates needs the whole family at once, otherwise the
+    // consensus can be built as members arrive
+    dd->streaming = dd->dedupe_function == cigar_family && dd->optical_duplicate_distance == 0 && dd->print_family_members == NULL && !dd->stats_only;
+    dd->stats.optical = dd->optical_duplicate_distance != 0;
+    dd->started = true;
+    }
+
+
+
+void feed_records(Dedupe *dd, const RecordRun *runs, size_t runs_len) {
+    const char *sam = NULL, *records_end = NULL, *next = NULL;
+    Segment batch[INGEST_BATCH];
+    uint32_t hashes[INGEST_BATCH];
+    size_t offsets[INGEST_BATCH]; // of each record from the first run, for progress
+    size_t batch_len = 0, i = 0, run = 0, run_offset = 0;
+    
+    if (runs_len == 0) {
+        return;
+        }
+    sam = runs[0].records;
+    records_end = sam + runs[0].len;
+    if (!dd->started) {
+        start_records(dd, &sam, records_end);
+        }
+    
+    while (run < runs_len) {
+        // Records are parsed a batch at a time so that the unpaired table lookups of a batch, each
+        // otherwise a cache miss stalling on the last, are in flight together. They are still added
+        // in order, the bucket of every record is requested as it is parsed and its chain a few
+        // records before it is added. A batch continues across runs, which may be only a few
+        // records long.
+        for (batch_len = 0; batch_len < INGEST_BATCH && run < runs_len;) {
+            if (sam >= records_end) {
+                run_offset += runs[run].len;
+                if (++run < runs_len) {
+                    sam = runs[run].records;
+                    records_end = sam + runs[run].len;
+                    if (!dd->started) {
+                        start_records(dd, &sam, records_end);
                         }
-                    dd.optical_duplicate_distance = (int)val + 1;
-                    }
-                break;
-                
-            case 'u':
-                if (strcmp(optarg, "thruplex") == 0) {
-                    dedupe_function = connor_families;
                     }
-                else if (strcmp(optarg, "thruplex_hv") == 0 || strcmp(optarg, "prism") == 0) {
-                    dedupe_function = barcode_families;
-                    }
-                else if (strcmp(optarg, "") != 0) {
-                    fprintf(stderr, "Error: Unsupported umi type: %s\n", optarg);
-                    exit(EXIT_FAILURE);
+                continue;
+                }
+            
+            PROFILE_START(parse_timer);
+            next = parse_segment(sam, records_end, batch + batch_len);
+            PROFILE_STOP(STAGE_PARSE, parse_timer);
+            PROFILE_COUNT(COUNT_RECORDS, 1);
+            PROFILE_COUNT(COUNT_BYTES, next - sam);
+            offsets[batch_len] = run_offset + (sam - runs[run].records);
+            if (!dd->collated) {
+                hashes[batch_len] = hash_key(dd->unpaired, batch[batch_len].qname, batch[batch_len].qname_len);
+                hash_prefetch_bucket(dd->unpaired, hashes[batch_len]);
+                }
+            ++batch_len;
+            sam = next;
+            }
+        
+        for (i = 0; i < batch_len; ++i) {
+            if (dd->progress.interval > 0 && (++dd->progress.records & PROGRESS_CHECK_MASK) == 0) {
+                report_progress(&dd->progress, dd, dd->progress.bytes + offsets[i], batch[i].rname, batch[i].rname_len, dd->unpaired->entries_occupied,
+                                dd->collated ? dd->spill->records : dd->paired->entries_occupied, false);
+                }
+            
+            if (dd->collated) {
+                add_collated(dd, batch[i]);
+                }
+            else {
+                if (i + PREFETCH_DISTANCE < batch_len) {
+                    hash_prefetch_chain(dd->unpaired, hashes[i + PREFETCH_DISTANCE]);
                     }
-                break;
-                
-            case '?':
-                // unknown option, getopt_long already printed an error message.
-                exit(EXIT_FAILURE);
+                add_sorted(dd, batch[i], hashes[i]);
+                }
             }
         }
+    }
+
+
+
+void add_collated(Dedupe *dd, Segment segment) {
+    // Mates of a query name collated sam are adjacent, therefore no unpaired table is needed. Families
+    // are instead grouped by writing every pair to spill and reading them back in position order.
+    Segment mate_segment = {0};
+    ReadPair readpair = {0};
     
-    if (argc - optind != 1) {
-        fprintf(stderr, "Error: No input file supplied\n");
-        exit(EXIT_FAILURE);
+    // Skip secondary, supplementary and completely unmapped reads
+    if ((segment.flag & NON_PRIMARY) || ((segment.flag & BOTH_UNMAPPED) == BOTH_UNMAPPED)) {
+        return;
         }
-    input_filename = *(argv + optind);
-    if (!endswith(input_filename, ".sam")) {
-        fprintf(stderr, "Error: Input file must be of type sam\n");
-        exit(EXIT_FAILURE);
+    
+    // If the previous read is not the mate of this one then its mate was filtered and it is dropped
+    if (!dd->pending || segment.qname_len != dd->mate_segment.qname_len || memcmp(segment.qname, dd->mate_segment.qname, segment.qname_len) != 0) {
+        dd->stats.orphans += dd->pending;
+        dd->mate_segment = segment;
+        dd->pending = true;
+        return;
         }
+    dd->pending = false;
     
+    mate_segment = dd->mate_segment;
+    if (cmp_coordinates(&segment, &mate_segment) < 0) {
+        mate_segment = segment;
+        segment = dd->mate_segment;
+        }
+    pair_segments(mate_segment, segment, dd->key_flags, &readpair, &dd->position, &dd->position_len, &dd->max_position_len);
+    PROFILE_COUNT(COUNT_PAIRS, 1);
+    spill_readpair(dd, dd->spill, dd->position, dd->position_len, &readpair);
+    }
+
+
+
+void add_sorted(Dedupe *dd, Segment segment, uint32_t qname_hash) {
+    // qname_hash is hash_key of the qname in the unpaired table
+    const char *mate = NULL;
+    size_t len = 0;
+    int popped = 0;
+    int32_t close_pos = 0;
+    Segment mate_segment = {0};
+    ReadPair readpair = {0};
     
-    if ((sam_fd = open(input_filename, O_RDONLY)) == -1) {
-        fprintf(stderr, "Error: Unable to open %s\n", input_filename);
-        exit(EXIT_FAILURE);
+    // Sanity check to ensure that sam file is sorted by position
+    if (segment.rname_len == dd->sort_check_rname_len && memcmp(segment.rname, dd->sort_check_rname, dd->sort_check_rname_len) == 0) {
+        if (segment.pos < dd->sort_check_pos) {
+            dedupe_fail("Sam file must be sorted by position");
+            }
+        }
+    else {
+        // No family can span contigs therefore all are complete
+        flush_all(dd, dd->paired, dd->spill, &dd->open_families, dd->dedupe_function);
+        enter_contig(dd, segment.rname, segment.rname_len);
+        dd->sort_check_rname = segment.rname;
+        dd->sort_check_rname_len = segment.rname_len;
         }
+    dd->sort_check_pos = segment.pos;
     
-    sam_len = (size_t)lseek(sam_fd, 0, SEEK_END);
-    if (sam_len == 0) {
-        fprintf(stderr, "Error: Empty sam file\n");
-        exit(EXIT_FAILURE);
+    // Families are deduped as soon as the position is reached beyond which no further members can be found
+    if (dd->open_families.len > 0 && dd->open_families.families[0].close_pos < segment.pos) {
+        flush_closed(dd, dd->paired, dd->spill, &dd->open_families, segment.pos, dd->dedupe_function);
         }
-    lseek(sam_fd, 0, SEEK_SET);
-    if ((sam_start = mmap(NULL, sam_len, PROT_READ, MAP_PRIVATE, sam_fd, 0)) == NULL) {
-        fprintf(stderr, "Error: Unable to memory map sam file\n");
-        exit(EXIT_FAILURE);
+    if (dd->expected_mates.len > 0 && dd->expected_mates.mates[0].mate_pos < segment.pos) {
+        expire_unpaired(dd, segment.pos);
         }
     
-    if (output_filename == NULL || strcmp(output_filename, "-") == 0) {
-        dd.output_file = stdout;
+    // Skip secondary, supplementary and completely unmapped reads
+    if ((segment.flag & NON_PRIMARY) || ((segment.flag & BOTH_UNMAPPED) == BOTH_UNMAPPED)) {
+        return;
         }
-    else {
-        if ((dd.output_file = fopen(output_filename, "w")) == NULL) {
-            fprintf(stderr, "Error: Unable to open %s for writing\n", output_filename);
-            exit(EXIT_FAILURE);
+    
+    // Do we have a pair of reads yet? If not store this read and move on to the next
+    PROFILE_START(unpaired_timer);
+    if ((popped = hash_pop_or_put(dd->unpaired, qname_hash, segment.qname, segment.qname_len, segment.qname, segment.len, (const void **)&mate, &len)) == -1) {
+        dedupe_fail("Unable to add qname to unpaired hash table");
+        }
+    if (popped == 0) {
+        track_unpaired(dd, &segment);
+        PROFILE_STOP(STAGE_UNPAIRED, unpaired_timer);
+        PROFILE_PEAK(peak_unpaired, dd->unpaired->entries_occupied);
+        return;
+        }
+    PROFILE_STOP(STAGE_UNPAIRED, unpaired_timer);
+    
+    PROFILE_START(paired_timer);
+    parse_segment(mate, mate + len, &mate_segment);
+    close_pos = pair_segments(mate_segment, segment, dd->key_flags, &readpair, &dd->position, &dd->position_len, &dd->max_position_len);
+    
+    if (mash_get(dd->paired, dd->position, dd->position_len, &len) == NULL) {
+        flush_queue_push(&dd->open_families, close_pos, dd->position, dd->position_len);
+        }
+    if (mash_put(dd->paired, dd->position, dd->position_len, &readpair, sizeof(ReadPair)) == -1) {
+        dedupe_fail("Unable to to add position to paired hash table");
+        }
+    PROFILE_STOP(STAGE_PAIRED, paired_timer);
+    PROFILE_COUNT(COUNT_PAIRS, 1);
+    PROFILE_PEAK(peak_paired, dd->paired->entries_occupied);
+    PROFILE_PEAK(peak_paired_bytes, mash_memory(dd->paired));
+    PROFILE_PEAK(peak_open_families, dd->open_families.len);
+    
+    // Once over budget move all but the first member of each family to disk. The threshold then
+    // rises to twice what remains so that many small families don't spill on every read
+    if (dd->max_memory > 0 && mash_memory(dd->paired) > dd->spill_threshold) {
+        PROFILE_START(spill_timer);
+        dd->paired = spill_window(dd, dd->paired, dd->spill);
+        PROFILE_STOP(STAGE_SPILL, spill_timer);
+        dd->spill_threshold = mash_memory(dd->paired) * 2;
+        if (dd->spill_threshold < dd->max_memory) {
+            dd->spill_threshold = dd->max_memory;
             }
         }
+    }
+
+
+
+void track_unpaired(Dedupe *dd, const Segment *segment) {
+    /*
+     * Decides how long a read just added to unpaired can wait. A mate on this contig is expected at
+     * pnext, a mate on a contig not yet reached is set aside with the mates of that contig so that it
+     * does not occupy unpaired meanwhile, and a mate on a contig that has been passed will never
+     * arrive. Reads without a mate position wait until the end.
+     */
+    ContigMates *contig = NULL;
+    size_t len = 0;
+    
+    if (segment->pnext <= 0 || (segment->rnext_len == 1 && *segment->rnext == '*')) {
+        return;
+        }
+    if ((segment->rnext_len == 1 && *segment->rnext == '=') ||
+        (segment->rnext_len == segment->rname_len && memcmp(segment->rnext, segment->rname, segment->rname_len) == 0)) {
+        // A mate not yet seen cannot be before this read, an unmapped mate is placed alongside it
+        // whatever pnext says
+        mate_queue_push(&dd->expected_mates, (segment->flag & MATE_UNMAPPED) || segment->pnext < segment->pos ? segment->pos : segment->pnext,
+                        segment->qname, segment->qname_len);
+        return;
+        }
     
+    hash_pop(dd->unpaired, segment->qname, segment->qname_len, &len);
+    contig = contig_mates(dd, segment->rnext, segment->rnext_len);
+    if (contig->finished) {
+        ++dd->stats.orphans;
+        return;
+        }
+    if (contig->len == contig->max_len) {
+        contig->max_len = contig->max_len ? contig->max_len * 2 : 16;
+        if ((contig->mates = realloc(contig->mates, contig->max_len * sizeof(DeferredMate))) == NULL) {
+            dedupe_fail("Unable to allocate memory for mates on other contigs");
+            }
+        }
+    contig->mates[contig->len].record = segment->qname;
+    contig->mates[contig->len++].len = segment->len;
+    }
+
+
+
+void enter_contig(Dedupe *dd, const char *rname, size_t rname_len) {
+    // Mates expected on the contig being left never arrived, those set aside for the new contig are
+    // now expected at their positions on it
+    ContigMates *contig = NULL;
+    Segment segment = {0};
+    size_t i = 0;
     
-    unpaired = hash_new(64);
-    paired = mash_new(64);
-    paired2 = mash_new(64);
+    expire_unpaired(dd, INT32_MAX);
+    if (dd->sort_check_rname_len > 0) {
+        contig_mates(dd, dd->sort_check_rname, dd->sort_check_rname_len)->finished = true;
+        }
     
-    // Move past all comments to first read
-    sam_end = sam_start + sam_len;
-    for (sam = sam_start; sam < sam_end; ++sam) {
-        if (*sam != '@') {
+    contig = contig_mates(dd, rname, rname_len);
+    for (i = 0; i < contig->len; ++i) {
+        parse_segment(contig->mates[i].record, contig->mates[i].record + contig->mates[i].len, &segment);
+        if (hash_put(dd->unpaired, segment.qname, segment.qname_len, segment.qname, segment.len) == -1) {
+            dedupe_fail("Unable to add qname to unpaired hash table");
+            }
+        mate_queue_push(&dd->expected_mates, segment.pnext, segment.qname, segment.qname_len);
+        }
+    free(contig->mates);
+    contig->mates = NULL;
+    contig->len = 0;
+    contig->max_len = 0;
+    }
+
+
+
+ContigMates *contig_mates(Dedupe *dd, const char *name, size_t name_len) {
+    // Returns the entry of the contig in contigs, adding it if it has not been seen
+    ContigMates *contig = NULL;
+    size_t data_size = 0;
+    
+    if ((contig = hash_get(dd->contigs, name, name_len, &data_size)) != NULL) {
+        return contig;
+        }
+    if ((contig = calloc(1, sizeof(ContigMates) + name_len)) == NULL) {
+        dedupe_fail("Unable to allocate memory for contig");
+        }
+    memcpy(contig->name, name, name_len);
+    if (hash_put(dd->contigs, contig->name, name_len, contig, sizeof(ContigMates)) == -1) {
+        free(contig);
+        dedupe_fail("Unable to add contig to hash table");
+        }
+    return contig;
+    }
+
+
+
+void expire_unpaired(Dedupe *dd, int32_t pos) {
+    // Removes the reads whose mates were expected before pos as orphans. Reads that have since been
+    // paired are no longer in unpaired, or a later read with the same qname is.
+    ExpectedMate *mate = NULL;
+    size_t len = 0;
+    
+    PROFILE_START(unpaired_timer);
+    while (dd->expected_mates.len > 0 && (mate = dd->expected_mates.mates)->mate_pos < pos) {
+        if (hash_get(dd->unpaired, mate->qname, mate->qname_len, &len) == mate->qname) {
+            hash_pop(dd->unpaired, mate->qname, mate->qname_len, &len);
+            ++dd->stats.orphans;
+            }
+        mate_queue_pop(&dd->expected_mates);
+        }
+    PROFILE_STOP(STAGE_UNPAIRED, unpaired_timer);
+    }
+
+
+
+void mate_queue_push(MateQueue *mq, int32_t mate_pos, const char *qname, size_t qname_len) {
+    // Adds a read to the min heap ordered by the position of its mate
+    ExpectedMate mate = {mate_pos, (uint32_t)qname_len, qname};
+    size_t i = 0, parent = 0;
+    
+    if (mq->len == mq->max_len) {
+        mq->max_len = mq->max_len ? mq->max_len * 2 : 1024;
+        if ((mq->mates = realloc(mq->mates, mq->max_len * sizeof(ExpectedMate))) == NULL) {
+            dedupe_fail("Unable to allocate memory for expected mates");
+            }
+        }
+    
+    for (i = mq->len++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (mq->mates[parent].mate_pos <= mate_pos) {
             break;
             }
-        for (; sam < sam_end && *sam != '\n'; ++sam);
+        mq->mates[i] = mq->mates[parent];
         }
-    if (sam == sam_end) {
-        fprintf(stderr, "Error: Empty sam file\n");
-        exit(EXIT_FAILURE);
+    mq->mates[i] = mate;
+    }
+
+
+
+void mate_queue_pop(MateQueue *mq) {
+    // Removes the read with the lowest mate_pos
+    ExpectedMate last = {0};
+    size_t i = 0, child = 0;
+    
+    last = mq->mates[--mq->len];
+    for (i = 0; (child = (2 * i) + 1) < mq->len; i = child) {
+        if (child + 1 < mq->len && mq->mates[child + 1].mate_pos < mq->mates[child].mate_pos) {
+            ++child;
+            }
+        if (last.mate_pos <= mq->mates[child].mate_pos) {
+            break;
+            }
+        mq->mates[i] = mq->mates[child];
         }
+    mq->mates[i] = last;
+    }
+
+
+
+int32_t pair_segments(Segment mate_segment, Segment segment, uint16_t key_flags, ReadPair *readpair, char **position, size_t *position_len, size_t *max_position_len) {
+    // Fills readpair and writes the position key identifying its family to position. mate_segment is
+    // the segment that appears first in a coordinate sorted sam, key_flags those flags of segment that
+    // are part of the key. Returns the last position at which
+    // another member of the family could be completed, ie the rightmost beginning of either segment
+    // as neither can be positioned after its beginning, or of segment alone if on different contigs.
+    Segment swap_segment = {0};
+    int32_t segment_begin = 0, mate_begin = 0;
     
-    if (dd.optical_duplicate_distance == 0 && !disable_optical_duplicates) {
-        dd.optical_duplicate_distance = guess_optical_distance(sam, sam_end);
+    // This is needed as an unmapped read may be positioned before or after its mate depending
+    // on the value of the REVERSE flag in a sorted sam
+    // If one read is unmapped then both reads will share the same rname and pos therefore these
+    // don't get affected by the swap
+    if (mate_segment.flag & UNMAPPED) {
+        swap_segment = segment;
+        segment = mate_segment;
+        mate_segment = swap_segment;
         }
     
-    for (;sam < sam_end; sam = next) {
-        next = parse_segment(sam, sam_end, &segment);
-        // Sanity check to ensure that sam file is sorted by position
-        if (segment.rname_len == sort_check_rname_len && memcmp(segment.rname, sort_check_rname, sort_check_rname_len) == 0) {
-            if (segment.pos < sort_check_pos) {
-                fprintf(stderr, "Error: Sam file must be sorted by position\n");
-                exit(EXIT_FAILURE);
-                }
+    
+    // Segment_begin and mate_begin are the positions of the start of a read which will be the
+    // segment[1]most position if reverse complemnted
+    mate_begin = mate_segment.pos;
+    if (mate_segment.flag & REVERSE) {
+        mate_begin += cigar_len(mate_segment.cigar, mate_segment.cigar_len, CONSUMES_REF);
+        }
+    
+    if (segment.flag & UNMAPPED) {
+        segment_begin = mate_begin;
+        }
+    else {
+        segment_begin = segment.pos;
+        if (segment.flag & REVERSE) {
+            segment_begin += cigar_len(segment.cigar, segment.cigar_len, CONSUMES_REF);
             }
-        else {
-            sort_check_rname = segment.rname;
-            sort_check_rname_len = segment.rname_len;
+        }
+    
+    
+    // 2 x max number of decimal digits in an int32 (10 digits) + 
+    // max number of decimal digits in a uint16 (5 digits) +
+    // 4 x '\t' field separators +
+    // terminal '\0' = 30
+    *position_len = mate_segment.rname_len + segment.rname_len + 30;
+    if (*position_len > *max_position_len) {
+        if ((*position = realloc(*position, *position_len)) == NULL) {
+            dedupe_fail("Unable to alllocate memory for position buffer");
             }
-        sort_check_pos = segment.pos;
-        
-        // Skip secondary, supplementary and completely unmapped reads
-        if ((segment.flag & NON_PRIMARY) || ((segment.flag & BOTH_UNMAPPED) == BOTH_UNMAPPED)) {
-            continue;
+        *max_position_len = *position_len;
+        }
+    snprintf(*position, *position_len, "%.*s\t%010i\t%.*s\t%010i\t%05u",
+                                       (int)mate_segment.rname_len, mate_segment.rname,
+                                       (int)mate_begin,
+                                       (int)segment.rname_len, segment.rname,
+                                       (int)segment_begin,
+                                       (unsigned)(segment.flag & key_flags));
+    
+    readpair->segment[0] = mate_segment;
+    readpair->segment[1] = segment;
+    
+    if (mate_begin > segment_begin && mate_segment.rname_len == segment.rname_len && memcmp(mate_segment.rname, segment.rname, segment.rname_len) == 0) {
+        return mate_begin;
+        }
+    return segment_begin;
+    }
+
+
+
+int cmp_coordinates(const Segment *s1, const Segment *s2) {
+    // Orders segments as they would appear in a coordinate sorted sam. Contigs are ordered by name as
+    // only a consistent order is needed, segments at the same position are ordered forward first.
+    size_t min_len = s1->rname_len < s2->rname_len ? s1->rname_len : s2->rname_len;
+    int ret = memcmp(s1->rname, s2->rname, min_len);
+    
+    if (ret == 0) {
+        ret = (s1->rname_len > s2->rname_len) - (s1->rname_len < s2->rname_len);
+        if (ret == 0) {
+            ret = (s1->pos > s2->pos) - (s1->pos < s2->pos);
+            if (ret == 0) {
+                ret = (int)(s1->flag & (REVERSE | READ2)) - (int)(s2->flag & (REVERSE | READ2));
+                }
             }
-        
-        // Do we have a pair of reads yet? If not store this read and move on to the next
-        if ((mate = hash_pop(unpaired, segment.qname, segment.qname_len, &len)) == NULL) {
-            hash_put(unpaired, segment.qname, segment.qname_len, segment.qname, segment.len);
-            continue;
+        }
+    return ret;
+    }
+
+
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+    }
+
+
+
+void report_progress(Progress *pg, Dedupe *dd, size_t offset, const char *rname, size_t rname_len, size_t unpaired, size_t window, bool finished) {
+    // Called every few thousand records, reports once interval seconds have passed since the last
+    // report. Rates are over the last interval. The heartbeat file is replaced atomically so that it
+    // can be read at any time.
+    double now = monotonic_seconds(), elapsed = 0, reads_per_second = 0, families_per_second = 0;
+    char *tmp_filename = NULL;
+    FILE *fp = NULL;
+    
+    if (now - pg->last < pg->interval && !finished) {
+        return;
+        }
+    
+    elapsed = now - pg->last;
+    if (elapsed > 0) {
+        reads_per_second = (pg->records - pg->last_records) / elapsed;
+        families_per_second = (dd->stats.total_families - pg->last_families) / elapsed;
+        }
+    pg->last = now;
+    pg->last_records = pg->records;
+    pg->last_families = dd->stats.total_families;
+    
+    if (pg->print) {
+        fprintf(stderr, "elduderino: %5.1f%% %.*s %.0f reads/s %.0f families/s %zu unpaired %zu window%s\n",
+                        pg->total_bytes ? 100.0 * offset / pg->total_bytes : 0.0, (int)rname_len, rname, reads_per_second, families_per_second,
+                        unpaired, window, finished ? " finished" : "");
+        }
+    
+    if (pg->heartbeat_filename != NULL) {
+        if ((tmp_filename = malloc(strlen(pg->heartbeat_filename) + 5)) == NULL) {
+            dedupe_fail("Unable to allocate memory for heartbeat filename");
             }
-        
-        parse_segment(mate, mate + len, &mate_segment);
-        
-        // This is needed as an unmapped read may be positioned before or after its mate depending
-        // on the value of the REVERSE flag in a sorted sam
-        // If one read is unmapped then both reads will share the same rname and pos therefore these
-        // don't get affected by the swap
-        if (mate_segment.flag & UNMAPPED) {
-            swap_segment = segment;
-            segment = mate_segment;
-            mate_segment = swap_segment;
+        sprintf(tmp_filename, "%s.tmp", pg->heartbeat_filename);
+        if ((fp = fopen(tmp_filename, "w")) == NULL) {
+            dedupe_fail("Unable to open %s", tmp_filename);
             }
-        
-        
-        // Segment_begin and mate_begin are the positions of the start of a read which will be the
-        // segment[1]most position if reverse complemnted
-        mate_begin = mate_segment.pos;
-        if (mate_segment.flag & REVERSE) {
-            mate_begin += cigar_len(mate_segment.cigar, mate_segment.cigar_len, CONSUMES_REF);
+        fprintf(fp, "{\n");
+        fprintf(fp, "    \"bytes\": %zu,\n", offset);
+        fprintf(fp, "    \"total_bytes\": %zu,\n", pg->total_bytes);
+        fprintf(fp, "    \"contig\": \"%.*s\",\n", (int)rname_len, rname);
+        fprintf(fp, "    \"elapsed\": %.1f,\n", now - pg->start);
+        fprintf(fp, "    \"reads\": %zu,\n", pg->records);
+        fprintf(fp, "    \"families\": %zu,\n", dd->stats.total_families);
+        fprintf(fp, "    \"reads_per_second\": %.0f,\n", reads_per_second);
+        fprintf(fp, "    \"families_per_second\": %.0f,\n", families_per_second);
+        fprintf(fp, "    \"unpaired\": %zu,\n", unpaired);
+        fprintf(fp, "    \"window\": %zu,\n", window);
+        fprintf(fp, "    \"finished\": %s\n", finished ? "true" : "false");
+        fprintf(fp, "}\n");
+        if (fclose(fp) != 0 || rename(tmp_filename, pg->heartbeat_filename) == -1) {
+            dedupe_fail("Unable to write %s", pg->heartbeat_filename);
             }
-        
-        if (segment.flag & UNMAPPED) {
-            segment_begin = mate_begin;
+        free(tmp_filename);
+        }
+    }
+
+
+
+void dedupe_all(Dedupe *dd, MashTable *paired, Spill *spill, dedupe_function_t dedupe_function) {
+    char *data = NULL, *key = NULL, *previous_key = NULL;
+    size_t data_size = 0, key_size = 0, previous_key_len = 0, readpair_len = 0;
+    uint32_t bucket = 0;
+    bool spilled = spill->records > 0;
+    void *ptr = NULL;
+    ReadPair readpair = {0};
+    
+    // If part of the window has been spilled then add the remainder so that every member of
+    // each family is returned consecutively by spill_pop
+    if (spilled) {
+        while ((data = mash_popall(paired, (const void **)&key, &key_size, &data_size, &bucket)) != NULL) {
+            spill_readpair(dd, spill, key, key_size, (ReadPair *)data);
             }
-        else {
-            segment_begin = segment.pos;
-            if (segment.flag & REVERSE) {
-                segment_begin += cigar_len(segment.cigar, segment.cigar_len, CONSUMES_REF);
+        }
+    
+    while (true) {
+        if (spilled) {
+            PROFILE_START(spill_timer);
+            data = spill_pop(spill, (const void **)&key, &key_size, &data_size);
+            PROFILE_STOP(STAGE_SPILL, spill_timer);
+            if (data == NULL && spill->failed) {
+                dedupe_fail("Unable to read from spill file");
+                }
+            if (data != NULL) {
+                unspill_readpair((SpilledPair *)data, &readpair);
+                data = (char *)&readpair;
+                data_size = sizeof(ReadPair);
                 }
             }
+        else {
+            data = mash_popall(paired, (const void **)&key, &key_size, &data_size, &bucket);
+            }
         
-        
-        // 2 x max number of decimal digits in an int32 (10 digits) + 
-        // max number of decimal digits in a uint16 (5 digits) +
-        // 4 x '\t' field separators +
-        // terminal '\0' = 30
-        position_len = mate_segment.rname_len + segment.rname_len + 30;
-        if (position_len > max_position_len) {
-            if ((position = realloc(position, position_len)) == NULL) {
-                fprintf(stderr, "Error: Unable to alllocate memory for position buffer\n");
-                exit(EXIT_FAILURE);
+        if (data == NULL || key_size != previous_key_len || memcmp(previous_key, key, previous_key_len) != 0) {
+            if (readpair_len > 0) {
+                dedupe_family(dd, previous_key, previous_key_len, readpair_len, dedupe_function);
+                readpair_len = 0;
                 }
-            max_position_len = position_len;
-            }
-        snprintf(position, position_len, "%.*s\t%010i\t%.*s\t%010i\t%05u",
-                                         (int)mate_segment.rname_len, mate_segment.rname,
-                                         (int)mate_begin,
-                                         (int)segment.rname_len, segment.rname,
-                                         (int)segment_begin,
-                                         (unsigned)(segment.flag & READXREVERSEXUNMAPPEDX));
-        
-        readpair.segment[0] = mate_segment;
-        readpair.segment[1] = segment;
-        
-        if (mate_begin > segment_begin) {
-            segment_begin = mate_begin;
+            if (data == NULL) {
+                break;
+                }
+            
+            // Keys returned by spill_pop are only valid until the next call
+            if (spilled) {
+                if (key_size > dd->max_spilled_key_len) {
+                    if ((ptr = realloc(dd->spilled_key, key_size)) == NULL) {
+                        dedupe_fail("Unable to allocate memory for key buffer");
+                        }
+                    dd->spilled_key = ptr;
+                    dd->max_spilled_key_len = key_size;
+                    }
+                previous_key = dd->spilled_key;
+                memcpy(previous_key, key, key_size);
+                }
+            else {
+                previous_key = key;
+                }
+            previous_key_len = key_size;
             }
         
-        if (segment.rname_len == current_rname_len && memcmp(segment.rname, current_rname, current_rname_len) == 0 && segment.pos <= max_pos) {
-            if (mash_get(paired, position, position_len, &len) != NULL) {
-                if (mash_put(paired, position, position_len, &readpair, sizeof(ReadPair)) == -1) {
-                    fprintf(stderr, "Error: Unable to to add position to paired hash table\n");
-                    exit(EXIT_FAILURE);
+        add_family_member(dd, (ReadPair *)data, readpair_len++);
+        }
+    }
+
+
+
+void add_family_member(Dedupe *dd, ReadPair *readpair, size_t i) {
+    // Adds readpair as member i of the family currently being collected
+    if (dd->family_index != NULL &&
+        family_index_member(dd->family_index, readpair->segment[0].qname, readpair->segment[0].qname_len, readpair->segment[1].qname) == -1) {
+        dedupe_fail("Unable to add to family index, records must lie within its sam");
+        }
+    
+    if (dd->streaming) {
+        PROFILE_START(consensus_timer);
+        consensus_add(dd, readpair);
+        PROFILE_STOP(STAGE_CONSENSUS, consensus_timer);
+        return;
+        }
+    
+    if (i >= dd->readpair_len) {
+        if ((dd->readpairs = realloc(dd->readpairs, (i + 1) * sizeof(ReadPair))) == NULL) {
+            dedupe_fail("Unable to allocate memory for readpairs buffer");
+            }
+        dd->readpair_len = i + 1;
+        }
+    memcpy(dd->readpairs + i, readpair, sizeof(ReadPair));
+    }
+
+
+
+void dedupe_family(Dedupe *dd, const char *key, size_t key_size, size_t readpair_len, dedupe_function_t dedupe_function) {
+    // Dedupes the readpair_len members collected by add_family_member, the family of position key.
+    // Members arrive in the order of the hash table chains, which depends on the hash function, its
+    // seed and the history of the table, so they are first put in qname order. Every later sort
+    // breaks ties by qname so that grouping and the member each consensus is named after never
+    // depend on that order.
+    PROFILE_START(dedupe_timer);
+    
+    if (dd->family_index != NULL && family_index_family(dd->family_index, key, key_size) == -1) {
+        dedupe_fail("Unable to write family index");
+        }
+    
+    if (dd->print_family_members != NULL) {
+        int i = 0, j = 0;
+        size_t len = 0;
+        for (i = 0; i < readpair_len; ++i) {
+            len = dd->readpairs[i].segment[0].qname_len;
+            if (memcmp(dd->readpairs[i].segment[0].qname, dd->print_family_members, len) == 0 && dd->print_family_members[len] == '\0') {
+                for (j = 0; j < 2; ++j) {
+                    for (i = 0; i < readpair_len; ++i) {
+                        write_output(dd, dd->readpairs[i].segment[j].qname, dd->readpairs[i].segment[j].len);
+                        }
                     }
+                dedupe_stop(dd);
+                }
+            }
+        }
+    else if (dd->streaming) {
+        PROFILE_START(consensus_timer);
+        consensus_finish(dd);
+        PROFILE_STOP(STAGE_CONSENSUS, consensus_timer);
+        }
+    else {
+        if (readpair_len > 1) {
+            PROFILE_START(sort_timer);
+            qsort(dd->readpairs, readpair_len, sizeof(ReadPair), cmp_qnames);
+            PROFILE_STOP(STAGE_SORT, sort_timer);
+            }
+        dedupe_function(dd, dd->readpairs, readpair_len);
+        }
+    PROFILE_STOP(STAGE_DEDUPE, dedupe_timer);
+    }
+
+
+
+void flush_queue_push(FlushQueue *fq, int32_t close_pos, const char *key, size_t key_size) {
+    // Adds a newly opened family to the min heap ordered by close_pos
+    OpenFamily family = {close_pos, false, key_size, NULL};
+    size_t i = 0, parent = 0;
+    void *ptr = NULL;
+    
+    // The queue is grown before the key is copied so that a failure leaves nothing that
+    // dedupe_destroy cannot free
+    if (fq->len == fq->max_len) {
+        if ((ptr = realloc(fq->families, (fq->max_len ? fq->max_len * 2 : 1024) * sizeof(OpenFamily))) == NULL) {
+            dedupe_fail("Unable to allocate memory for open families");
+            }
+        fq->families = ptr;
+        fq->max_len = fq->max_len ? fq->max_len * 2 : 1024;
+        }
+    if ((family.key = malloc(key_size)) == NULL) {
+        dedupe_fail("Unable to allocate memory for open family key");
+        }
+    memcpy(family.key, key, key_size);
+    
+    for (i = fq->len++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (fq->families[parent].close_pos <= close_pos) {
+            break;
+            }
+        fq->families[i] = fq->families[parent];
+        }
+    fq->families[i] = family;
+    }
+
+
+
+void flush_queue_pop(FlushQueue *fq) {
+    // Removes the family with the lowest close_pos
+    OpenFamily last = {0};
+    size_t i = 0, child = 0;
+    
+    free(fq->families[0].key);
+    last = fq->families[--fq->len];
+    for (i = 0; (child = (2 * i) + 1) < fq->len; i = child) {
+        if (child + 1 < fq->len && fq->families[child + 1].close_pos < fq->families[child].close_pos) {
+            ++child;
+            }
+        if (last.close_pos <= fq->families[child].close_pos) {
+            break;
+            }
+        fq->families[i] = fq->families[child];
+        }
+    fq->families[i] = last;
+    }
+
+
+
+void flush_closed(Dedupe *dd, MashTable *paired, Spill *spill, FlushQueue *fq, int32_t pos, dedupe_function_t dedupe_function) {
+    // Dedupes every family whose close_pos is before pos. Families with members on disk are moved
+    // entirely to spill to be merged at the end of the contig. Members are popped in chain order,
+    // which dedupe_family replaces with qname order, so closing early cannot change the result.
+    OpenFamily *family = NULL;
+    ReadPair *readpair = NULL;
+    size_t data_size = 0, readpair_len = 0;
+    
+    while (fq->len > 0 && fq->families[0].close_pos < pos) {
+        family = fq->families;
+        readpair_len = 0;
+        while ((readpair = mash_pop(paired, family->key, family->key_size, &data_size)) != NULL) {
+            if (family->spilled) {
+                spill_readpair(dd, spill, family->key, family->key_size, readpair);
                 }
             else {
-                if (mash_put(paired2, position, position_len, &readpair, sizeof(ReadPair)) == -1) {
-                    fprintf(stderr, "Error: Unable to to add position to paired2 hash table\n");
-                    exit(EXIT_FAILURE);
-                    }
-                if (segment_begin > max_pos2) {
-                    max_pos2 = segment_begin;
-                    }
+                add_family_member(dd, readpair, readpair_len++);
+                }
+            }
+        if (readpair_len > 0) {
+            dedupe_family(dd, family->key, family->key_size, readpair_len, dedupe_function);
+            }
+        flush_queue_pop(fq);
+        }
+    }
+
+
+
+void flush_all(Dedupe *dd, MashTable *paired, Spill *spill, FlushQueue *fq, dedupe_function_t dedupe_function) {
+    flush_closed(dd, paired, spill, fq, INT32_MAX, dedupe_function);
+    dedupe_all(dd, paired, spill, dedupe_function);
+    }
+
+
+
+MashTable *spill_window(Dedupe *dd, MashTable *paired, Spill *spill) {
+    // Moves every family member except the first to spill. The first is kept so that membership
+    // of each family can still be tested with mash_get. Only open families that lost a member are
+    // marked as spilled, the rest can still be deduped in memory when they close.
+    MashTable *kept = NULL, *spilled_keys = NULL;
+    char *data = NULL, *key = NULL, *previous_key = NULL;
+    size_t data_size = 0, key_size = 0, previous_key_len = 0, i = 0;
+    uint32_t bucket = 0;
+    bool marked = false;
+    OpenFamily *family = NULL;
+
+    if ((kept = mash_new(64)) == NULL) {
+        dedupe_fail("Unable to allocate memory for paired hash table");
+        }
+    if ((spilled_keys = mash_new(64)) == NULL) {
+        mash_destroy(kept);
+        dedupe_fail("Unable to allocate memory for spilled hash table");
+        }
+    kept->hash_function = spilled_keys->hash_function = paired->hash_function;
+    kept->seed = spilled_keys->seed = paired->seed;
+
+    while ((data = mash_popall(paired, (const void **)&key, &key_size, &data_size, &bucket)) != NULL) {
+        if (key_size != previous_key_len || memcmp(previous_key, key, previous_key_len) != 0) {
+            if (mash_put(kept, key, key_size, data, data_size) == -1) {
+                dedupe_fail("Unable to to add position to paired hash table");
                 }
+            previous_key = key;
+            previous_key_len = key_size;
+            marked = false;
             }
         else {
-            dedupe_all(&dd, paired, dedupe_function);
-            mash_destroy(paired); // this is faster than recycling paired
-            paired = paired2;
-            max_pos = max_pos2;
-            paired2 = mash_new(64);
-            max_pos2 = 0;
-            if (mash_put(paired, position, position_len, &readpair, sizeof(ReadPair)) == -1) {
-                fprintf(stderr, "Error: Unable to to add position to paired hash table\n");
-                exit(EXIT_FAILURE);
-                }
-            if (segment.rname_len != current_rname_len || memcmp(segment.rname, current_rname, current_rname_len) != 0) {
-                current_rname = segment.rname;
-                current_rname_len = segment.rname_len;
-                max_pos = segment_begin;
-                }
-            else if (segment_begin > max_pos) {
-                max_pos = segment_begin;
+            spill_readpair(dd, spill, key, key_size, (ReadPair *)data);
+            if (!marked && mash_put(spilled_keys, key, key_size, &marked, sizeof(marked)) == -1) {
+                dedupe_fail("Unable to to add position to spilled hash table");
                 }
+            marked = true;
             }
-        
         }
-    dedupe_all(&dd, paired, dedupe_function);
-    dedupe_all(&dd, paired2, dedupe_function);
-    
-    if (dd.output_file != stdout) {
-        fclose(dd.output_file);
+
+    for (i = 0; i < dd->open_families.len; ++i) {
+        family = dd->open_families.families + i;
+        if (!family->spilled && mash_get(spilled_keys, family->key, family->key_size, &data_size) != NULL) {
+            family->spilled = true;
+            }
         }
-    
-    write_stats(stats_filename, &dd);
-    
-    // Clean up, not really needed but allows confirmation of no memory leaks
-    free(position);
-    free(dd.readpairs);
-    free(dd.buffer);
-    free(dd.family_sizes);
-    hash_destroy(unpaired);
+
+    mash_destroy(spilled_keys);
     mash_destroy(paired);
-    mash_destroy(paired2);
+    return kept;
     }
 
 
 
-void write_stats(const char *stats_filename, Dedupe *dd) {
-    FILE *stats_file = NULL;
-    char ch = '\0';
-    size_t total_reads = 0, total_families = 0, i = 0;
-    
-    for (i = 1; i < dd->max_family_size + 1; ++i) {
-        total_families += dd->family_sizes[i];
-        total_reads += i *  dd->family_sizes[i];
-        }
-    
-    if ((stats_file = fopen(stats_filename, "r+")) == NULL) {
-        if ((stats_file = fopen(stats_filename, "w")) == NULL) {
-            fprintf(stderr, "Error: Unable to open %s\n", stats_filename);
-            exit(EXIT_FAILURE);
+void spill_readpair(Dedupe *dd, Spill *spill, const char *key, size_t key_size, ReadPair *readpair) {
+    // Only the location of each record within the input is written, they are parsed again when needed
+    SpilledPair spilled = {{readpair->segment[0].qname, readpair->segment[1].qname},
+                           {readpair->segment[0].len, readpair->segment[1].len}};
+    FedSource *source = NULL;
+    size_t i = 0;
+
+    // Bounds within each source of the records that spill refers to, reported by dedupe_references
+    if (spill->records == 0) {
+        for (i = 0; i < dd->sources_len; ++i) {
+            dd->sources[i].spilled_start = dd->sources[i].spilled_end = NULL;
             }
-        fprintf(stats_file, "{\n");
         }
-    else {
-        fseek(stats_file, 0, SEEK_END);
-        if (ftell(stats_file) == 0) {
-            fprintf(stats_file, "{}\n");
+    for (i = 0; i < 2; ++i) {
+        source = dd->sources + record_source(dd, spilled.record[i]);
+        if (source->spilled_start == NULL) {
+            source->spilled_start = spilled.record[i];
+            source->spilled_end = spilled.record[i] + spilled.len[i];
             }
-        
-        fseek(stats_file, -1, SEEK_CUR);
-        while (true) {
-            ch = fgetc(stats_file);
-            if (ch != '}' && !isspace(ch)) {
-                if (ch != '{') {
-                    fprintf(stats_file, ",");
-                    }
-                break;
-                }
-            if (fseek(stats_file, -2, SEEK_CUR) == -1) {
-                fprintf(stderr, "Error: Malformed stats file\n");
-                exit(EXIT_FAILURE);
-                }
+        if (spilled.record[i] < source->spilled_start) {
+            source->spilled_start = spilled.record[i];
+            }
+        if (spilled.record[i] + spilled.len[i] > source->spilled_end) {
+            source->spilled_end = spilled.record[i] + spilled.len[i];
             }
         }
+
+    if (spill_put(spill, key, key_size, &spilled, sizeof(SpilledPair)) == -1) {
+        dedupe_fail("Unable to write to spill file");
+        }
+    PROFILE_COUNT(COUNT_SPILLED, 1);
+    }
+
+
+
+void track_sources(Dedupe *dd, const RecordRun *runs, size_t runs_len) {
+    // Extends the records fed from the source of each run
+    FedSource *source = NULL;
+    void *ptr = NULL;
+    size_t i = 0;
     
-    fprintf(stats_file, "\n    \"family_sizes\": {");
-    for (i = 1; i < dd->max_family_size + 1; ++i) {
-        if (dd->family_sizes[i]) {
-            if (i > 1) {
-                fprintf(stats_file, ",");
+    for (i = 0; i < runs_len; ++i) {
+        if (runs[i].source >= dd->sources_len) {
+            if ((ptr = realloc(dd->sources, (runs[i].source + 1) * sizeof(FedSource))) == NULL) {
+                dedupe_fail("Unable to allocate memory for sources");
                 }
-            fprintf(stats_file, "\n        \"%i\": %f", (int)i, (float)dd->family_sizes[i] / total_families);
+            dd->sources = ptr;
+            memset(dd->sources + dd->sources_len, 0, (runs[i].source + 1 - dd->sources_len) * sizeof(FedSource));
+            dd->sources_len = runs[i].source + 1;
+            }
+        source = dd->sources + runs[i].source;
+        if (source->fed_start == NULL) {
+            source->fed_start = runs[i].records;
+            source->fed_end = runs[i].records + runs[i].len;
+            }
+        if (runs[i].records < source->fed_start) {
+            source->fed_start = runs[i].records;
+            }
+        if (runs[i].records + runs[i].len > source->fed_end) {
+            source->fed_end = runs[i].records + runs[i].len;
             }
         }
-    fprintf(stats_file, "\n    },\n");
-    fprintf(stats_file, "    \"mean_family_size\": %.2f,\n", (float)total_reads / total_families);
+    }
+
+
+
+size_t record_source(Dedupe *dd, const char *record) {
+    // Returns the source that record was fed from. The buffers of different sources are unrelated
+    // so the record is compared with each only as an address.
+    uintptr_t address = (uintptr_t)record;
+    size_t i = dd->last_source, n = 0;
     
-    fprintf(stats_file, "    \"duplicate_rate\": %.4f,\n", (float)(dd->optical_duplicates + dd->pcr_duplicates) / dd->total_reads);
-    if (dd->optical_duplicate_distance != 0) {
-        fprintf(stats_file, "    \"duplicate_rate_optical\": %.4f,\n", (float)dd->optical_duplicates / dd->total_reads);
-        fprintf(stats_file, "    \"duplicate_rate_pcr\": %.4f,\n", (float)dd->pcr_duplicates / dd->total_reads);
+    for (n = 0; n < dd->sources_len; ++n, i = (i + 1) % dd->sources_len) {
+        if (address >= (uintptr_t)dd->sources[i].fed_start && address < (uintptr_t)dd->sources[i].fed_end) {
+            dd->last_source = i;
+            return i;
+            }
         }
-    
-    fprintf(stats_file, "    \"sequencing_error_rate\": %.4f,\n", dd->sequencing_errors / dd->sequencing_total);
-    fprintf(stats_file, "    \"pcr_error_rate\": %.4f\n", dd->pcr_errors / dd->pcr_total);
-    fprintf(stats_file, "}\n");
-
-    fclose(stats_file);
+    dedupe_fail("Spilled record lies outside the records fed");
+    return 0;
     }
 
 
 
-void dedupe_all(Dedupe *dd, MashTable *paired, dedupe_function_t dedupe_function) {
-    char *data = NULL, *key = NULL, *previous_key = NULL;
-    size_t data_size = 0, key_size = 0, previous_key_len = 0, readpair_len = 0;
-    uint32_t bucket = 0;
-    
-    while (true) {
-        data = mash_popall(paired, (const void **)&key, &key_size, &data_size, &bucket);
-        if (data == NULL || key_size != previous_key_len || memcmp(previous_key, key, previous_key_len) != 0) {
-            if (readpair_len > 0) {
+void unspill_readpair(SpilledPair *spilled, ReadPair *readpair) {
+    int i = 0;
 
-                if (dd->print_family_members != NULL) {
-                    int i = 0, j = 0;
-                    size_t len = 0;
-                    for (i = 0; i < readpair_len; ++i) {
-                        len = dd->readpairs[i].segment[0].qname_len;
-                        if (memcmp(dd->readpairs[i].segment[0].qname, dd->print_family_members, len) == 0 && dd->print_family_members[len] == '\0') {
-                            for (j = 0; j < 2; ++j) {
-                                for (i = 0; i < readpair_len; ++i) {
-                                    fprintf(dd->output_file, "%.*s", (int)dd->readpairs[i].segment[j].len, dd->readpairs[i].segment[j].qname);
-                                    }
-                                }
-                            exit(0);
-                            }
-                        }
-                    }
-                else {
-                    dedupe_function(dd, dd->readpairs, readpair_len);
-                    }
-                
-                readpair_len = 0;
-                }
-            if (data == NULL) {
-                break;
-                }
-            previous_key_len = key_size;
-            previous_key = key;
-            }
-        
-        if (++readpair_len > dd->readpair_len) {
-            if ((dd->readpairs = realloc(dd->readpairs, readpair_len * sizeof(ReadPair))) == NULL) {
-                fprintf(stderr, "Error: Unable to allocate memory for readpairs buffer\n");
-                exit(EXIT_FAILURE);
-                }
-            dd->readpair_len = readpair_len;
-            }
-        memcpy(dd->readpairs + readpair_len - 1, data, data_size);
+    memset(readpair, 0, sizeof(ReadPair));
+    for (i = 0; i < 2; ++i) {
+        parse_segment(spilled->record[i], spilled->record[i] + spilled->len[i], readpair->segment + i);
         }
     }
 
@@ -498,7 +1405,9 @@ void barcode_families(Dedupe *dd, ReadPair *family, size_t family_size) {
         cigar_family(dd, family, family_size);
         }
     else {
-        qsort(family, family_size, sizeof(ReadPair), cmp_barcodes);
+        PROFILE_START(sort_timer);
+        qsort(family, family_size, sizeof(ReadPair), cmp_barcodes_qnames);
+        PROFILE_STOP(STAGE_SORT, sort_timer);
         for (i = 1;; ++i) {
             if (i == family_size || cmp_barcodes(sub_family, family + i) != 0) {
                 cigar_family(dd, sub_family, sub_family_size);
@@ -531,8 +1440,7 @@ void connor_families(Dedupe *dd, ReadPair *family, size_t family_size) {
     else {
         for (i = 0; i < family_size; ++i) {
             if (family[i].segment[0].barcode == NULL || family[i].segment[0].barcode2 == NULL) {
-                fprintf(stderr, "Error: Missing valid barcode tags\n");
-                exit(EXIT_FAILURE);
+                dedupe_fail("Missing valid barcode tags");
                 }
             }
         
@@ -565,23 +1473,243 @@ void connor_families(Dedupe *dd, ReadPair *family, size_t family_size) {
 
 
 
+void duplex_families(Dedupe *dd, ReadPair *family, size_t family_size) {
+    // Groups the members into molecules as connor_families does, a member joining if either half of
+    // its umi matches that of another member, with the halves of B strand members swapped
+    size_t sub_family_size = 1;
+    int i = 0, j = 0;
+    bool changed = false;
+    ReadPair swap_readpair = {0};
+    
+    for (i = 0; i < family_size; ++i) {
+        // A umi without a separator leaves barcode2 beyond the end of barcode
+        if (family[i].segment[0].barcode == NULL || family[i].segment[0].barcode2_len >= family[i].segment[0].barcode_len) {
+            dedupe_fail("Missing valid barcode tags");
+            }
+        }
+    
+    for (; family_size > 0; family_size -= sub_family_size) {
+        sub_family_size = 1;
+        do {
+            changed = false;
+            for (i = sub_family_size; i < family_size; ++i) {
+                for (j = 0; j < sub_family_size; ++j) {
+                    if (same_umi_half(family + i, family + j, 0) || same_umi_half(family + i, family + j, 1)) {
+                        if (i > sub_family_size) {
+                            swap_readpair = family[sub_family_size];
+                            family[sub_family_size] = family[i];
+                            family[i] = swap_readpair;
+                            }
+                        ++sub_family_size;
+                        changed = true;
+                        break;
+                        }
+                    }
+                }
+            } while (changed);
+        
+        duplex_family(dd, family, sub_family_size);
+        family += sub_family_size;
+        }
+    }
+
+
+
+void duplex_family(Dedupe *dd, ReadPair *molecule, size_t molecule_size) {
+    // Each strand is deduped as a family of its own, a molecule seen on one strand only is written
+    // as that consensus alone. Otherwise the output of both is held and combined by write_duplex.
+    size_t a_size = 0, i = 0;
+    ReadPair swap_readpair = {0};
+    
+    for (i = 0; i < molecule_size; ++i) {
+        if (!b_strand(molecule + i)) {
+            swap_readpair = molecule[a_size];
+            molecule[a_size++] = molecule[i];
+            molecule[i] = swap_readpair;
+            }
+        }
+    
+    if (a_size == 0 || a_size == molecule_size) {
+        cigar_family(dd, molecule, molecule_size);
+        return;
+        }
+    
+    if (!dd->stats_only) {
+        dd->duplex_held_len[0] = dd->duplex_held_len[1] = 0;
+        dd->duplex_strand = 0;
+        }
+    cigar_family(dd, molecule, a_size);
+    if (!dd->stats_only) {
+        dd->duplex_strand = 1;
+        }
+    cigar_family(dd, molecule + a_size, molecule_size - a_size);
+    if (!dd->stats_only) {
+        dd->duplex_strand = -1;
+        write_duplex(dd);
+        }
+    }
+
+
+
+bool b_strand(const ReadPair *readpair) {
+    // Read 1 of the A strand is the forward read, that of the B strand the reverse read
+    int forward = (readpair->segment[0].flag & REVERSE) && !(readpair->segment[1].flag & REVERSE);
+    return (readpair->segment[forward].flag & READX) == READ2;
+    }
+
+
+
+bool same_umi_half(const ReadPair *r1, const ReadPair *r2, int half) {
+    const char *umi1 = NULL, *umi2 = NULL;
+    size_t umi1_len = 0, umi2_len = 0;
+    
+    umi_half(r1, half, &umi1, &umi1_len);
+    umi_half(r2, half, &umi2, &umi2_len);
+    return umi1_len == umi2_len && memcmp(umi1, umi2, umi1_len) == 0;
+    }
+
+
+
+void umi_half(const ReadPair *readpair, int half, const char **umi, size_t *umi_len) {
+    // Half 0 is the umi read by read 1 of the A strand, which the B strand reads with read 2
+    const Segment *segment = readpair->segment;
+    
+    if (b_strand(readpair)) {
+        half = !half;
+        }
+    if (half == 0) {
+        *umi = segment->barcode;
+        *umi_len = segment->barcode_len - segment->barcode2_len - 1;
+        }
+    else {
+        *umi = segment->barcode2;
+        *umi_len = segment->barcode2_len;
+        }
+    }
+
+
+
+void write_duplex(Dedupe *dd) {
+    /*
+     * Each strand holds the fastq records of its consensus, read 1 then read 2, or none if it was not
+     * written. Read 1 of the A strand and read 2 of the B strand are read from the same end of the
+     * molecule in the same direction, as are the others, so they are combined base by base. Bases on
+     * which the strands disagree are N, those beyond the shorter read are trimmed. The qname is that
+     * of the A strand, XF the members of both strands and XD those of the strand with fewer.
+     */
+    const char *a[8] = {NULL}, *b[8] = {NULL}, *end = NULL;
+    size_t a_lens[8] = {0}, b_lens[8] = {0}, a_size = 0, b_size = 0, len = 0, required_len = 0, i = 0;
+    char *record = NULL;
+    int r = 0, q = 0;
+    
+    if (dd->duplex_held_len[0] == 0 || dd->duplex_held_len[1] == 0) {
+        for (r = 0; r < 2; ++r) {
+            if (dd->duplex_held_len[r] > 0) {
+                write_output(dd, dd->duplex_held[r], dd->duplex_held_len[r]);
+                }
+            }
+        return;
+        }
+    
+    end = dd->duplex_held[0] + dd->duplex_held_len[0];
+    split_fastq(split_fastq(dd->duplex_held[0], end, a, a_lens), end, a + 4, a_lens + 4);
+    end = dd->duplex_held[1] + dd->duplex_held_len[1];
+    split_fastq(split_fastq(dd->duplex_held[1], end, b, b_lens), end, b + 4, b_lens + 4);
+    a_size = strtoul(a[0] + a_lens[0] + 6, NULL, 10);
+    b_size = strtoul(b[0] + b_lens[0] + 6, NULL, 10);
+    
+    // Room for the qnames, tags, sequences, qualities and separators with 20 digit family sizes
+    required_len = 2 * (a_lens[0] + a_lens[1] + a_lens[5] + 60);
+    if (required_len > dd->max_record_len) {
+        if ((dd->record = realloc(dd->record, required_len)) == NULL) {
+            dedupe_fail("Unable to allocate memory for output record");
+            }
+        dd->max_record_len = required_len;
+        }
+    
+    record = dd->record;
+    for (r = 0; r < 2; ++r) {
+        len = a_lens[r * 4 + 1] < b_lens[(1 - r) * 4 + 1] ? a_lens[r * 4 + 1] : b_lens[(1 - r) * 4 + 1];
+        record += sprintf(record, "@%.*s XF:i:%zu XD:i:%zu\n", (int)a_lens[0], a[0], a_size + b_size, a_size < b_size ? a_size : b_size);
+        for (i = 0; i < len; ++i) {
+            record[i] = a[r * 4 + 1][i] == b[(1 - r) * 4 + 1][i] ? a[r * 4 + 1][i] : 'N';
+            }
+        memcpy(record + len, "\n+\n", 3);
+        record += len + 3;
+        for (i = 0; i < len; ++i) {
+            // Agreeing qualities add as call_base adds those of members
+            q = a[r * 4 + 1][i] == b[(1 - r) * 4 + 1][i] && a[r * 4 + 1][i] != 'N' ? a[r * 4 + 3][i] + b[(1 - r) * 4 + 3][i] - 66 : 0;
+            record[i] = (q > 93 ? 93 : q) + 33;
+            }
+        record[len] = '\n';
+        record += len + 1;
+        }
+    write_output(dd, dd->record, record - dd->record);
+    }
+
+
+
+const char *split_fastq(const char *record, const char *end, const char **lines, size_t *lens) {
+    // Finds the lines of a record written by write_fastq, returns the start of the next record. The
+    // first line is the qname alone, which is followed by " XF:i:".
+    const char *line_end = NULL;
+    int i = 0;
+    
+    for (i = 0; i < 4; ++i) {
+        if (record == NULL || (line_end = memchr(record, '\n', end - record)) == NULL) {
+            dedupe_fail("Truncated duplex consensus");
+            }
+        lines[i] = record;
+        lens[i] = line_end - record;
+        record = line_end + 1;
+        }
+    if ((line_end = memchr(lines[0], ' ', lens[0])) == NULL) {
+        dedupe_fail("Truncated duplex consensus");
+        }
+    ++lines[0];
+    lens[0] = line_end - lines[0];
+    return record;
+    }
+
+
+
 void cigar_family(Dedupe *dd, ReadPair *family, size_t family_size) {
     size_t sixty_percent_family_size = 0, sub_family_size = 1, i = 1;
+    uint32_t hash = 0, min_hash = UINT32_MAX;
     ReadPair *sub_family = family;
     
-    if (family_size > dd->max_family_size) {
-        if ((dd->family_sizes = realloc(dd->family_sizes, (family_size + 1) * sizeof(size_t))) == NULL) {
-            fprintf(stderr, "Error: Unable to allocate memory for family_sizes statistics\n");
-            exit(EXIT_FAILURE);
+    for (i = 0; i < family_size; ++i) {
+        if ((hash = subsample_hash(family[i].segment[0].qname, family[i].segment[0].qname_len)) < min_hash) {
+            min_hash = hash;
             }
-        memset(dd->family_sizes + dd->max_family_size + 1, 0, (family_size - dd->max_family_size) * sizeof(size_t));
-        dd->max_family_size = family_size;
         }
-    ++dd->family_sizes[family_size];
+    count_family_size(dd, family_size, min_hash);
     
-    if (family_size > 1) {
+    if (family_size == 1) {
+        // Singletons can contain neither pcr nor optical duplicates therefore skip straight to output,
+        // although the read name is still checked as it is for every other family
+        if (dd->optical_duplicate_distance > 0) {
+            find_irflt(family);
+            }
+        ++dd->stats.total_reads;
+        PROFILE_START(consensus_timer);
+        if (dd->stats_only) {
+            count_errors(dd, family, family_size);
+            }
+        else {
+            dedupe_single(dd, family);
+            }
+        PROFILE_STOP(STAGE_CONSENSUS, consensus_timer);
+        return;
+        }
+    else {
+        if (dd->mark_duplicates) {
+            keep_family_records(dd, family, family_size);
+            }
         sixty_percent_family_size = ((family_size * 6) / 10) + !!((family_size * 6) % 10);
-        qsort(family, family_size, sizeof(ReadPair), cmp_cigars);
+        PROFILE_START(sort_timer);
+        qsort(family, family_size, sizeof(ReadPair), cmp_cigars_qnames);
+        PROFILE_STOP(STAGE_SORT, sort_timer);
         
         for (i = 1;; ++i) {
             if (i == family_size || cmp_cigars(sub_family, family + i) != 0) {
@@ -592,6 +1720,10 @@ void cigar_family(Dedupe *dd, ReadPair *family, size_t family_size) {
                     }
                 
                 if (i == family_size) {
+                    // No consensus is written, one member is still kept
+                    if (dd->mark_duplicates) {
+                        mark_family(dd, family);
+                        }
                     return;
                     }
                 
@@ -603,15 +1735,233 @@ void cigar_family(Dedupe *dd, ReadPair *family, size_t family_size) {
                 }
             }
         }
-    
-    dd->total_reads += family_size;
-    copy_sequence_to_buffer(dd, family, family_size);
-    if (dd->optical_duplicate_distance > 0) {
-        tile_families(dd, family, family_size);
+    
+    dd->stats.total_reads += family_size;
+    // Stats only mode reads the input in place unless optical duplicates need a consensus to count
+    // the errors of the remaining member
+    if (!dd->stats_only || dd->optical_duplicate_distance > 0) {
+        copy_sequence_to_buffer(dd, family, family_size);
+        }
+    if (dd->optical_duplicate_distance > 0) {
+        tile_families(dd, family, family_size);
+        }
+    else {
+        PROFILE_START(consensus_timer);
+        if (dd->stats_only) {
+            count_errors(dd, family, family_size);
+            }
+        else {
+            trim_family(dd, family, family_size);
+            }
+        PROFILE_STOP(STAGE_CONSENSUS, consensus_timer);
+        }
+    
+    // The first member remaining is the one that the consensus is written as
+    if (dd->mark_duplicates) {
+        mark_family(dd, family);
+        }
+    }
+
+
+
+void keep_family_records(Dedupe *dd, const ReadPair *family, size_t family_size) {
+    // Members are reordered and optical duplicates removed as the family is deduped, so the records
+    // of every member are kept beforehand for mark_family
+    size_t i = 0;
+    int s = 0;
+    
+    if (2 * family_size > dd->max_family_records_len) {
+        if ((dd->family_records = realloc(dd->family_records, 2 * family_size * sizeof(const char *))) == NULL) {
+            dedupe_fail("Unable to allocate memory for family records");
+            }
+        dd->max_family_records_len = 2 * family_size;
+        }
+    for (i = 0; i < family_size; ++i) {
+        for (s = 0; s < 2; ++s) {
+            dd->family_records[(2 * i) + s] = family[i].segment[s].qname;
+            }
+        }
+    dd->family_records_len = 2 * family_size;
+    }
+
+
+
+void mark_family(Dedupe *dd, const ReadPair *kept) {
+    // Marks both records of every member kept by keep_family_records except kept as duplicates
+    size_t i = 0;
+    
+    for (i = 0; i < dd->family_records_len; ++i) {
+        if (dd->family_records[i - (i % 2)] != kept->segment[0].qname &&
+            mash_put(dd->duplicates, dd->family_records + i, sizeof(const char *), dd->family_records + i, sizeof(const char *)) == -1) {
+            dedupe_fail("Unable to add record to duplicates hash table");
+            }
+        }
+    dd->family_records_len = 0;
+    }
+
+
+
+void queue_unwritten(Dedupe *dd, const RecordRun *runs, size_t runs_len) {
+    // Adds fed runs to those waiting to be written, a run that continues the previous is joined to it
+    size_t i = 0;
+    
+    for (i = 0; i < runs_len; ++i) {
+        if (dd->unwritten_len > 0 && dd->unwritten[dd->unwritten_len - 1].source == runs[i].source &&
+            dd->unwritten[dd->unwritten_len - 1].records + dd->unwritten[dd->unwritten_len - 1].len == runs[i].records) {
+            dd->unwritten[dd->unwritten_len - 1].len += runs[i].len;
+            continue;
+            }
+        if (dd->unwritten_len == dd->max_unwritten_len) {
+            dd->max_unwritten_len = dd->max_unwritten_len ? dd->max_unwritten_len * 2 : 256;
+            if ((dd->unwritten = realloc(dd->unwritten, dd->max_unwritten_len * sizeof(RecordRun))) == NULL) {
+                dedupe_fail("Unable to allocate memory for unwritten records");
+                }
+            }
+        dd->unwritten[dd->unwritten_len++] = runs[i];
+        }
+    }
+
+
+
+void add_pending_range(void *context, const char *start, const char *end) {
+    // dedupe_reference_t collecting the ranges reported by pending_references for write_marked
+    Dedupe *dd = context;
+    
+    if (dd->pending_ranges_len == dd->max_pending_ranges_len) {
+        dd->max_pending_ranges_len = dd->max_pending_ranges_len ? dd->max_pending_ranges_len * 2 : 1024;
+        if ((dd->pending_ranges = realloc(dd->pending_ranges, dd->max_pending_ranges_len * sizeof(RecordRun))) == NULL) {
+            dedupe_fail("Unable to allocate memory for pending records");
+            }
+        }
+    dd->pending_ranges[dd->pending_ranges_len].records = start;
+    dd->pending_ranges[dd->pending_ranges_len++].len = end - start;
+    }
+
+
+
+int cmp_ranges(const void *p1, const void *p2) {
+    const char *start1 = ((const RecordRun *)p1)->records, *start2 = ((const RecordRun *)p2)->records;
+    return (start1 > start2) - (start1 < start2);
+    }
+
+
+
+void write_marked(Dedupe *dd, bool flushed) {
+    /*
+     * Writes, in the order they were fed, the records that no read or family waiting to be deduped
+     * refers to. A run is written up to the first record that is still referred to, where writing
+     * stops until the next call so that the order is kept. Runs of merged inputs lie in separate
+     * buffers and a referred to record lies within a single run, therefore only the first range
+     * beginning within each run matters, except for the range bounding the spilled records of its
+     * source which may begin before it. Once flushed everything is written. A read whose mate is on a contig not yet
+     * reached therefore holds back every record fed after it until that contig is.
+     */
+    RecordRun *run = NULL;
+    const FedSource *source = NULL;
+    const char *block = NULL;
+    size_t low = 0, high = 0, mid = 0, written = 0;
+    
+    PROFILE_START(output_timer);
+    dd->unwritten_fed = 0;
+    dd->pending_ranges_len = 0;
+    if (!flushed) {
+        pending_references(dd, add_pending_range, dd);
+        qsort(dd->pending_ranges, dd->pending_ranges_len, sizeof(RecordRun), cmp_ranges);
+        }
+    PROFILE_STOP(STAGE_OUTPUT, output_timer);
+    
+    for (written = 0; written < dd->unwritten_len; ++written) {
+        run = dd->unwritten + written;
+        block = run->records + run->len;
+        for (low = 0, high = dd->pending_ranges_len; low < high;) {
+            mid = (low + high) / 2;
+            if (dd->pending_ranges[mid].records < run->records) {
+                low = mid + 1;
+                }
+            else {
+                high = mid;
+                }
+            }
+        if (low < dd->pending_ranges_len && dd->pending_ranges[low].records < block) {
+            block = dd->pending_ranges[low].records;
+            }
+        source = dd->sources + run->source;
+        if (!flushed && dd->spill->records > 0 && source->spilled_start != NULL &&
+            source->spilled_start < run->records && source->spilled_end > run->records) {
+            block = run->records;
+            }
+        
+        write_records_marked(dd, run->records, block);
+        run->len -= block - run->records;
+        run->records = block;
+        if (run->len > 0) {
+            break;
+            }
+        }
+    
+    memmove(dd->unwritten, dd->unwritten + written, (dd->unwritten_len - written) * sizeof(RecordRun));
+    dd->unwritten_len -= written;
+    }
+
+
+
+void write_records_marked(Dedupe *dd, const char *records, const char *end) {
+    // Writes the records as they are except for the flag of each marked record, which is written
+    // again with the duplicate bit set
+    const char *record = NULL, *next = NULL, *flag = NULL, *flag_end = NULL;
+    char formatted[8];
+    size_t data_size = 0;
+    long val = 0;
+    int len = 0;
+    
+    for (record = records; record < end && dd->duplicates->entries_occupied > 0; record = next) {
+        next = memchr(record, '\n', end - record);
+        next = next != NULL ? next + 1 : end;
+        if (mash_pop(dd->duplicates, &record, sizeof(const char *), &data_size) == NULL) {
+            continue;
+            }
+        
+        // Every marked record was parsed when fed therefore has a valid flag
+        flag = (const char *)memchr(record, '\t', next - record) + 1;
+        val = strtol(flag, (char **)&flag_end, 10);
+        len = snprintf(formatted, sizeof(formatted), "%li", val | DUPLICATE);
+        write_output(dd, records, flag - records);
+        write_output(dd, formatted, len);
+        records = flag_end;
+        }
+    if (end > records) {
+        write_output(dd, records, end - records);
         }
-    else {
-        trim_family(dd, family, family_size);
+    }
+
+
+
+void count_family_size(Dedupe *dd, size_t family_size, uint32_t subsample_hash) {
+    // subsample_hash is the lowest of the subsample hashes of the members, the family is seen by a
+    // subsample of read pairs if that member is selected
+    if (stats_add_family(&dd->stats, family_size, subsample_hash) == -1) {
+        dedupe_fail("Unable to allocate memory for family_sizes statistics");
+        }
+    PROFILE_COUNT(COUNT_FAMILIES, 1);
+    }
+
+
+
+uint32_t subsample_hash(const char *qname, size_t qname_len) {
+    // Uniform hash of the qname used to select read pairs, as samtools view -s does, so that both
+    // mates and every run agree. FNV-1a followed by the murmur3 finaliser to spread the high bits.
+    uint32_t hash = 2166136261u;
+    size_t i = 0;
+    
+    for (i = 0; i < qname_len; ++i) {
+        hash = (hash ^ (unsigned char)qname[i]) * 16777619u;
         }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
     }
 
 
@@ -638,8 +1988,7 @@ void copy_sequence_to_buffer(Dedupe *dd, ReadPair *family, size_t family_size) {
     if ((required_len = max_seq_len * 4 * family_size) > dd->buffer_len) {
         free(dd->buffer);
         if ((dd->buffer = malloc(required_len)) == NULL) {
-            fprintf(stderr, "Error: Unable to allocate memory for sequence buffer\n");
-            exit(EXIT_FAILURE);
+            dedupe_fail("Unable to allocate memory for sequence buffer");
             }
         dd->buffer_len = required_len;
         }
@@ -659,26 +2008,33 @@ void copy_sequence_to_buffer(Dedupe *dd, ReadPair *family, size_t family_size) {
 
 
 
-void tile_families(Dedupe *dd, ReadPair *family, size_t family_size) {
+void find_irflt(ReadPair *readpair) {
+    // Sets irflt_len, failing if the qname is not an illumina read name
     int colon_count = 0;
-    size_t i = 0, j = 0, sub_family_size = 1, removed = 0;
+    size_t j = 0;
+
+    for (j = 0; j < readpair->segment[0].qname_len; ++j) {
+        if (readpair->segment[0].qname[j] == ':' && ++colon_count == 5) {
+            readpair->irflt_len = j;
+            return;
+            }
+        }
+    dedupe_fail("Invalid illumina read name");
+    }
+
+
+
+void tile_families(Dedupe *dd, ReadPair *family, size_t family_size) {
+    size_t i = 0, sub_family_size = 1, removed = 0;
     ReadPair *sub_family = family;
 
     for (i = 0; i < family_size; ++i) {
-        colon_count = 0;
-        for (j = 0; j < family[i].segment[0].qname_len; ++j) {
-            if (family[i].segment[0].qname[j] == ':' && ++colon_count == 5) {
-                family[i].irflt_len = j;
-                break;
-                }
-            }
-        if (colon_count != 5) {
-            fprintf(stderr, "Error: Invalid illumina read name\n");
-            exit(EXIT_FAILURE);
-            }
+        find_irflt(family + i);
         }
     
-    qsort(family, family_size, sizeof(ReadPair), cmp_irflts);
+    PROFILE_START(sort_timer);
+    qsort(family, family_size, sizeof(ReadPair), cmp_irflts_qnames);
+    PROFILE_STOP(STAGE_SORT, sort_timer);
     
     for (i = 1;; ++i) {
         if (i == family_size || cmp_irflts(sub_family, family + i) != 0) {
@@ -703,7 +2059,14 @@ void tile_families(Dedupe *dd, ReadPair *family, size_t family_size) {
             }
         }
     
-    trim_family(dd, family, family_size);
+    PROFILE_START(consensus_timer);
+    if (dd->stats_only) {
+        count_errors(dd, family, family_size);
+        }
+    else {
+        trim_family(dd, family, family_size);
+        }
+    PROFILE_STOP(STAGE_CONSENSUS, consensus_timer);
     }
 
 
@@ -723,8 +2086,7 @@ size_t coordinate_families(Dedupe *dd, ReadPair *family, size_t family_size) {
         errno = 0;
         val = strtol(coordinate, (char **)&endptr, 10);
         if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == coordinate)) {
-            fprintf(stderr, "Error: Invalid illumina read name x coordinate\n");
-            exit(EXIT_FAILURE);
+            dedupe_fail("Invalid illumina read name x coordinate");
             }
         family[i].optical_x = (int)val;
 
@@ -732,8 +2094,7 @@ size_t coordinate_families(Dedupe *dd, ReadPair *family, size_t family_size) {
         errno = 0;
         val = strtol(coordinate, (char **)&endptr, 10);
         if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == coordinate)) {
-            fprintf(stderr, "Error: Invalid illumina read name y coordinate\n");
-            exit(EXIT_FAILURE);
+            dedupe_fail("Invalid illumina read name y coordinate");
             }
         family[i].optical_y = (int)val;
         }
@@ -789,7 +2150,7 @@ void dedupe_optical(Dedupe *dd, ReadPair *family, size_t family_size) {
     int read = 0, counts[5] = {0}, quals[5] = {0}, b = 0, q = 0, winner = 0, i = 0, j = 0;
     Segment *first = NULL, *second = NULL;
     
-    dd->optical_duplicates += family_size - 1;
+    dd->stats.optical_duplicates += family_size - 1;
     
     if (family_size == 2) {
         for (read = 0; read < 2; ++read) {
@@ -838,279 +2199,856 @@ void dedupe_optical(Dedupe *dd, ReadPair *family, size_t family_size) {
                         }
                     }
                 
-                if (counts[winner] >= sixty_percent_family_size) {
-                    family[0].segment[read].seq[i] = bases[winner];
-                    family[0].segment[read].qual[i] = quals[winner] + 33;
+                if (counts[winner] >= sixty_percent_family_size) {
+                    family[0].segment[read].seq[i] = bases[winner];
+                    family[0].segment[read].qual[i] = quals[winner] + 33;
+                    }
+                else {
+                    family[0].segment[read].seq[i] = 'N';
+                    family[0].segment[read].qual[i] = '!';
+                    }
+                }
+            }
+        }
+    }
+
+
+
+int base(char base) {
+    switch (base) {
+        case 'A':
+            return 0;
+        case 'C':
+            return 1;
+        case 'G':
+            return 2;
+        case 'T':
+            return 3;
+        default:
+            return 4;
+        }
+    }
+
+
+
+char reversebase(char base) {
+    switch (base) {
+        case 'A':
+            return 'T';
+        case 'C':
+            return 'G';
+        case 'G':
+            return 'C';
+        case 'T':
+            return 'A';
+        default:
+            return 'N';
+        }
+    }
+
+
+
+bool overlap_family(ReadPair *family, size_t family_size, int *left, int *right, int32_t *left_start, int32_t *right_end) {
+    int32_t lref = 0, rref = 0, lread = 0, rread = 0, num = 0;
+    int i = 0, l = 0, r = 1, swap = 0, overhang = 0;
+    const char *cigar = NULL, *cigar_end = NULL, *op = NULL;
+    
+    // Mappend to the same reference and pointing in different directions therefore may be a concordant pair
+    // otherwise skip
+    if ((family->segment[l].flag & UNMAPPED) || (family->segment[r].flag & UNMAPPED) ||
+        family->segment[l].rname_len != family->segment[r].rname_len || memcmp(family->segment[l].rname, family->segment[r].rname, family->segment[l].rname_len) != 0 ||
+        (family->segment[l].flag & REVERSE) == (family->segment[r].flag & REVERSE)) {
+        return false;
+        }
+    
+    // Ensure the left segment has the lowest ref pos
+    lref = family->segment[l].pos;
+    rref = family->segment[r].pos;
+    if (rref < lref) {
+        l = 1;
+        r = 0;
+        lref = family->segment[l].pos;
+        rref = family->segment[r].pos;
+        }
+        
+    lref -= 1;
+    lread = -1;
+    cigar = family->segment[l].cigar;
+    cigar_end = cigar + family->segment[l].cigar_len;
+    for (; cigar < cigar_end;) {
+        cigar = cigar_op(cigar, &op, &num);
+        if (strchr(CONSUMES_REF, *op) != NULL) {
+            if (lref + num > rref) {
+                num = rref - lref;
+                }
+            lref += num;
+            }
+        
+        if (strchr(CONSUMES_READ, *op) != NULL) {
+            lread += num;
+            }
+        
+        if (lref == rref) {
+            break;
+            }
+        }
+    
+    if (lref != rref) {
+        return false;
+        }
+    
+    cigar = family->segment[r].cigar;
+    cigar_end = cigar + family->segment[r].cigar_len;
+    for (; cigar < cigar_end;) {
+        cigar = cigar_op(cigar, &op, &num);
+        if (strchr(CONSUMES_REF, *op) != NULL) {
+            break;
+            }
+        
+        if (strchr(CONSUMES_READ, *op) != NULL) {
+            lread -= num;
+            }
+        }
+    
+    
+    // Now ensure the left segment is correctly orientated
+    if (family->segment[l].flag & REVERSE) {
+        swap = l;
+        l = r;
+        r = swap;
+        lread = -lread;
+        }
+    
+    // lread is the position of the base in the left read that
+    // overlaps the first base in the right read. If lread is less
+    // than zero then there is readthrough of the right read into
+    // the left umi
+    if (lread < 0) {
+        for (i = 0; i < family_size; ++i) {
+            family[i].segment[r].seq -= lread;
+            family[i].segment[r].seq_len += lread;
+            family[i].segment[r].qual -= lread;
+            }
+        lread = 0;
+        }
+        
+    // rread is the position of the base in the right read that
+    // overlaps the last base in the left read. If rread is
+    // greater than or equal to right read length then there is 
+    // readthrough of the left read into the right umi
+    if ((rread = family->segment[l].seq_len - lread - 1) >= family->segment[r].seq_len) {
+        overhang = rread - family->segment[r].seq_len + 1;
+        for (i = 0; i < family_size; ++i) {
+            family[i].segment[l].seq_len -= overhang;
+            }
+        rread = family->segment[r].seq_len - 1;
+        }
+    
+    *left = l;
+    *right = r;
+    *left_start = lread;
+    *right_end = rread;
+    return true;
+    }
+
+
+
+void trim_family(Dedupe *dd, ReadPair *family, size_t family_size) {
+    int32_t lread = 0, rread = 0;
+    int i = 0, j = 0, l = 0, r = 1, mismatches = 0;
+    
+    if (overlap_family(family, family_size, &l, &r, &lread, &rread)) {
+        for (i = 0; i < family_size; ++i) {
+            for (j = 0; j <= rread; ++j) {
+                if (family[i].segment[l].seq[j + lread] != family[i].segment[r].seq[j]) {
+                    ++mismatches;
+                    if (family[i].segment[l].qual[j + lread] > family[i].segment[r].qual[j] + 10) {
+                        family[i].segment[r].seq[j] = family[i].segment[l].seq[j + lread];
+                        family[i].segment[r].qual[j] = family[i].segment[l].qual[j + lread];
+                        }
+                    else if (family[i].segment[r].qual[j] > family[i].segment[l].qual[j + lread] + 10) {
+                        family[i].segment[l].seq[j + lread] = family[i].segment[r].seq[j];
+                        family[i].segment[l].qual[j + lread] = family[i].segment[r].qual[j];
+                        }
+                    else {
+                        family[i].segment[r].seq[j] = 'N';
+                        family[i].segment[r].qual[j] = '!';
+                        family[i].segment[l].seq[j + lread] = 'N';
+                        family[i].segment[l].qual[j + lread] = '!';
+                        }
+                    }
+                }
+            }
+
+        dd->stats.sequencing_errors += mismatches;
+        dd->stats.sequencing_total += rread;
+        }
+
+    dedupe_pcr(dd, family, family_size);
+   }
+
+
+
+void count_errors(Dedupe *dd, ReadPair *family, size_t family_size) {
+    // Stats only equivalent of trim_family followed by dedupe_pcr. Bases are counted member by member
+    // into per position accumulators, as consensus_add does, rather than position by position across
+    // members, indexed by BASE_CODES so that N and anything else is slot 0. The input is read only
+    // therefore overlap corrections are applied by replacing the contribution of the uncorrected base.
+    int32_t lread = 0, rread = 0;
+    int l = 0, r = 1, s = 0, read = 0, r1r2[2] = {0}, mismatches = 0, total = 0, sum = 0, most = 0, *counts = NULL;
+    size_t len = 0, i = 0, j = 0, k = 0, mate = 0;
+    const char *seq = NULL;
+    char corrected = '\0', mate_base = '\0', qual = '\0', mate_qual = '\0';
+    bool overlap = false;
+    
+    if ((overlap = overlap_family(family, family_size, &l, &r, &lread, &rread))) {
+        for (j = 0; j < family_size; ++j) {
+            for (k = 0; k <= rread; ++k) {
+                if (family[j].segment[l].seq[k + lread] != family[j].segment[r].seq[k]) {
+                    ++mismatches;
+                    }
+                }
+            }
+        dd->stats.sequencing_errors += mismatches;
+        dd->stats.sequencing_total += rread;
+        mismatches = 0;
+        }
+    
+    dd->stats.pcr_duplicates += family_size - 1;
+    read_order(family, r1r2);
+    if (family_size == 1) {
+        return;
+        }
+    
+    for (s = 0; s < 2; ++s) {
+        read = r1r2[s];
+        if (family->segment[read].flag & UNMAPPED) {
+            continue;
+            }
+        
+        len = family->segment[read].seq_len;
+        if (len * 5 > dd->max_error_counts_len) {
+            free(dd->error_counts);
+            if ((dd->error_counts = malloc(len * 5 * sizeof(int))) == NULL) {
+                dedupe_fail("Unable to allocate memory for error accumulators");
+                }
+            dd->max_error_counts_len = len * 5;
+            }
+        counts = dd->error_counts;
+        memset(counts, 0, len * 5 * sizeof(int));
+        
+        for (j = 0; j < family_size; ++j) {
+            seq = family[j].segment[read].seq;
+            for (i = 0; i < len; ++i) {
+                ++counts[(i * 5) + BASE_CODES[(uint8_t)seq[i]]];
+                }
+            
+            if (overlap) {
+                for (k = 0; k <= rread; ++k) {
+                    i = read == l ? k + lread : k;
+                    mate = read == l ? k : k + lread;
+                    if (seq[i] != (mate_base = family[j].segment[!read].seq[mate])) {
+                        qual = family[j].segment[read].qual[i];
+                        mate_qual = family[j].segment[!read].qual[mate];
+                        corrected = mate_qual > qual + 10 ? mate_base : qual > mate_qual + 10 ? seq[i] : 'N';
+                        --counts[(i * 5) + BASE_CODES[(uint8_t)seq[i]]];
+                        ++counts[(i * 5) + BASE_CODES[(uint8_t)corrected]];
+                        }
+                    }
+                }
+            }
+        
+        // As counted by call_base, every base other than the most frequent is a mismatch, the
+        // consensus itself is not needed
+        for (i = 0; i < len; ++i, counts += 5) {
+            sum = counts[1] + counts[2] + counts[3] + counts[4];
+            most = counts[1] > counts[2] ? counts[1] : counts[2];
+            most = counts[3] > most ? counts[3] : most;
+            most = counts[4] > most ? counts[4] : most;
+            total += sum;
+            mismatches += sum - most;
+            }
+        
+        dd->stats.pcr_errors += mismatches;
+        dd->stats.pcr_total += total;
+        }
+    }
+
+
+
+void read_order(ReadPair *readpair, int *r1r2) {
+    if (((readpair->segment[0].flag & READX) == READ1) && ((readpair->segment[1].flag & READX) == READ2)) {
+        r1r2[0] = 0;
+        r1r2[1] = 1;
+        }
+    else if (((readpair->segment[0].flag & READX) == READ2) && ((readpair->segment[1].flag & READX) == READ1)) {
+        r1r2[0] = 1;
+        r1r2[1] = 0;
+        }
+    else {
+        dedupe_fail("Invalid first/last segment flags within read pair");
+        }
+    }
+
+
+
+void dedupe_single(Dedupe *dd, ReadPair *readpair) {
+    // Fast path for a family of one. There is no consensus to build therefore seq and qual are
+    // copied straight from the input into the output buffer, reverse complemented as required,
+    // and any overlap corrections are then patched into the output.
+    int32_t lread = 0, rread = 0;
+    int i = 0, j = 0, l = 0, r = 1, read = 0, r1r2[2] = {0}, mismatches = 0, index = 0;
+    size_t required_len = 0;
+    char *buffer = NULL, *seq[2] = {NULL}, *qual[2] = {NULL}, lbase = '\0', rbase = '\0', lqual = '\0', rqual = '\0';
+    Segment *segment = NULL;
+    bool overlap = false;
+    
+    read_order(readpair, r1r2);
+    overlap = overlap_family(readpair, 1, &l, &r, &lread, &rread);
+    
+    // '@' + " XF:i:1\n" + "\n+\n" + '\n' = 13
+    required_len = readpair->segment[0].qname_len + (readpair->segment[0].seq_len * 2) + 
+                   readpair->segment[1].qname_len + (readpair->segment[1].seq_len * 2) + 26;
+    if (required_len > dd->buffer_len) {
+        free(dd->buffer);
+        if ((dd->buffer = malloc(required_len)) == NULL) {
+            dedupe_fail("Unable to allocate memory for sequence buffer");
+            }
+        dd->buffer_len = required_len;
+        }
+    
+    buffer = dd->buffer;
+    for (i = 0; i < 2; ++i) {
+        read = r1r2[i];
+        segment = readpair->segment + read;
+        
+        *buffer++ = '@';
+        memcpy(buffer, segment->qname, segment->qname_len);
+        buffer += segment->qname_len;
+        memcpy(buffer, " XF:i:1\n", 8);
+        buffer += 8;
+        
+        seq[read] = buffer;
+        if (segment->flag & REVERSE) {
+            reversecomplement_copy(buffer, segment->seq, segment->seq_len);
+            }
+        else {
+            memcpy(buffer, segment->seq, segment->seq_len);
+            }
+        buffer += segment->seq_len;
+        memcpy(buffer, "\n+\n", 3);
+        buffer += 3;
+        
+        qual[read] = buffer;
+        if (segment->flag & REVERSE) {
+            reverse_copy(buffer, segment->qual, segment->seq_len);
+            }
+        else {
+            memcpy(buffer, segment->qual, segment->seq_len);
+            }
+        buffer += segment->seq_len;
+        *buffer++ = '\n';
+        }
+    
+    if (overlap) {
+        for (j = 0; j <= rread; ++j) {
+            lbase = readpair->segment[l].seq[j + lread];
+            rbase = readpair->segment[r].seq[j];
+            if (lbase != rbase) {
+                ++mismatches;
+                lqual = readpair->segment[l].qual[j + lread];
+                rqual = readpair->segment[r].qual[j];
+                if (lqual > rqual + 10) {
+                    rbase = lbase;
+                    rqual = lqual;
+                    }
+                else if (rqual > lqual + 10) {
+                    lbase = rbase;
+                    lqual = rqual;
+                    }
+                else {
+                    lbase = rbase = 'N';
+                    lqual = rqual = '!';
+                    }
+                
+                // The input is read only therefore patch the corrections directly into the output
+                index = j + lread;
+                if (readpair->segment[l].flag & REVERSE) {
+                    index = readpair->segment[l].seq_len - index - 1;
+                    lbase = reversebase(lbase);
+                    }
+                seq[l][index] = lbase;
+                qual[l][index] = lqual;
+                
+                index = j;
+                if (readpair->segment[r].flag & REVERSE) {
+                    index = readpair->segment[r].seq_len - index - 1;
+                    rbase = reversebase(rbase);
+                    }
+                seq[r][index] = rbase;
+                qual[r][index] = rqual;
+                }
+            }
+        
+        dd->stats.sequencing_errors += mismatches;
+        dd->stats.sequencing_total += rread;
+        }
+    
+    if (dd->min_family_size <= 1) {
+        write_output(dd, dd->buffer, buffer - dd->buffer);
+        }
+    }
+
+
+
+void write_output(Dedupe *dd, const char *data, size_t len) {
+    int strand = dd->duplex_strand;
+    
+    if (strand >= 0) {
+        if (dd->duplex_held_len[strand] + len > dd->max_duplex_held_len[strand]) {
+            dd->max_duplex_held_len[strand] = (dd->duplex_held_len[strand] + len) * 2;
+            if ((dd->duplex_held[strand] = realloc(dd->duplex_held[strand], dd->max_duplex_held_len[strand])) == NULL) {
+                dedupe_fail("Unable to allocate memory for duplex consensus");
+                }
+            }
+        memcpy(dd->duplex_held[strand] + dd->duplex_held_len[strand], data, len);
+        dd->duplex_held_len[strand] += len;
+        return;
+        }
+    
+    PROFILE_START(output_timer);
+    if (dd->output != NULL) {
+        if (dd->output(dd->output_context, data, len) != 0) {
+            dedupe_fail("Unable to write output");
+            }
+        }
+    else if (fwrite(data, 1, len, dd->output_file) != len) {
+        dedupe_fail("Unable to write to output file");
+        }
+    PROFILE_STOP(STAGE_OUTPUT, output_timer);
+    }
+
+
+
+void dedupe_pcr(Dedupe *dd, ReadPair *family, size_t family_size) {
+    size_t sixty_percent_family_size = 0, len = 0;
+    char *corrected_seq = NULL, *corrected_qual = NULL;
+    int i = 0, j = 0, counts[5] = {0}, quals[5] = {0}, r = 0, r1r2[2] = {0}, read = 0, b = 0, mismatches = 0, total = 0;
+    
+    dd->stats.pcr_duplicates += family_size - 1;
+    read_order(family, r1r2);
+    
+    sixty_percent_family_size = ((family_size * 6) / 10) + !!((family_size * 6) % 10);
+    
+    for (r = 0; r < 2; ++r) {
+        read = r1r2[r];
+        
+        // len will be the same for all family members.
+        len = family->segment[read].seq_len;
+        // Write corrected data to the first family member
+        corrected_seq = family->segment[read].seq;
+        corrected_qual = family->segment[read].qual;
+        
+        if (family_size > 1 && !(family->segment[read].flag & UNMAPPED)) {
+            for (i = 0; i < len; ++i) {
+                memset(counts, 0, 5 * sizeof(int));
+                memset(quals, 0, 5 * sizeof(int));
+                
+                for (j = 0; j < family_size; ++j) {
+                    b = base(family[j].segment[read].seq[i]);
+                    ++counts[b];
+                    quals[b] += dd->model.weights[(unsigned char)family[j].segment[read].qual[i]];
+                    }
+                
+                if (dd->model.likelihood) {
+                    call_base_likelihood(&dd->model, counts, quals, corrected_seq + i, corrected_qual + i, &mismatches, &total);
                     }
                 else {
-                    family[0].segment[read].seq[i] = 'N';
-                    family[0].segment[read].qual[i] = '!';
+                    call_base(counts, quals, sixty_percent_family_size, corrected_seq + i, corrected_qual + i, &mismatches, &total);
                     }
                 }
+            
+            dd->stats.pcr_errors += mismatches;
+            dd->stats.pcr_total += total;;
             }
+        
+        write_fastq(dd, family->segment + read, family_size, corrected_seq, corrected_qual, len);
         }
     }
 
 
 
-int base(char base) {
-    switch (base) {
-        case 'A':
-            return 0;
-        case 'C':
-            return 1;
-        case 'G':
-            return 2;
-        case 'T':
-            return 3;
-        default:
-            return 4;
+void call_base(int *counts, int *quals, size_t sixty_percent_family_size, char *seq, char *qual, int *mismatches, int *total) {
+    int b = 0, q = 0, phred = 0, winner = 0;
+    
+    quals[4] = 0;
+    
+    winner = 0;
+    *total += counts[0];
+    for (b = 1; b < 4; ++b) {
+        *total += counts[b];
+        if (counts[b] > counts[winner]) {
+            *mismatches += counts[winner];
+            winner = b;
+            }
+        else {
+            *mismatches += counts[b];
+            }
+        }
+    
+    if (counts[winner] >= sixty_percent_family_size) {
+        phred = 0;
+        for (q = 0; q < 4; ++q) {
+            if (q == winner) {
+                phred += quals[q];
+                }
+            else {
+                phred -= quals[q];
+                }
+            }
+        if (phred < 0) {
+            phred = 0;
+            }
+        else if (phred > 93) {
+            phred = 93;
+            }
+        
+        *seq = bases[winner];
+        *qual = phred + 33;
+        }
+    else {
+        *seq = 'N';
+        *qual = '!';
         }
     }
 
 
 
-char reversebase(char base) {
-    switch (base) {
-        case 'A':
-            return 'T';
-        case 'C':
-            return 'G';
-        case 'G':
-            return 'C';
-        case 'T':
-            return 'A';
-        default:
-            return 'N';
+void call_base_likelihood(const QualityModel *model, int *counts, int *scores, char *seq, char *qual, int *mismatches, int *total) {
+    /*
+     * scores are the sums of the weights of the members observing each base, the log likelihood of
+     * that base being the true one less a term common to all. The winner is the base with the
+     * highest score, its error is the posterior probability of any other and so is found by adding
+     * 10^(-d/100) for each other base d tenths of a phred behind it. A tie with no evidence for
+     * either base is N.
+     */
+    int b = 0, winner = 0, d = 0, sum = INT_MAX, low = 0, gap = 0, phred = 0, observed = 0;
+    bool tied = false;
+    
+    for (b = 0; b < 4; ++b) {
+        observed += counts[b];
+        if (scores[b] > scores[winner]) {
+            winner = b;
+            }
+        }
+    *total += observed;
+    *mismatches += observed - counts[winner];
+    
+    // sum is the probability of every other base so far, in tenths of a phred
+    for (b = 0; b < 4; ++b) {
+        if (b != winner) {
+            d = scores[winner] - scores[b];
+            tied = tied || d == 0;
+            if (sum == INT_MAX) {
+                sum = d;
+                }
+            else {
+                low = d < sum ? d : sum;
+                gap = abs(d - sum);
+                sum = low - (gap < LOG_SUM_LEN ? model->log_sum[gap] : 0);
+                }
+            }
         }
+    
+    if (observed == 0 || tied) {
+        *seq = 'N';
+        *qual = '!';
+        return;
+        }
+    
+    // Dividing by the total probability, that of the winner being 1 relative to the others. Below 0
+    // the other bases together are more probable than the winner.
+    if (sum >= 0) {
+        phred = sum + (sum < LOG_SUM_LEN ? model->log_sum[sum] : 0);
+        }
+    else {
+        phred = -sum < LOG_SUM_LEN ? model->log_sum[-sum] : 0;
+        }
+    phred = (phred + 5) / 10;
+    *seq = bases[winner];
+    *qual = (phred > 93 ? 93 : phred) + 33;
     }
 
 
 
-void trim_family(Dedupe *dd, ReadPair *family, size_t family_size) {
-    int32_t lref = 0, rref = 0, lread = 0, rread = 0, num = 0;
-    int i = 0, j = 0, l = 0, r = 1, swap = 0, overhang = 0, mismatches = 0;
-    const char *cigar = NULL, *cigar_end = NULL, *op = NULL;
+void quality_model_init(QualityModel *model, bool likelihood) {
+    /*
+     * The only logs taken are here. A member observing base b with error probability e has likelihood
+     * 1 - e if b is true and e / 3 otherwise, so the score of each base need only count its own
+     * observers, weighted by 100 * log10((1 - e) / (e / 3)). Qualities of 1 or less, where e / 3 is no
+     * smaller than 1 - e, carry no evidence.
+     */
+    double e = 0;
+    int c = 0, q = 0;
     
-    // Mappend to the same reference and pointing in different directions therefore may be a concordant pair
-    // otherwise skip
-    if ((!(family->segment[l].flag & UNMAPPED)) && (!(family->segment[r].flag & UNMAPPED)) &&
-        family->segment[l].rname_len == family->segment[r].rname_len && memcmp(family->segment[l].rname, family->segment[r].rname, family->segment[l].rname_len) == 0 &&
-        (family->segment[l].flag & REVERSE) != (family->segment[r].flag & REVERSE)) {
+    model->likelihood = likelihood;
+    for (c = 0; c < 256; ++c) {
+        q = c - 33;
+        if (!likelihood) {
+            model->weights[c] = q;
+            }
+        else {
+            q = q > 93 ? 93 : q;
+            e = pow(10, -q / 10.0);
+            model->weights[c] = e >= 0.75 ? 0 : (int)lround(100 * log10((1 - e) / (e / 3)));
+            }
+        }
+    for (c = 0; c < LOG_SUM_LEN; ++c) {
+        model->log_sum[c] = (int)lround(100 * log10(1 + pow(10, -c / 100.0)));
+        }
+    }
+
+
+
+void write_fastq(Dedupe *dd, Segment *segment, size_t family_size, char *seq, char *qual, size_t len) {
+    size_t record_len = 0;
     
+    if (segment->flag & REVERSE) {
+        reversecomplement(seq, len);
+        reverse(qual, len);
+        }
     
-        // Ensure the left segment has the lowest ref pos
-        lref = family->segment[l].pos;
-        rref = family->segment[r].pos;
-        if (rref < lref) {
-            l = 1;
-            r = 0;
-            lref = family->segment[l].pos;
-            rref = family->segment[r].pos;
-            }
-            
-        lref -= 1;
-        lread = -1;
-        cigar = family->segment[l].cigar;
-        cigar_end = cigar + family->segment[l].cigar_len;
-        for (; cigar < cigar_end;) {
-            cigar = cigar_op(cigar, &op, &num);
-            if (strchr(CONSUMES_REF, *op) != NULL) {
-                if (lref + num > rref) {
-                    num = rref - lref;
-                    }
-                lref += num;
+    if (family_size >= dd->min_family_size) {
+        // Room for the qname, tag, sequence, quality and separators with a 20 digit family size
+        record_len = segment->qname_len + (2 * len) + 40;
+        if (record_len > dd->max_record_len) {
+            if ((dd->record = realloc(dd->record, record_len)) == NULL) {
+                dedupe_fail("Unable to allocate memory for output record");
                 }
-            
-            if (strchr(CONSUMES_READ, *op) != NULL) {
-                lread += num;
+            dd->max_record_len = record_len;
+            }
+        record_len = snprintf(dd->record, dd->max_record_len, "@%.*s XF:i:%i\n%.*s\n+\n%.*s\n", (int)segment->qname_len, segment->qname,
+                                                                                                (int)family_size, 
+                                                                                                (int)len, seq,
+                                                                                                (int)len, qual);
+        write_output(dd, dd->record, record_len);
+        }
+    }
+
+
+
+void consensus_add(Dedupe *dd, ReadPair *readpair) {
+    // Adds a family member to the accumulators for its pair of cigars. This is used in place of
+    // collecting the whole family in dd->readpairs when no grouping step needs to see every member
+    // at once, therefore memory is proportional to the number of distinct cigars, not family size.
+    Consensus *consensus = NULL;
+    ReadPair member = *readpair;
+    size_t i = 0, required_len = 0, index = 0;
+    int32_t lread = 0, rread = 0;
+    int j = 0, l = 0, r = 1, s = 0, b = 0, mismatches = 0, *counts = NULL, *quals = NULL;
+    uint32_t hash = 0;
+    char lbase = '\0', rbase = '\0', lqual = '\0', rqual = '\0';
+    bool overlap = false;
+    void *ptr = NULL;
+    
+    for (i = 0; i < dd->consensus_len; ++i) {
+        if (cmp_cigars(&dd->consensus[i].first, readpair) == 0) {
+            consensus = dd->consensus + i;
+            break;
+            }
+        }
+    
+    if (consensus == NULL) {
+        if (dd->consensus_len == dd->max_consensus_len) {
+            if ((ptr = realloc(dd->consensus, (dd->max_consensus_len + 1) * sizeof(Consensus))) == NULL) {
+                dedupe_fail("Unable to allocate memory for consensus accumulators");
                 }
-            
-            if (lref == rref) {
-                break;
+            dd->consensus = (Consensus *)ptr;
+            memset(dd->consensus + dd->max_consensus_len, 0, sizeof(Consensus));
+            ++dd->max_consensus_len;
+            }
+        consensus = dd->consensus + dd->consensus_len++;
+        consensus->first = *readpair;
+        consensus->family_size = 0;
+        consensus->subsample_hash = UINT32_MAX;
+        consensus->sequencing_errors = 0;
+        consensus->sequencing_total = 0;
+        }
+    else if (cmp_qnames(readpair, &consensus->first) < 0) {
+        // As when the whole family is collected the consensus is named after the least qname
+        consensus->first = *readpair;
+        }
+    
+    overlap = overlap_family(&member, 1, &l, &r, &lread, &rread);
+    if ((hash = subsample_hash(member.segment[0].qname, member.segment[0].qname_len)) < consensus->subsample_hash) {
+        consensus->subsample_hash = hash;
+        }
+    
+    if (consensus->family_size++ == 0) {
+        // Cigars are identical therefore trimmed lengths will be the same for all members
+        required_len = 0;
+        for (s = 0; s < 2; ++s) {
+            consensus->seq_len[s] = member.segment[s].flag & UNMAPPED ? 0 : member.segment[s].seq_len;
+            if (consensus->seq_len[s] > required_len) {
+                required_len = consensus->seq_len[s];
                 }
             }
         
-        if (lref == rref) {
-            cigar = family->segment[r].cigar;
-            cigar_end = cigar + family->segment[r].cigar_len;
-            for (; cigar < cigar_end;) {
-                cigar = cigar_op(cigar, &op, &num);
-                if (strchr(CONSUMES_REF, *op) != NULL) {
-                    break;
-                    }
-                
-                if (strchr(CONSUMES_READ, *op) != NULL) {
-                    lread -= num;
-                    }
-                }
-            
-            
-            // Now ensure the left segment is correctly orientated
-            if (family->segment[l].flag & REVERSE) {
-                swap = l;
-                l = r;
-                r = swap;
-                lread = -lread;
-                }
-            
-            // lread is the position of the base in the left read that
-            // overlaps the first base in the right read. If lread is less
-            // than zero then there is readthrough of the right read into
-            // the left umi
-            if (lread < 0) {
-                for (i = 0; i < family_size; ++i) {
-                    family[i].segment[r].seq -= lread;
-                    family[i].segment[r].seq_len += lread;
-                    family[i].segment[r].qual -= lread;
-                    }
-                lread = 0;
+        if (required_len > consensus->max_seq_len) {
+            free(consensus->counts);
+            free(consensus->quals);
+            if ((consensus->counts = malloc(required_len * 10 * sizeof(int))) == NULL ||
+                (consensus->quals = malloc(required_len * 10 * sizeof(int))) == NULL) {
+                dedupe_fail("Unable to allocate memory for consensus accumulators");
                 }
+            consensus->max_seq_len = required_len;
+            }
+        memset(consensus->counts, 0, consensus->max_seq_len * 10 * sizeof(int));
+        memset(consensus->quals, 0, consensus->max_seq_len * 10 * sizeof(int));
+        }
+    
+    for (s = 0; s < 2; ++s) {
+        counts = consensus->counts + (s * consensus->max_seq_len * 5);
+        quals = consensus->quals + (s * consensus->max_seq_len * 5);
+        for (i = 0; i < consensus->seq_len[s]; ++i, counts += 5, quals += 5) {
+            b = base(member.segment[s].seq[i]);
+            ++counts[b];
+            quals[b] += dd->model.weights[(unsigned char)member.segment[s].qual[i]];
+            }
+        }
+    
+    // The input is read only therefore overlap corrections are applied by replacing the
+    // contribution of the uncorrected bases within the accumulators
+    if (overlap) {
+        for (j = 0; j <= rread; ++j) {
+            lbase = member.segment[l].seq[j + lread];
+            rbase = member.segment[r].seq[j];
+            if (lbase != rbase) {
+                ++mismatches;
+                lqual = member.segment[l].qual[j + lread];
+                rqual = member.segment[r].qual[j];
+                
+                index = ((l * consensus->max_seq_len) + j + lread) * 5;
+                --consensus->counts[index + base(lbase)];
+                consensus->quals[index + base(lbase)] -= dd->model.weights[(unsigned char)lqual];
+                index = ((r * consensus->max_seq_len) + j) * 5;
+                --consensus->counts[index + base(rbase)];
+                consensus->quals[index + base(rbase)] -= dd->model.weights[(unsigned char)rqual];
                 
-            // rread is the position of the base in the right read that
-            // overlaps the last base in the left read. If rread is
-            // greater than or equal to right read length then there is 
-            // readthrough of the left read into the right umi
-            if ((rread = family->segment[l].seq_len - lread - 1) >= family->segment[r].seq_len) {
-                overhang = rread - family->segment[r].seq_len + 1;
-                for (i = 0; i < family_size; ++i) {
-                    family[i].segment[l].seq_len -= overhang;
+                if (lqual > rqual + 10) {
+                    rbase = lbase;
+                    rqual = lqual;
                     }
-                rread = family->segment[r].seq_len - 1;
-                }
-            
-            
-            for (i = 0; i < family_size; ++i) {
-                for (j = 0; j <= rread; ++j) {
-                    if (family[i].segment[l].seq[j + lread] != family[i].segment[r].seq[j]) {
-                        ++mismatches;
-                        if (family[i].segment[l].qual[j + lread] > family[i].segment[r].qual[j] + 10) {
-                            family[i].segment[r].seq[j] = family[i].segment[l].seq[j + lread];
-                            family[i].segment[r].qual[j] = family[i].segment[l].qual[j + lread];
-                            }
-                        else if (family[i].segment[r].qual[j] > family[i].segment[l].qual[j + lread] + 10) {
-                            family[i].segment[l].seq[j + lread] = family[i].segment[r].seq[j];
-                            family[i].segment[l].qual[j + lread] = family[i].segment[r].qual[j];
-                            }
-                        else {
-                            family[i].segment[r].seq[j] = 'N';
-                            family[i].segment[r].qual[j] = '!';
-                            family[i].segment[l].seq[j + lread] = 'N';
-                            family[i].segment[l].qual[j + lread] = '!';
-                            }
-                        }
+                else if (rqual > lqual + 10) {
+                    lbase = rbase;
+                    lqual = rqual;
+                    }
+                else {
+                    lbase = rbase = 'N';
+                    lqual = rqual = '!';
                     }
+                
+                index = ((l * consensus->max_seq_len) + j + lread) * 5;
+                ++consensus->counts[index + base(lbase)];
+                consensus->quals[index + base(lbase)] += dd->model.weights[(unsigned char)lqual];
+                index = ((r * consensus->max_seq_len) + j) * 5;
+                ++consensus->counts[index + base(rbase)];
+                consensus->quals[index + base(rbase)] += dd->model.weights[(unsigned char)rqual];
                 }
-
-            dd->sequencing_errors += mismatches;
-            dd->sequencing_total += rread;
+            }
+        
+        // As in trim_family the overlap length is only counted once per family
+        consensus->sequencing_errors += mismatches;
+        if (consensus->family_size == 1) {
+            consensus->sequencing_total = rread;
             }
         }
-
-    dedupe_pcr(dd, family, family_size);
-   }
+    }
 
 
 
-void dedupe_pcr(Dedupe *dd, ReadPair *family, size_t family_size) {
-    size_t sixty_percent_family_size = 0, len = 0;
-    char *corrected_seq = NULL, *corrected_qual = NULL;
-    int i = 0, j = 0, counts[5] = {0}, quals[5] = {0}, r = 0, r1r2[2] = {0}, read = 0, b = 0, q = 0, qual = 0, winner = 0, mismatches = 0, total = 0;
+void consensus_finish(Dedupe *dd) {
+    size_t family_size = 0, sixty_percent_family_size = 0, required_len = 0, len = 0, i = 0, index = 0;
+    int r = 0, read = 0, r1r2[2] = {0}, mismatches = 0, total = 0;
+    uint32_t min_hash = UINT32_MAX;
+    char *seq = NULL, *qual = NULL;
+    Consensus *consensus = NULL;
+    Segment *segment = NULL;
     
-    dd->pcr_duplicates += family_size - 1;
+    for (i = 0; i < dd->consensus_len; ++i) {
+        family_size += dd->consensus[i].family_size;
+        if (dd->consensus[i].subsample_hash < min_hash) {
+            min_hash = dd->consensus[i].subsample_hash;
+            }
+        }
+    count_family_size(dd, family_size, min_hash);
     
-    if (((family->segment[0].flag & READX) == READ1) && ((family->segment[1].flag & READX) == READ2)) {
-        r1r2[0] = 0;
-        r1r2[1] = 1;
+    if (family_size == 1) {
+        ++dd->stats.total_reads;
+        dedupe_single(dd, &dd->consensus->first);
+        dd->consensus_len = 0;
+        return;
         }
-    else if (((family->segment[0].flag & READX) == READ2) && ((family->segment[1].flag & READX) == READ1)) {
-        r1r2[0] = 1;
-        r1r2[1] = 0;
+    
+    sixty_percent_family_size = ((family_size * 6) / 10) + !!((family_size * 6) % 10);
+    for (i = 0; i < dd->consensus_len; ++i) {
+        if (dd->consensus[i].family_size >= sixty_percent_family_size) {
+            consensus = dd->consensus + i;
+            break;
+            }
         }
-    else {
-        fprintf(stderr, "Error: Invalid first/last segment flags within read pair\n");
-        exit(EXIT_FAILURE);
+    dd->consensus_len = 0;
+    if (consensus == NULL) {
+        return;
         }
     
+    family_size = consensus->family_size;
     sixty_percent_family_size = ((family_size * 6) / 10) + !!((family_size * 6) % 10);
+    dd->stats.total_reads += family_size;
+    dd->stats.pcr_duplicates += family_size - 1;
+    dd->stats.sequencing_errors += consensus->sequencing_errors;
+    dd->stats.sequencing_total += consensus->sequencing_total;
+    read_order(&consensus->first, r1r2);
+    
+    required_len = (consensus->first.segment[0].seq_len + consensus->first.segment[1].seq_len) * 2;
+    if (required_len > dd->buffer_len) {
+        free(dd->buffer);
+        if ((dd->buffer = malloc(required_len)) == NULL) {
+            dedupe_fail("Unable to allocate memory for sequence buffer");
+            }
+        dd->buffer_len = required_len;
+        }
     
+    seq = dd->buffer;
     for (r = 0; r < 2; ++r) {
         read = r1r2[r];
+        segment = consensus->first.segment + read;
         
-        // len will be the same for all family members.
-        len = family->segment[read].seq_len;
-        // Write corrected data to the first family member
-        corrected_seq = family->segment[read].seq;
-        corrected_qual = family->segment[read].qual;
-        
-        if (family_size > 1 && !(family->segment[read].flag & UNMAPPED)) {
+        if (segment->flag & UNMAPPED) {
+            len = segment->seq_len;
+            qual = seq + len;
+            memcpy(seq, segment->seq, len);
+            memcpy(qual, segment->qual, len);
+            }
+        else {
+            len = consensus->seq_len[read];
+            qual = seq + len;
             for (i = 0; i < len; ++i) {
-                memset(counts, 0, 5 * sizeof(int));
-                memset(quals, 0, 5 * sizeof(int));
-                
-                for (j = 0; j < family_size; ++j) {
-                    b = base(family[j].segment[read].seq[i]);
-                    ++counts[b];
-                    quals[b] += family[j].segment[read].qual[i] - 33;
-                    }
-                quals[4] = 0;
-                
-                
-                winner = 0;
-                total += counts[0];
-                for (b = 1; b < 4; ++b) {
-                    total += counts[b];
-                    if (counts[b] > counts[winner]) {
-                        mismatches += counts[winner];
-                        winner = b;
-                        }
-                    else {
-                        mismatches += counts[b];
-                        }
-                    }
-                
-                if (counts[winner] >= sixty_percent_family_size) {
-                    qual = 0;
-                    for (q = 0; q < 4; ++q) {
-                        if (q == winner) {
-                            qual += quals[q];
-                            }
-                        else {
-                            qual -= quals[q];
-                            }
-                        }
-                    if (qual < 0) {
-                        qual = 0;
-                        }
-                    else if (qual > 93) {
-                        qual = 93;
-                        }
-                    
-                    corrected_seq[i] = bases[winner];
-                    corrected_qual[i] = qual + 33;
+                index = ((read * consensus->max_seq_len) + i) * 5;
+                if (dd->model.likelihood) {
+                    call_base_likelihood(&dd->model, consensus->counts + index, consensus->quals + index, seq + i, qual + i, &mismatches, &total);
                     }
                 else {
-                    corrected_seq[i] = 'N';
-                    corrected_qual[i] = '!';
+                    call_base(consensus->counts + index, consensus->quals + index, sixty_percent_family_size, seq + i, qual + i, &mismatches, &total);
                     }
                 }
             
-            dd->pcr_errors += mismatches;
-            dd->pcr_total += total;;
-            }
-        
-        if (family->segment[read].flag & REVERSE) {
-            reversecomplement(corrected_seq, len);
-            reverse(corrected_qual, len);
+            dd->stats.pcr_errors += mismatches;
+            dd->stats.pcr_total += total;
             }
         
-        // write to file
-        if (family_size >= dd->min_family_size) {
-            fprintf(dd->output_file, "@%.*s XF:i:%i\n%.*s\n+\n%.*s\n", (int)family->segment[read].qname_len, family->segment[read].qname,
-                                                                       (int)family_size, 
-                                                                       (int)len, corrected_seq,
-                                                                       (int)len, corrected_qual);
-            }
+        write_fastq(dd, segment, family_size, seq, qual, len);
+        seq = qual + len;
         }
     }
 
@@ -1149,6 +3087,26 @@ void reversecomplement(char *start, int len) {
 
 
 
+void reverse_copy(char *dest, const char *src, int len) {
+    const char *end = src + len - 1;
+    
+    while (end >= src) {
+        *dest++ = *end--;
+        }
+    }
+
+
+
+void reversecomplement_copy(char *dest, const char *src, int len) {
+    const char *end = src + len - 1;
+    
+    while (end >= src) {
+        *dest++ = reversebase(*end--);
+        }
+    }
+
+
+
 int cmp_qnames(const void *p1, const void *p2) {
     // qnames of both reads in pair will be identical, therefore just compare segment[0]
     Segment *s1 = (Segment *)p1, *s2 = (Segment *)p2;
@@ -1175,6 +3133,17 @@ int cmp_irflts(const void *p1, const void *p2) {
 
 
 
+int cmp_irflts_qnames(const void *p1, const void *p2) {
+    int ret = cmp_irflts(p1, p2);
+    
+    if (ret == 0) {
+        ret = cmp_qnames(p1, p2);
+        }
+    return ret;
+    }
+
+
+
 int cmp_barcodes(const void *p1, const void *p2) {
     // barcodes of both reads in pair will be identical according to specificatin, therefore just compare segment[0]
     Segment *s1 = (Segment *)p1, *s2 = (Segment *)p2;
@@ -1189,6 +3158,17 @@ int cmp_barcodes(const void *p1, const void *p2) {
 
 
 
+int cmp_barcodes_qnames(const void *p1, const void *p2) {
+    int ret = cmp_barcodes(p1, p2);
+    
+    if (ret == 0) {
+        ret = cmp_qnames(p1, p2);
+        }
+    return ret;
+    }
+
+
+
 int cmp_cigars(const void *p1, const void *p2) {
     ReadPair *r1 = (ReadPair *)p1, *r2 = (ReadPair *)p2;
     size_t len = 0;
@@ -1211,6 +3191,18 @@ int cmp_cigars(const void *p1, const void *p2) {
 
 
 
+int cmp_cigars_qnames(const void *p1, const void *p2) {
+    // The qname of the first member with the chosen cigars names the consensus
+    int ret = cmp_cigars(p1, p2);
+    
+    if (ret == 0) {
+        ret = cmp_qnames(p1, p2);
+        }
+    return ret;
+    }
+
+
+
 const char *parse_segment(const char *read, const char *sam_end, Segment *segment) {
     int column = 0;
     const char *start = NULL, *endptr = NULL, *beginning = read;
@@ -1233,8 +3225,7 @@ const char *parse_segment(const char *read, const char *sam_end, Segment *segmen
                     errno = 0;
                     val = strtol(start, (char **)&endptr, 10);
                     if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == start)) {
-                        fprintf(stderr, "Error: Invalid flag in sam file\n");
-                        exit(EXIT_FAILURE);
+                        dedupe_fail("Invalid flag in sam file");
                         }
                     segment->flag = (uint16_t)val;
                     break;
@@ -1246,8 +3237,7 @@ const char *parse_segment(const char *read, const char *sam_end, Segment *segmen
                     errno = 0;
                     val = strtol(start, (char **)&endptr, 10);
                     if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == start)) {
-                        fprintf(stderr, "Error: Invalid pos in sam file\n");
-                        exit(EXIT_FAILURE);
+                        dedupe_fail("Invalid pos in sam file");
                         }
                     segment->pos = (int32_t)val;
                     break;
@@ -1255,6 +3245,18 @@ const char *parse_segment(const char *read, const char *sam_end, Segment *segmen
                     segment->cigar = start;
                     segment->cigar_len = read - start;
                     break;
+                case 7: // rnext
+                    segment->rnext = start;
+                    segment->rnext_len = read - start;
+                    break;
+                case 8: // pnext
+                    errno = 0;
+                    val = strtol(start, (char **)&endptr, 10);
+                    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == start)) {
+                        dedupe_fail("Invalid pnext in sam file");
+                        }
+                    segment->pnext = (int32_t)val;
+                    break;
                 case 10: // seq
                     segment->seq = (char *)start;
                     segment->seq_len = read - start;
@@ -1263,8 +3265,7 @@ const char *parse_segment(const char *read, const char *sam_end, Segment *segmen
                     segment->qual = (char *)start;
                     // seq and qual must be the same length
                     if (segment->seq_len != read - start) {
-                        fprintf(stderr, "Error: Sequence and quality differ in length\n");
-                        exit(EXIT_FAILURE);
+                        dedupe_fail("Sequence and quality differ in length");
                         }
                     break;
                 default:
@@ -1285,15 +3286,13 @@ const char *parse_segment(const char *read, const char *sam_end, Segment *segmen
             }
         }
     if (column < 11) {
-        fprintf(stderr, "Error: Truncated sam file\n");
-        exit(EXIT_FAILURE);
+        dedupe_fail("Truncated sam file");
         }
     
     
     // seq and cigar must be the same length except for unmapped segment (cigar = *)
     if (memcmp(segment->cigar, "*\t", 2) != 0 && segment->seq_len != cigar_len(segment->cigar, segment->cigar_len, CONSUMES_READ)) {
-        fprintf(stderr, "Error: Sequence and cigar differ in length\n");
-        exit(EXIT_FAILURE);
+        dedupe_fail("Sequence and cigar differ in length");
         }
     
     return read + 1;
@@ -1301,13 +3300,6 @@ const char *parse_segment(const char *read, const char *sam_end, Segment *segmen
 
 
 
-bool endswith(const char *text, const char *suffix) {
-    int offset = strlen(text) - strlen(suffix);
-    return (offset >= 0 && strcmp(text + offset, suffix) == 0);
-    }
-
-
-
 int32_t cigar_len(const char *cigar, size_t cigar_len, const char *ops) {
     long val = 0;
     int32_t len = 0;
@@ -1321,8 +3313,7 @@ int32_t cigar_len(const char *cigar, size_t cigar_len, const char *ops) {
         errno = 0;
         val = strtol(cigar, (char **)&endptr, 10);
         if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == cigar)) {
-            fprintf(stderr, "Error: Invalid cigar string %.*s\n", (int)cigar_len, cigar);
-            exit(EXIT_FAILURE);
+            dedupe_fail("Invalid cigar string %.*s", (int)cigar_len, cigar);
             }
             
         if (strchr(ops, *endptr) != NULL) {
@@ -1339,15 +3330,13 @@ const char *cigar_op(const char *cigar, const char **op, int32_t *num) {
     const char *endptr = NULL;
 
     if (*cigar == '*') {
-        fprintf(stderr, "Error: Missing cigar string\n");
-        exit(EXIT_FAILURE);
+        dedupe_fail("Missing cigar string");
         }
     
     errno = 0;
     val = strtol(cigar, (char **)&endptr, 10);
     if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == cigar)) {
-        fprintf(stderr, "Error: Invalid cigar string\n");
-        exit(EXIT_FAILURE);
+        dedupe_fail("Invalid cigar string");
         }
     
     *num = (int32_t)val;
@@ -1366,8 +3355,7 @@ int guess_optical_distance(const char *sam,  const char *sam_end) {
     long val = 0;
 
     if ((x_coords = calloc(1000, sizeof(int))) == NULL) {
-        fprintf(stderr, "Error: Unable to allocate memory for coordinate buffer\n");
-        exit(EXIT_FAILURE);
+        dedupe_fail("Unable to allocate memory for coordinate buffer");
         }
     
     for (; sam < sam_end; ++sam) {
@@ -3,8 +3,14 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "hash.h"
+#include "mash.h"
+#include "spill.h"
+#include "familyindex.h"
+#include "stats.h"
 
 
 typedef struct segment_t {
@@ -15,6 +21,7 @@ typedef struct segment_t {
     char *qual;
     const char *barcode;
     const char *barcode2;
+    const char *rnext; // "=" if the mate is on the same contig
     size_t len;
     size_t qname_len;
     size_t rname_len;
@@ -22,7 +29,9 @@ typedef struct segment_t {
     size_t seq_len;
     size_t barcode_len;
     size_t barcode2_len;
+    size_t rnext_len;
     int32_t pos; // Max size 2^31 - 1 according to sam specifications
+    int32_t pnext; // 0 if unknown
     uint16_t flag; // Max size 2^16 - 1 according to sam specifications
     } Segment;
 
@@ -35,32 +44,245 @@ typedef struct readpair_t {
     } ReadPair;
 
 
+typedef struct spilledpair_t {
+    const char *record[2]; // qname, and therefore start, of each segment within the input
+    size_t len[2];
+    } SpilledPair;
+
+
+typedef struct progress_t {
+    int interval; // seconds between reports, 0 if disabled
+    bool print; // print a progress line to stderr
+    const char *heartbeat_filename; // json file rewritten with each report
+    size_t bytes; // bytes of input fed before the current buffer
+    size_t total_bytes; // expected size of the input, 0 if unknown
+    size_t records; // records parsed
+    double start;
+    double last; // time of the last report
+    size_t last_records;
+    size_t last_families;
+    } Progress;
+
+
+typedef struct openfamily_t {
+    int32_t close_pos; // last position at which a further member can be completed
+    bool spilled; // members may have been moved to spill
+    size_t key_size;
+    char *key;
+    } OpenFamily;
+
+
+typedef struct flushqueue_t {
+    OpenFamily *families; // min heap ordered by close_pos
+    size_t len;
+    size_t max_len;
+    } FlushQueue;
+
+
+typedef struct expectedmate_t {
+    int32_t mate_pos;
+    uint32_t qname_len;
+    const char *qname; // of a record in the unpaired table, which may since have been paired
+    } ExpectedMate;
+
+
+typedef struct matequeue_t {
+    ExpectedMate *mates; // min heap ordered by mate_pos
+    size_t len;
+    size_t max_len;
+    } MateQueue;
+
+
+typedef struct deferredmate_t {
+    const char *record;
+    size_t len;
+    } DeferredMate;
+
+
+typedef struct contigmates_t {
+    bool finished; // every read on the contig has been fed
+    DeferredMate *mates; // unpaired reads whose mates are on this contig, which has not been reached
+    size_t len;
+    size_t max_len;
+    char name[]; // key in the contigs table
+    } ContigMates;
+
+
+#define LOG_SUM_LEN 256 // differences in tenths of a phred beyond which adding the smaller probability changes nothing
+
+
+// How the quality of each member base counts towards the consensus. Accumulators of every model are
+// integer sums of weights, only the call made from them differs.
+typedef struct qualitymodel_t {
+    bool likelihood; // call the most probable base rather than a 60% majority, see call_base_likelihood
+    int weights[256]; // indexed by quality character, phred or the log likelihood ratio of the base observed
+    int log_sum[LOG_SUM_LEN]; // 100 * log10(1 + 10^(-i / 100)), adds probabilities given in tenths of a phred
+    } QualityModel;
+
+
+typedef struct consensus_t {
+    ReadPair first; // first member with this pair of cigars, supplies qname, flags and unmapped sequence
+    size_t family_size;
+    size_t seq_len[2];
+    size_t max_seq_len; // allocated length of the accumulators of each segment
+    int *counts; // per segment, per position, per base counts
+    int *quals; // per segment, per position, per base sums of phred quality
+    size_t sequencing_errors;
+    size_t sequencing_total;
+    uint32_t subsample_hash; // lowest of the members, see count_family_size
+    } Consensus;
+
+
+// Called with each block of fastq output, returns non-zero on failure
+typedef int (*dedupe_output_t)(void *context, const char *data, size_t len);
+
+
+// Called by dedupe_references with each range of the input that is still referenced
+typedef void (*dedupe_reference_t)(void *context, const char *start, const char *end);
+
+
+// One of several buffers of records fed together by dedupe_feed_runs
+typedef struct recordrun_t {
+    const char *records;
+    size_t len;
+    size_t source; // buffer the records lie within, such as one of several inputs being merged
+    } RecordRun;
+
+
+// Records fed from one source and those among them that spill refers to. Pointers into a source are
+// only ever compared with others into the same source.
+typedef struct fedsource_t {
+    const char *fed_start;
+    const char *fed_end;
+    const char *spilled_start; // NULL if spill refers to none
+    const char *spilled_end;
+    } FedSource;
+
+
+typedef struct dedupeoptions_t {
+    const char *umi; // thruplex, thruplex_hv or prism, NULL or "" if none
+    size_t min_family_size;
+    int optical_duplicate_distance; // 0 to guess from the query names, -1 to disable, otherwise the distance + 1
+    const char *print_family_members; // write the members of the family of this qname and nothing else
+    size_t max_memory; // 0 for no limit
+    bool collated; // input is collated by query name rather than sorted by position
+    FILE *output_file; // output is written here unless output is set, stdout if neither
+    dedupe_output_t output;
+    void *output_context;
+    int progress_interval; // seconds between progress reports, 0 for none
+    bool print_progress;
+    const char *heartbeat_filename;
+    size_t input_size; // used to report progress as a percentage, 0 if unknown
+    FamilyIndex *family_index; // if set the members of every family are recorded, fed buffers must lie within its sam
+    bool stats_only; // group and count families without building consensus or writing output
+    const char *hash_function; // hash of the qname and position tables, a name from HASH_FUNCTIONS or NULL for the default
+    uint64_t hash_seed; // changes the table layout and the order families at the end of a contig are written, never the results
+    bool mark_duplicates; // write the fed records, with 0x400 set on all but one pair of each family, rather than consensus
+    bool duplex; // combine the families of the two strands of each molecule, whose umi halves are swapped, into one consensus
+    bool likelihood_consensus; // consensus bases and qualities are posterior probabilities given the qualities of the members
+    } DedupeOptions;
+
+
 typedef struct dedupe_t {
     size_t min_family_size;
     FILE *output_file;
+    dedupe_output_t output;
+    void *output_context;
+    char *record; // used by write_fastq to format each output record
+    size_t max_record_len;
     char *buffer; // writable buffer to store seq and qual that may be modified
     size_t buffer_len;
+    QualityModel model;
+    int *error_counts; // used by count_errors to accumulate per position base counts
+    size_t max_error_counts_len;
     ReadPair *readpairs; // used by dedupe_all to store readpair family members
     size_t readpair_len;
+    char *spilled_key; // used by dedupe_all to keep the key of the family being read back from spill
+    size_t max_spilled_key_len;
     int optical_duplicate_distance;
-    char *print_family_members;
+    const char *print_family_members;
+    FamilyIndex *family_index;
+    bool stats_only;
+    bool mark_duplicates;
+    MashTable *duplicates; // address of every record marked as a duplicate that has not yet been written
+    const char **family_records; // both records of each member of the family being marked, see keep_family_records
+    size_t family_records_len;
+    size_t max_family_records_len;
+    RecordRun *unwritten; // fed records not yet written by write_marked, oldest first
+    size_t unwritten_len;
+    size_t max_unwritten_len;
+    size_t unwritten_fed; // bytes fed since write_marked was last called
+    RecordRun *pending_ranges; // used by write_marked to sort the ranges that families still refer to
+    size_t pending_ranges_len;
+    size_t max_pending_ranges_len;
+    uint16_t key_flags; // flags of the later segment that are part of the position key
+    int duplex_strand; // strand of the molecule whose output write_output is holding for write_duplex, -1 if none
+    char *duplex_held[2]; // consensus of each strand, as fastq
+    size_t duplex_held_len[2];
+    size_t max_duplex_held_len[2];
+    size_t max_memory; // size of the paired table beyond which family members are spilled to disk
     
-    size_t *family_sizes; // used to store family size statistics
-    size_t max_family_size;
-
-    size_t total_reads;
-    size_t pcr_duplicates;
-    size_t optical_duplicates;
+    bool streaming; // build consensus as family members are popped rather than collecting the whole family
+    Consensus *consensus; // used by consensus_add to store one accumulator per distinct pair of cigars
+    size_t consensus_len;
+    size_t max_consensus_len;
+    
+    Stats stats; // counted by this context alone so that contexts on other threads can be merged
     
-    float sequencing_total;
-    float sequencing_errors;
-    float pcr_total;
-    float pcr_errors;
+    // State carried between calls to dedupe_feed
+    bool started; // the first record has been seen
+    bool done; // the family requested by print_family_members has been written, input is ignored
+    bool flushed;
+    bool failed; // every further call returns an error
+    bool collated;
+    bool guess_optical_distance;
+    void (*dedupe_function)(struct dedupe_t *dd, ReadPair *family, size_t family_size);
+    HashTable *unpaired; // qname to first seen mate
+    MateQueue expected_mates; // entries of unpaired by the position of their mate on the current contig
+    HashTable *contigs; // name to ContigMates of every contig that has been seen or is expected
+    MashTable *paired; // position key to family members
+    Spill *spill;
+    FedSource *sources; // indexed by the source of each fed run
+    size_t sources_len;
+    size_t last_source; // of the last record spilled, the first tried by record_source
+    FlushQueue open_families;
+    size_t spill_threshold;
+    Progress progress;
+    Segment mate_segment; // collated input, previous read still waiting for its mate
+    bool pending;
+    const char *sort_check_rname;
+    size_t sort_check_rname_len;
+    int32_t sort_check_pos;
+    char *position; // key of the current pair
+    size_t position_len;
+    size_t max_position_len;
+    char error_message[256];
     } Dedupe;
 
 
 typedef void (*dedupe_function_t)(Dedupe *dd, ReadPair *family, size_t family_size);
 
 
+/*
+ * In process api. Records are sam text, whole lines optionally preceded by the header, and are
+ * referenced rather than copied so every buffer passed to dedupe_feed must stay valid until
+ * dedupe_flush returns. dedupe_feed_runs feeds several buffers in turn as though they were one, which
+ * is far quicker than feeding each alone when they hold only a few records, and the runs of each source
+ * must lie within a single buffer. dedupe_feed feeds source 0. With mark_duplicates the
+ * output is the fed buffers themselves, header included, each record written in the order fed once
+ * its family has been deduped. Functions returning int return 0 on success and -1 on error, after
+ * which dedupe_error_message describes the error and the context only accepts dedupe_destroy.
+ */
+Dedupe *dedupe_new(const DedupeOptions *options);
+int dedupe_feed(Dedupe *dd, const char *records, size_t len);
+int dedupe_feed_runs(Dedupe *dd, const RecordRun *runs, size_t runs_len);
+int dedupe_flush(Dedupe *dd);
+int dedupe_write_stats(Dedupe *dd, const char *stats_filename);
+void dedupe_references(const Dedupe *dd, dedupe_reference_t reference, void *context);
+const char *dedupe_error_message(const Dedupe *dd);
+void dedupe_destroy(Dedupe *dd);
+int guess_optical_distance(const char *sam,  const char *sam_end);
+
+
 
 #endif
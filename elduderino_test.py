@@ -1,6 +1,9 @@
 import subprocess
+import ctypes
+import json
 import os
 import sys
+import random
 #from collections import defaultdict
 
 
@@ -12,6 +15,7 @@ MATE_REVERSED = 32
 FIRST = 64
 LAST = 128
 SECONDARY = 256
+DUPLICATE = 1024
 SUPPLEMENTARY = 2048
 
 
@@ -76,34 +80,309 @@ def rc(seq):
 
 
 
-def execute(sam, expected, umi=None, min_family_size=1):
+OUTPUT_FUNCTION = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t)
+
+class DedupeOptions(ctypes.Structure):
+    _fields_ = [("umi", ctypes.c_char_p),
+                ("min_family_size", ctypes.c_size_t),
+                ("optical_duplicate_distance", ctypes.c_int),
+                ("print_family_members", ctypes.c_char_p),
+                ("max_memory", ctypes.c_size_t),
+                ("collated", ctypes.c_bool),
+                ("output_file", ctypes.c_void_p),
+                ("output", OUTPUT_FUNCTION),
+                ("output_context", ctypes.c_void_p),
+                ("progress_interval", ctypes.c_int),
+                ("print_progress", ctypes.c_bool),
+                ("heartbeat_filename", ctypes.c_char_p),
+                ("input_size", ctypes.c_size_t),
+                ("family_index", ctypes.c_void_p),
+                ("stats_only", ctypes.c_bool),
+                ("hash_function", ctypes.c_char_p),
+                ("hash_seed", ctypes.c_uint64),
+                ("mark_duplicates", ctypes.c_bool),
+                ("duplex", ctypes.c_bool),
+                ("likelihood_consensus", ctypes.c_bool)]
+
+
+
+def run_library(records, umi, min_family_size, collated):
+    # Feeds records one at a time to an in process context, returns the fastq output
+    lib = ctypes.CDLL("./libelduderino.so")
+    lib.dedupe_new.restype = ctypes.c_void_p
+    lib.dedupe_new.argtypes = [ctypes.POINTER(DedupeOptions)]
+    lib.dedupe_feed.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.dedupe_flush.argtypes = [ctypes.c_void_p]
+    lib.dedupe_error_message.restype = ctypes.c_char_p
+    lib.dedupe_error_message.argtypes = [ctypes.c_void_p]
+    lib.dedupe_destroy.argtypes = [ctypes.c_void_p]
+    
+    output = []
+    def write(context, data, length):
+        output.append(ctypes.string_at(data, length))
+        return 0
+    
+    options = DedupeOptions(umi=umi.encode() if umi else None, min_family_size=min_family_size, optical_duplicate_distance=-1,
+                            collated=collated, output=OUTPUT_FUNCTION(write))
+    dd = lib.dedupe_new(ctypes.byref(options))
+    if not dd:
+        sys.exit(lib.dedupe_error_message(None).decode())
+    records = [record.encode() for record in records]
+    for record in records:
+        if lib.dedupe_feed(dd, record, len(record)) != 0:
+            sys.exit(lib.dedupe_error_message(dd).decode())
+    if lib.dedupe_flush(dd) != 0:
+        sys.exit(lib.dedupe_error_message(dd).decode())
+    lib.dedupe_destroy(dd)
+    return b"".join(output).decode()
+
+
+
+def run_elduderino(inputs, commands, outputs=[], temporary=[], check=True):
+    # Writes inputs, a dict of filename to contents, and runs the command line program with each list
+    # of arguments in turn. Returns the completed processes, with stdout and, unless check, stderr
+    # captured as text, and a dict of the contents of those outputs that were written. Every input,
+    # output, temporary file and sidecar index is removed afterwards. With check a failed run ends the
+    # test.
+    for fn in inputs:
+        if os.path.exists(fn):
+            sys.exit(f"{fn} already exists")
+    
+    try:
+        for fn, contents in inputs.items():
+            with open(fn, "wt") as f:
+                f.write(contents)
+        completed = [subprocess.run(["./elduderino"] + args, stdout=subprocess.PIPE, stderr=None if check else subprocess.PIPE, universal_newlines=True, check=check) for args in commands]
+        written = {}
+        for fn in outputs:
+            if os.path.exists(fn):
+                with open(fn) as f:
+                    written[fn] = f.read()
+    finally:
+        for fn in list(inputs) + outputs + temporary + [fn + ".eidx" for fn in inputs]:
+            if os.path.exists(fn):
+                os.unlink(fn)
+    return completed, written
+
+
+
+def run_rewritten(reads, replacement, region):
+    # Runs --region on the reads, building the sidecar index, then again once the sam is rewritten in
+    # place with the replacement reads, of the same size but a later modification time, and once more
+    # without the index. Returns the stdout of the last two runs.
+    original, rewritten = lane_inputs(reads)["test.sam"], lane_inputs(replacement)["test.sam"]
+    if len(original) != len(rewritten):
+        sys.exit("Replacement differs in size")
+    args = ["./elduderino", "test.sam", "--output", "-", "--region", region]
+    
     if os.path.exists("test.sam"):
         sys.exit("test.sam already exists")
+    try:
+        with open("test.sam", "wt") as f:
+            f.write(original)
+        subprocess.run(args, stdout=subprocess.DEVNULL, check=True)
+        mtime = os.stat("test.sam").st_mtime
+        with open("test.sam", "r+t") as f:
+            f.write(rewritten)
+        os.utime("test.sam", (mtime + 10, mtime + 10))
+        reindexed = subprocess.run(args, stdout=subprocess.PIPE, universal_newlines=True, check=True).stdout
+        os.unlink("test.sam.eidx")
+        indexed = subprocess.run(args, stdout=subprocess.PIPE, universal_newlines=True, check=True).stdout
+    finally:
+        for fn in ["test.sam", "test.sam.eidx"]:
+            if os.path.exists(fn):
+                os.unlink(fn)
+    return reindexed, indexed
+
+
+
+def lane_inputs(reads, lanes=1, header=""):
+    # The reads, already in file order, as the contents of a sam or divided by pair between that many
+    # sams, each beginning with header
+    names = ["test.sam"] if lanes == 1 else [f"test{i}.sam" for i in range(lanes)]
+    contents = [[header] for fn in names]
+    for read in reads:
+        contents[int(read.qname.split("_")[1]) % lanes if lanes > 1 else 0].append(str(read))
+    return {fn: "".join(lines) for fn, lines in zip(names, contents)}
+
+
+
+def sorted_header(reads):
+    return "@HD\tVN:1.6\tSO:coordinate\n" + "".join(f"@SQ\tSN:{rname}\tLN:1000000\n" for rname in sorted(set(read.rname for read in reads)))
+
+
+
+def run_cli(reads, umi, min_family_size, collated, region=None, no_mmap=False, lanes=1, duplex=False, likelihood=False):
+    # Runs the command line program on the reads, already in file order, returns its stdout. With more
+    # than one lane the pairs are divided between that many sams, each with a header, to be merged.
+    inputs = lane_inputs(reads, lanes, sorted_header(reads) if lanes > 1 else "")
+    args = list(inputs) + ["--output", "-", "--min-family-size", str(min_family_size)]
+    if umi:
+        args += ["--umi", umi]
+    if collated:
+        args += ["--collated"]
+    if region:
+        args += ["--region", region]
+    if no_mmap:
+        args += ["--no-mmap"]
+    if duplex:
+        args += ["--duplex"]
+    if likelihood:
+        args += ["--likelihood-consensus"]
+    
+    completed, written = run_elduderino(inputs, [args], check=False)
+    sys.stderr.write(completed[0].stderr)
+    return completed[0].stdout
+
+
+
+def run_manifest(reads, umi, min_family_size, collated):
+    # Runs the same sam twice as separate samples of a manifest, returns the output of the first
+    # after checking that both are identical
+    outputs = ["test1.fastq", "test2.fastq"]
+    stats = ["test1.json", "test2.json"]
+    inputs = lane_inputs(reads)
+    inputs["test_manifest.txt"] = "".join(f"test.sam\t{output}\t{stat}\n" for output, stat in zip(outputs, stats))
+    
+    args = ["--manifest", "test_manifest.txt", "--threads", "2", "--min-family-size", str(min_family_size)]
+    if umi:
+        args += ["--umi", umi]
+    if collated:
+        args += ["--collated"]
+    
+    completed, written = run_elduderino(inputs, [args], outputs, stats)
+    if written[outputs[0]] != written[outputs[1]]:
+        sys.exit("Manifest samples differ")
+    return written[outputs[0]]
+
+
+
+def run_family_index(reads, qname):
+    # Writes a family index during a normal run then prints the family of qname both from the index
+    # and by --print-family-members, returns the records after checking that both are identical
+    completed, written = run_elduderino(lane_inputs(reads), [["test.sam", "--output", "-", "--stats", "test.json", "--family-index", "test.fidx"],
+                                                             ["test.sam", "--output", "-", "--print-family-members", qname, "--family-index", "test.fidx"],
+                                                             ["test.sam", "--output", "-", "--print-family-members", qname]], temporary=["test.json", "test.fidx"])
+    indexed, walked = completed[1].stdout, completed[2].stdout
+    if indexed != walked:
+        sys.exit("Family index lookup differs from --print-family-members")
+    return indexed
+
+
+
+def run_stats_only(reads, umi):
+    # Checks that --stats-only writes no output and the same stats as a full run
+    args = ["test.sam"] + (["--umi", umi] if umi else [])
+    completed, written = run_elduderino(lane_inputs(reads), [args + ["--output", "-", "--stats", "test_full.json"],
+                                                             args + ["--stats-only", "--stats", "test_stats.json"]], ["test_full.json", "test_stats.json"])
+    if completed[1].stdout or written["test_stats.json"] != written["test_full.json"]:
+        sys.exit("Failed")
+    return written["test_stats.json"]
+
+
+
+def run_failing(reads, args):
+    # Returns the error printed by a run that is expected to fail
+    completed, written = run_elduderino(lane_inputs(reads), [["test.sam", "--output", "-", "--stats", "test.json"] + args], temporary=["test.json"], check=False)
+    if completed[0].returncode == 0:
+        sys.exit("Failed")
+    return completed[0].stderr
+
+
+
+def run_seeded(reads, args):
+    # Runs the reads under several hash functions and seeds, and collated by name, returns the sorted
+    # fastq records and the stats after checking that every run gives the same
+    variants = [["test.sam", "--hash-seed", "0"], ["test.sam", "--hash-seed", "1"], ["test.sam", "--hash", "fnv1a", "--hash-seed", "7"],
+                ["test.sam", "--hash-seed", "2", "--max-memory", "1"], ["test_collated.sam", "--collated"]]
+    inputs = lane_inputs(reads)
+    inputs["test_collated.sam"] = lane_inputs(sorted(reads, key=lambda x:x.qname))["test.sam"]
+    stats = [f"test{i}.json" for i in range(len(variants))]
+    completed, written = run_elduderino(inputs, [variant + ["--output", "-", "--stats", fn] + args for fn, variant in zip(stats, variants)], stats)
+    
+    results = []
+    for run, fn in zip(completed, stats):
+        lines = run.stdout.splitlines()
+        summary = {key: value for key, value in json.loads(written[fn]).items() if key.startswith("duplicate_rate")}
+        results.append((sorted("\n".join(lines[i:i + 4]) for i in range(0, len(lines), 4)), summary))
+    if any(result != results[0] for result in results):
+        sys.exit("Failed")
+    return results[0]
+
+
+
+def run_marked(reads, lanes=1, no_mmap=False):
+    # Runs --mark-duplicates on the reads, already in file order, divided between lanes as run_cli
+    # does. Returns the header and the records written after checking that the stats are those of a
+    # full run.
+    header = sorted_header(reads)
+    inputs = lane_inputs(reads, lanes, header)
+    args = list(inputs) + (["--no-mmap"] if no_mmap else [])
+    completed, written = run_elduderino(inputs, [args + ["--output", "-", "--stats", "test_full.json"],
+                                                 args + ["--mark-duplicates", "--output", "-", "--stats", "test_marked.json"]], ["test_full.json", "test_marked.json"])
+    stdout = completed[1].stdout
+    if written["test_marked.json"] != written["test_full.json"] or not stdout.startswith(header):
+        sys.exit("Failed")
+    return header, stdout[len(header):]
+
+
+
+def run_sharded(reads, shards):
+    # Returns the fastq records of each shard after checking that together they are those of a
+    # single output
+    outputs = [f"test.{i}.fastq" for i in range(shards)]
+    completed, written = run_elduderino(lane_inputs(reads), [["test.sam", "--output", "-", "--stats", "test.json"],
+                                                             ["test.sam", "--output", "test.fastq", "--output-shards", str(shards), "--stats", "test.json"]], outputs, ["test.json"])
+    sharded = []
+    for fn in outputs:
+        lines = written[fn].splitlines()
+        sharded.append(["\n".join(lines[i:i + 4]) for i in range(0, len(lines), 4)])
+    
+    lines = completed[0].stdout.splitlines()
+    if sorted(record for shard in sharded for record in shard) != sorted("\n".join(lines[i:i + 4]) for i in range(0, len(lines), 4)):
+        sys.exit("Failed")
+    return sharded
+
+
+
+def run_merged_stats(reads):
+    # Runs the same sam as two samples of a manifest with combined stats, returns the stats of one
+    # sample and the combined stats
+    stats = ["test1.json", "test2.json"]
+    outputs = ["test1.fastq", "test2.fastq"]
+    inputs = lane_inputs(reads)
+    inputs["test_manifest.txt"] = "".join(f"test.sam\t{output}\t{stat}\n" for output, stat in zip(outputs, stats))
     
+    completed, written = run_elduderino(inputs, [["--manifest", "test_manifest.txt", "--threads", "2", "--stats-only", "--stats", "test_all.json"]], ["test_all.json"] + stats, outputs)
+    return json.loads(written[stats[0]]), json.loads(written["test_all.json"])
+
+
+
+def execute(sam, expected, umi=None, min_family_size=1, collated=False, library=False, manifest=False, region=None, no_mmap=False, lanes=1, duplex=False, likelihood=False):
     reads = []
     for pair in sam:
         reads.extend([pair.read1, pair.read2])
     
-    with open("test.sam", "wt") as f:
-        for read in sorted(reads, key=lambda x:(x.rname, x.pos, x.flag & REVERSED)):
-            f.write(str(read))
+    if collated:
+        order = lambda x:x.qname
+    else:
+        order = lambda x:(x.rname, x.pos, x.flag & REVERSED)
+    reads = sorted(reads, key=order)
     
-    cmd = ["./elduderino", "test.sam", "--output", "-", "--min-family-size", str(min_family_size)]
-    if umi:
-        cmd += ["--umi", umi]
-        
-    try:
-        completed = subprocess.run(cmd, stdout=subprocess.PIPE, universal_newlines=True, bufsize=1)
-    finally:
-        os.unlink("test.sam")
+    if library:
+        stdout = run_library([str(read) for read in reads], umi, min_family_size, collated)
+    elif manifest:
+        stdout = run_manifest(reads, umi, min_family_size, collated)
+    else:
+        stdout = run_cli(reads, umi, min_family_size, collated, region, no_mmap, lanes, duplex, likelihood)
     
     n = 7
     result = []
-    for i, row in enumerate(completed.stdout.splitlines()):
+    for i, row in enumerate(stdout.splitlines()):
         n = i % 8
         row = row.strip()
         if n == 0:
-            family_size = int(row.split(" XF:i:")[1])
+            family_size = int(row.split(" XF:i:")[1].split()[0])
         elif n == 1:
             seq1 = row
         elif n == 3:
@@ -250,6 +529,20 @@ def main():
     execute(sam, expected)
     
         
+    print("Likelihood consensus")
+    # Two members disagree, the better quality base is called with the posterior probability of
+    # either other. Agreeing bases of quality 40 leave an error of 10^-8.5.
+    sam = [Pair(Read("AAAAAAA", qual="IIIIIII"),
+                Read("       CCCCCCC", qual="IIIIIII"), barcode="AAA-CCC"),
+           Pair(Read("AAAAAAC", qual="IIIIII+"),
+                Read("       CCCCCCC", qual="IIIIIII"), barcode="AAA-CCC")]
+    expected = ["AAAAAAN qqqqqq! - CCCCCCC qqqqqqq 2"]
+    execute(sam, expected)
+    expected = ["AAAAAAA vvvvvv? - CCCCCCC vvvvvvv 2"]
+    execute(sam, expected, likelihood=True)
+    execute(sam, expected, umi="thruplex", likelihood=True)
+    
+    
     print("Readthrough")
     sam = [Pair(Read("   AAAATTT"),
                 Read("TTTAAAA"))]
@@ -382,6 +675,252 @@ def main():
     execute(sam, expected, umi="thruplex")
     
     
+    print("Duplex")
+    # Read 2 of the B strand is read 1 of the A strand, and the halves of its umi are swapped. A
+    # molecule seen on one strand only is written as the consensus of that strand.
+    def b_strand(pair):
+        pair.read1.flag = LAST | MATE_REVERSED
+        pair.read2.flag = FIRST | REVERSED
+        return pair
+    sam = [Pair(Read("AAATTTT"),
+                Read("       CCCGGGA"), barcode="AAA-CCC"),
+           Pair(Read("AAATTTT"),
+                Read("       CCCGGGA"), barcode="AAA-CCC"),
+           b_strand(Pair(Read("AAATTTG"),
+                         Read("       CCCGGGA"), barcode="CCC-AAT")),
+           b_strand(Pair(Read("GGGGGGG", pos=50),
+                         Read("       TTTTTTT", pos=50), barcode="AAA-CCC"))]
+    expected = ["AAATTTN ~~~~~~! - CCCGGGA ~~~~~~~ 3",
+                "AAAAAAA aaaaaaa - CCCCCCC aaaaaaa 1"]
+    execute(sam, expected, umi="thruplex", duplex=True)
+    execute(sam, expected, umi="thruplex", duplex=True, collated=True)
+    execute(sam, expected, umi="thruplex", duplex=True, lanes=2)
+    expected = ["AAATTTT ~~~~~~~ - CCCGGGA ~~~~~~~ 2",
+                "TCCCGGG aaaaaaa - CAAATTT aaaaaaa 1",
+                "AAAAAAA aaaaaaa - CCCCCCC aaaaaaa 1"]
+    execute(sam, expected, umi="thruplex")
+    
+    
+    print("Mates on different contigs")
+    sam = [Pair(Read("AAAAAAA"),
+                Read("CCCCCCC", rname="chr2")),
+           Pair(Read("       GGGGGGG"),
+                Read("TTTTTTT")),
+           Pair(Read("AAAAAAA"),
+                Read("CCCCCCC", rname="chr2"))]
+    expected = ["AAAAAAA ~~~~~~~ - CCCCCCC ~~~~~~~ 2", "GGGGGGG aaaaaaa - TTTTTTT aaaaaaa 1"]
+    execute(sam, expected)    
+    
+    print("Collated")
+    sam = [Pair(Read("AAAAAAA"),
+                Read("       CCCCCCC")),
+           Pair(Read("AAAAAAA", rname="chr2"),
+                Read("       CCCCCCC", rname="chr2")),
+           Pair(Read("       CCCCCCC"),
+                Read("AAAAAAA")),
+           Pair(Read("AAAAAAA"),
+                Read("       CCCCCCC"))]
+    expected = ["AAAAAAA ~~~~~~~ - CCCCCCC ~~~~~~~ 2", "AAAAAAA aaaaaaa - CCCCCCC aaaaaaa 1", "CCCCCCC aaaaaaa - AAAAAAA aaaaaaa 1"]
+    execute(sam, expected)
+    execute(sam, expected, collated=True)
+    
+    print("No mmap")
+    execute(sam, expected, no_mmap=True)
+    execute(sam, expected, collated=True, no_mmap=True)
+    
+    print("Lanes")
+    # Members of a family are found across lanes, contigs are ordered by the @SQ header lines
+    execute(sam, expected, lanes=2)
+    execute(sam, expected, lanes=3, no_mmap=True)
+    
+    print("Library")
+    execute(sam, expected, library=True)
+    execute(sam, expected, collated=True, library=True)
+    sam = [Pair(Read("AAATTTT"),
+                Read("   TTTTCCC"), barcode="AAA-CCC"),
+           Pair(Read("AAATTTT"),
+                Read("   TTTTCCC"), barcode="AAA-CCC"),
+           Pair(Read("AAATTTT"),
+                Read("   TTTTCCC"), barcode="AAA-CCC")]
+    expected = ["AAATTTT ~~~~~~~ - TTTTCCC ~~~~~~~ 3"]
+    execute(sam, expected, umi="thruplex", library=True)
+    
+    print("Manifest")
+    execute(sam, expected, umi="thruplex", manifest=True)
+    
+    print("Region")
+    # Pairs belong to the region of their leftmost mate, wherever the other mate lies
+    sam = [Pair(Read("AAAAAAA"),
+                Read("       CCCCCCC")),
+           Pair(Read("GGGGGGG", pos=100000),
+                Read("TTTTTTT", pos=100000, rname="chr2")),
+           Pair(Read("GGGGGGG", pos=100000),
+                Read("TTTTTTT", pos=100000, rname="chr2")),
+           Pair(Read("CCCCCCC", pos=100005),
+                Read("AAAAAAA", pos=200000)),
+           Pair(Read("TTTTTTT", pos=200000),
+                Read("GGGGGGG", pos=300000))]
+    expected = ["GGGGGGG ~~~~~~~ - TTTTTTT ~~~~~~~ 2", "CCCCCCC aaaaaaa - AAAAAAA aaaaaaa 1"]
+    execute(sam, expected, region="chr1:100000-199999")
+    
+    print("Family index")
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    records = run_family_index(reads, sam[1].read1.qname).splitlines()
+    if sorted(record.split("\t")[0] for record in records) != sorted([sam[1].read1.qname] * 2 + [sam[2].read1.qname] * 2):
+        sys.exit("Failed")
+    
+    print("Stale index")
+    # A sam rewritten to the same size is indexed again, here the records before the region grow so
+    # that the old offsets would fall within them
+    sam = [Pair(Read("AAAAAAA", pos=100000), Read("CCCCCCC", pos=100000)),
+           Pair(Read("GGGGGGG", pos=300000), Read("TTTTTTT", pos=300000))]
+    replacement = [Pair(Read("AAAAAAAAA", pos=100000), Read("CCCCCCCCC", pos=100000)),
+                   Pair(Read("GGGGG", pos=300000), Read("TTTTT", pos=300000))]
+    for pair, replaced in zip(sam, replacement):
+        replaced.read1.qname = replaced.read2.qname = pair.read1.qname
+    order = lambda x:(x.rname, x.pos, x.flag & REVERSED)
+    reindexed, indexed = run_rewritten(sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=order),
+                                       sorted([read for pair in replacement for read in [pair.read1, pair.read2]], key=order), "chr1:300000-399999")
+    if not indexed or reindexed != indexed:
+        sys.exit("Failed")
+    
+    print("Stats only")
+    run_stats_only(reads, None)
+    sam = [Pair(Read("AAATTTT"),
+                Read("   TTTTCCC"), barcode="AAA-CCC"),
+           Pair(Read("AAAGTTT"),
+                Read("   TTTTCCC"), barcode="AAA-CCC"),
+           Pair(Read("AAATTTT", qual="aaaaaak"),
+                Read("   TTTACCC"), barcode="AAA-CCC"),
+           Pair(Read("CCCCCCC"),
+                Read("GGGGGGG"), barcode="GGG-TTT")]
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    run_stats_only(reads, None)
+    run_stats_only(reads, "thruplex")
+    
+    print("Saturation")
+    # Two families of three and one, every family is seen by the full set of read pairs
+    saturation = json.loads(run_stats_only(reads, None))["saturation"]
+    if saturation["subsampled_families"][-1] != 2 or saturation["expected_families"][-1] != 2 or \
+       saturation["subsampled_families"] != sorted(saturation["subsampled_families"]) or \
+       abs(saturation["expected_families"][4] - (1 - 0.5 ** 3) - 0.5) > 0.1 or saturation["estimated_library_size"] < 2:
+        sys.exit("Failed")
+    
+    print("Orphans")
+    # Reads whose mates were filtered are counted once the position or contig of the mate has passed,
+    # whether the mate is on the same contig or one that is reached later
+    sam = [Pair(Read("AAAAAAA"), Read("       CCCCCCC")),
+           Pair(Read("GGGGGGG", pos=100), Read("TTTTTTT", pos=200)),
+           Pair(Read("AAAAAAA", pos=300), Read("CCCCCCC", pos=50, rname="chr2")),
+           Pair(Read("GGGGGGG", pos=400), Read("TTTTTTT", pos=60, rname="chr3"))]
+    sam[1].read2.flag |= SUPPLEMENTARY
+    sam[3].read2.flag |= SECONDARY
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    stats = json.loads(run_stats_only(reads, None))
+    if stats["orphaned_reads"] != 2 or stats["family_sizes"] != {"1": 1.0} or stats["saturation"]["subsampled_families"][-1] != 2:
+        sys.exit("Failed")
+    
+    print("Hash seed")
+    # Members reach the dedupe function in the order of the hash table chains, which must affect
+    # neither the grouping of barcodes and optical duplicates nor the names of the consensus reads.
+    # The families of chr1 stay open to the end of the contig and are popped in bucket order, so the
+    # entries reused by chr2, and the chains rebuilt when it outgrows the table, follow the seed.
+    random.seed(1)
+    sam = []
+    for rname, positions, members in [("chr1", 150, 4), ("chr2", 400, 6)]:
+        for pos in range(1, positions + 1):
+            for i in range(members):
+                pair = Pair(Read("AAAAAAA", pos=pos, rname=rname), Read("CCCCCCC", pos=5000, rname=rname), barcode=random.choice("AB"))
+                pair.read1.qname = pair.read2.qname = "M1:1:FC1:1:{}:{}:{}:{}".format(random.randint(1101, 1102), random.randint(1000, 1300), random.randint(1000, 1300), pair.read1.qname)
+                sam.append(pair)
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    records, summary = run_seeded(reads, ["--umi", "prism", "--optical-duplicate-distance", "100"])
+    if not records or summary["duplicate_rate_optical"] == 0:
+        sys.exit("Failed")
+    
+    print("Closed families")
+    # Families closed as the input passes their mates give the same consensus, optical duplicates
+    # included, as when spilling under --max-memory defers them to the end of the contig. Half the
+    # families share the mate position at which the table outgrows the budget.
+    random.seed(2)
+    sam = []
+    for pos in range(1, 801):
+        for i in range(6):
+            pair = Pair(Read("AAAAAAA", pos=pos), Read("CCCCCCC", pos=5000 if pos <= 400 else 6000 + pos), barcode=random.choice("AB"))
+            pair.read1.qname = pair.read2.qname = "M1:1:FC1:1:{}:{}:{}:{}".format(random.randint(1101, 1102), random.randint(1000, 1300), random.randint(1000, 1300), pair.read1.qname)
+            sam.append(pair)
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    records, summary = run_seeded(reads, ["--umi", "prism", "--optical-duplicate-distance", "100"])
+    if not records or summary["duplicate_rate_optical"] == 0:
+        sys.exit("Failed")
+    
+    print("Invalid illumina read name")
+    # Optical duplicate detection requires illumina read names, including for families of one
+    for sam in [[Pair(Read("AAAAAAA"), Read("       CCCCCCC"))],
+                [Pair(Read("AAAAAAA"), Read("       CCCCCCC")) for i in range(2)]]:
+        reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+        if "Invalid illumina read name" not in run_failing(reads, ["--optical-duplicate-distance", "100"]):
+            sys.exit("Failed")
+    
+    print("Mark duplicates")
+    # Every pair of a family except the one its consensus is named after is flagged, including those
+    # outvoted by the cigars of the rest, and nothing else changes. Orphans and secondary reads are
+    # written as they are, in the order fed.
+    sam = [Pair(Read("AAAAAAA"), Read("       CCCCCCC")) for i in range(3)] + \
+          [Pair(Read("AAAAAAA", cigar="2S5M"), Read("       CCCCCCC")),
+           Pair(Read("GGGGGGG", pos=100), Read("TTTTTTT", pos=200)),
+           Pair(Read("GGGGGGG", pos=300), Read("TTTTTTT", pos=50, rname="chr2")),
+           Pair(Read("AAAAAAA", pos=300), Read("CCCCCCC", pos=60, rname="chr2")),
+           Pair(Read("AAAAAAA", pos=300), Read("CCCCCCC", pos=60, rname="chr2"))]
+    sam[4].read2.flag |= SUPPLEMENTARY
+    secondary = Read("GGGGGGG", pos=100)
+    secondary.qname, secondary.flag, secondary.rnext, secondary.pnext = sam[0].read1.qname, FIRST | SECONDARY, "*", 0
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]] + [secondary], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    for lanes, no_mmap in [(1, False), (1, True), (2, False)]:
+        header, records = run_marked(reads, lanes, no_mmap)
+        flagged = [record.split("\t") for record in records.splitlines()]
+        for record in flagged:
+            record[1] = str(int(record[1]) & ~DUPLICATE)
+        if sorted("\t".join(record) + "\n" for record in flagged) != sorted(str(read) for read in reads):
+            sys.exit("Failed")
+        if lanes == 1 and "".join("\t".join(record) + "\n" for record in flagged) != "".join(str(read) for read in reads):
+            sys.exit("Failed")
+        marked = sorted(record.split("\t")[0] for record in records.splitlines() if int(record.split("\t")[1]) & DUPLICATE)
+        family = [pair.read1.qname for pair in sam[:4]]
+        if len(marked) != 8 or len(set(marked)) != 4 or not set(marked) - set(family) <= {sam[6].read1.qname, sam[7].read1.qname} or \
+           sum(qname in family for qname in set(marked)) != 3:
+            sys.exit("Failed")
+    
+    print("Output shards")
+    # Both reads of each consensus pair are written to the same shard
+    sam = [Pair(Read("AAAAAAA", pos=pos), Read("       CCCCCCC", pos=pos)) for pos in range(1, 400, 10) for i in range(2)]
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    sharded = run_sharded(reads, 3)
+    for shard in sharded:
+        qnames = [record.split()[0] for record in shard]
+        if any(qnames.count(qname) != 2 for qname in qnames):
+            sys.exit("Failed")
+    if sum(len(shard) for shard in sharded) != 80 or not all(sharded):
+        sys.exit("Failed")
+    
+    print("Spill")
+    # The runs of the external sort cannot be reached from the command line, bench/spilltest puts
+    # records through a spill that writes several and truncates them
+    if subprocess.run(["make", "-s", "bench/spilltest"]).returncode != 0 or \
+       subprocess.run(["bench/spilltest"], stdout=subprocess.DEVNULL).returncode != 0:
+        sys.exit("Failed")
+    
+    print("Merged stats")
+    # A family too large for the dense bins of the family size histogram
+    sam = [Pair(Read("AAAAAAA"), Read("       CCCCCCC")) for i in range(300)] + \
+          [Pair(Read("GGGGGGG", pos=100), Read("       TTTTTTT", pos=100))]
+    reads = sorted([read for pair in sam for read in [pair.read1, pair.read2]], key=lambda x:(x.rname, x.pos, x.flag & REVERSED))
+    sample, merged = run_merged_stats(reads)
+    if sample["family_sizes"] != {"1": 0.5, "300": 0.5} or merged["family_sizes"] != sample["family_sizes"] or \
+       merged["duplicate_rate"] != sample["duplicate_rate"] or merged["saturation"]["subsampled_families"][-1] != 4:
+        sys.exit("Failed")
+    
+    
 
 
     
@@ -0,0 +1,289 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "familyindex.h"
+
+
+/*
+ * Sidecar index of the members of every family so that a single family can be inspected without
+ * processing the whole sam. The file, in native byte order, is
+ *
+ *     header   magic, sam length
+ *     families key size (uint32), member count (uint32), key, then the offsets within the sam of
+ *              the records of segment 0 and segment 1 of each member (uint64)
+ *     footer   qname hash and family offset (uint64) for every member, ordered by hash
+ *     trailer  footer offset, footer entries (uint64), magic
+ *
+ * A qname is found by binary search of the footer, hash collisions being resolved by comparing the
+ * qname of the records of each candidate family.
+ */
+
+
+typedef struct familyindexentry_t {
+    uint64_t hash;
+    uint64_t family_offset;
+    } FamilyIndexEntry;
+
+
+static const char MAGIC[8] = "EDFIDX1\n";
+static const size_t DEFAULT_MEMORY = 256 * 1024 * 1024; // budget for the qname hashes if none is given
+
+static uint64_t qname_hash(const char *qname, size_t qname_len);
+static int write_bytes(FamilyIndex *fi, const void *data, size_t len);
+static int read_at(FILE *fp, uint64_t offset, void *data, size_t len);
+static size_t record_len(const char *sam, size_t sam_len, uint64_t offset);
+
+
+
+static uint64_t qname_hash(const char *qname, size_t qname_len) {
+    // 64 bit FNV-1a, wide enough that collisions within one sam are rare
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+
+    for (i = 0; i < qname_len; ++i) {
+        hash = (hash ^ (unsigned char)qname[i]) * 1099511628211ULL;
+        }
+    return hash;
+    }
+
+
+
+static int write_bytes(FamilyIndex *fi, const void *data, size_t len) {
+    if (fwrite(data, 1, len, fi->fp) != len) {
+        return -1;
+        }
+    fi->offset += len;
+    return 0;
+    }
+
+
+
+static int read_at(FILE *fp, uint64_t offset, void *data, size_t len) {
+    if (fseeko(fp, (off_t)offset, SEEK_SET) != 0 || fread(data, 1, len, fp) != len) {
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+static size_t record_len(const char *sam, size_t sam_len, uint64_t offset) {
+    // Length of the record at offset including its newline
+    const char *end = memchr(sam + offset, '\n', sam_len - offset);
+    return end != NULL ? (size_t)(end - (sam + offset)) + 1 : sam_len - offset;
+    }
+
+
+
+FamilyIndex *family_index_new(const char *filename, const char *sam, size_t sam_len, size_t max_memory) {
+    // Families are written as they are deduped, max_memory bounds the qname hashes held for the footer,
+    // 0 for the default
+    FamilyIndex *fi = NULL;
+    uint64_t len = sam_len;
+
+    if ((fi = (FamilyIndex *)calloc(1, sizeof(FamilyIndex))) == NULL) {
+        return NULL;
+        }
+    fi->sam = sam;
+    fi->sam_len = sam_len;
+    if ((fi->qnames = spill_new(max_memory ? max_memory : DEFAULT_MEMORY)) == NULL || (fi->fp = fopen(filename, "wb")) == NULL ||
+        write_bytes(fi, MAGIC, sizeof(MAGIC)) == -1 || write_bytes(fi, &len, sizeof(len)) == -1) {
+        family_index_destroy(fi);
+        return NULL;
+        }
+    return fi;
+    }
+
+
+
+int family_index_member(FamilyIndex *fi, const char *qname0, size_t qname_len, const char *qname1) {
+    // Adds a member of the current family given the start of the record of each of its segments
+    FamilyIndexMember *member = NULL;
+    void *ptr = NULL;
+
+    if (qname0 < fi->sam || qname0 >= fi->sam + fi->sam_len || qname1 < fi->sam || qname1 >= fi->sam + fi->sam_len) {
+        return -1;
+        }
+
+    if (fi->members_len == fi->max_members_len) {
+        fi->max_members_len = fi->max_members_len ? fi->max_members_len * 2 : 64;
+        if ((ptr = realloc(fi->members, fi->max_members_len * sizeof(FamilyIndexMember))) == NULL) {
+            return -1;
+            }
+        fi->members = (FamilyIndexMember *)ptr;
+        }
+    member = fi->members + fi->members_len++;
+    member->offset[0] = qname0 - fi->sam;
+    member->offset[1] = qname1 - fi->sam;
+    member->hash = qname_hash(qname0, qname_len);
+    return 0;
+    }
+
+
+
+int family_index_family(FamilyIndex *fi, const char *key, size_t key_size) {
+    // Writes the members added since the previous family, the family of position key
+    uint64_t family_offset = fi->offset;
+    uint32_t sizes[2] = {(uint32_t)key_size, (uint32_t)fi->members_len};
+    unsigned char hash[8];
+    size_t i = 0, j = 0;
+
+    if (write_bytes(fi, sizes, sizeof(sizes)) == -1 || write_bytes(fi, key, key_size) == -1) {
+        return -1;
+        }
+    for (i = 0; i < fi->members_len; ++i) {
+        if (write_bytes(fi, fi->members[i].offset, sizeof(fi->members[i].offset)) == -1) {
+            return -1;
+            }
+
+        // Stored big endian so that spill, which compares keys bytewise, orders them numerically
+        for (j = 0; j < 8; ++j) {
+            hash[j] = (unsigned char)(fi->members[i].hash >> (56 - (8 * j)));
+            }
+        if (spill_put(fi->qnames, hash, sizeof(hash), &family_offset, sizeof(family_offset)) == -1) {
+            return -1;
+            }
+        }
+    fi->members_len = 0;
+    return 0;
+    }
+
+
+
+int family_index_finish(FamilyIndex *fi) {
+    // Writes the footer and trailer and closes the file, the index is complete only if this succeeds
+    FamilyIndexEntry entry = {0};
+    const unsigned char *hash = NULL;
+    uint64_t trailer[2] = {fi->offset, fi->qnames->records};
+    size_t key_size = 0, data_size = 0, popped = 0, j = 0;
+    void *data = NULL;
+    int ret = 0;
+
+    while ((data = spill_pop(fi->qnames, (const void **)&hash, &key_size, &data_size)) != NULL) {
+        for (entry.hash = 0, j = 0; j < 8; ++j) {
+            entry.hash = (entry.hash << 8) | hash[j];
+            }
+        memcpy(&entry.family_offset, data, sizeof(entry.family_offset));
+        if (write_bytes(fi, &entry, sizeof(entry)) == -1) {
+            ret = -1;
+            }
+        ++popped;
+        }
+
+    if (fi->qnames->failed || popped != trailer[1] || write_bytes(fi, trailer, sizeof(trailer)) == -1 || write_bytes(fi, MAGIC, sizeof(MAGIC)) == -1) {
+        ret = -1;
+        }
+    if (fclose(fi->fp) != 0) {
+        ret = -1;
+        }
+    fi->fp = NULL;
+    return ret;
+    }
+
+
+
+void family_index_destroy(FamilyIndex *fi) {
+    if (fi == NULL) {
+        return;
+        }
+    if (fi->fp != NULL) {
+        fclose(fi->fp);
+        }
+    if (fi->qnames != NULL) {
+        spill_destroy(fi->qnames);
+        }
+    free(fi->members);
+    free(fi);
+    }
+
+
+
+int family_index_lookup(const char *filename, const char *sam, size_t sam_len, const char *qname, FILE *output_file) {
+    /*
+     * Writes the records of the family containing qname to output_file, those of segment 0 of every
+     * member followed by those of segment 1 as --print-family-members does. Returns 1 if found, 0 if
+     * not and -1 if the index is unreadable or was not built from this sam.
+     */
+    FILE *fp = NULL;
+    char magic[sizeof(MAGIC)] = {0};
+    uint64_t header_sam_len = 0, trailer[2] = {0}, hash = qname_hash(qname, strlen(qname)), *offsets = NULL, low = 0, high = 0, mid = 0;
+    uint32_t sizes[2] = {0};
+    FamilyIndexEntry entry = {0};
+    size_t qname_len = strlen(qname), i = 0, j = 0;
+    off_t file_len = 0;
+    int ret = -1;
+
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        return -1;
+        }
+    if (fseeko(fp, 0, SEEK_END) != 0 || (file_len = ftello(fp)) < (off_t)(2 * sizeof(MAGIC) + sizeof(uint64_t) + sizeof(trailer)) ||
+        read_at(fp, 0, magic, sizeof(magic)) == -1 || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        read_at(fp, sizeof(MAGIC), &header_sam_len, sizeof(header_sam_len)) == -1 || header_sam_len != sam_len ||
+        read_at(fp, file_len - sizeof(MAGIC), magic, sizeof(magic)) == -1 || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        read_at(fp, file_len - sizeof(MAGIC) - sizeof(trailer), trailer, sizeof(trailer)) == -1 ||
+        trailer[0] + (trailer[1] * sizeof(FamilyIndexEntry)) != file_len - sizeof(MAGIC) - sizeof(trailer)) {
+        fclose(fp);
+        return -1;
+        }
+
+    // First footer entry with this hash
+    high = trailer[1];
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (read_at(fp, trailer[0] + (mid * sizeof(FamilyIndexEntry)), &entry, sizeof(entry)) == -1) {
+            fclose(fp);
+            return -1;
+            }
+        if (entry.hash < hash) {
+            low = mid + 1;
+            }
+        else {
+            high = mid;
+            }
+        }
+
+    for (ret = 0; ret == 0 && low < trailer[1]; ++low) {
+        if (read_at(fp, trailer[0] + (low * sizeof(FamilyIndexEntry)), &entry, sizeof(entry)) == -1) {
+            ret = -1;
+            break;
+            }
+        if (entry.hash != hash) {
+            break;
+            }
+        if (read_at(fp, entry.family_offset, sizes, sizeof(sizes)) == -1 ||
+            (offsets = realloc(offsets, (2 * sizes[1] + 1) * sizeof(uint64_t))) == NULL ||
+            read_at(fp, entry.family_offset + sizeof(sizes) + sizes[0], offsets, 2 * sizes[1] * sizeof(uint64_t)) == -1) {
+            ret = -1;
+            break;
+            }
+        for (i = 0; i < 2 * sizes[1]; ++i) {
+            if (offsets[i] >= sam_len) {
+                ret = -1;
+                break;
+                }
+            }
+
+        // Any member whose qname matches, the hash may be shared with another family
+        for (i = 0; ret == 0 && i < sizes[1]; ++i) {
+            if (offsets[2 * i] + qname_len < sam_len && memcmp(sam + offsets[2 * i], qname, qname_len) == 0 && sam[offsets[2 * i] + qname_len] == '\t') {
+                ret = 1;
+                }
+            }
+        }
+
+    if (ret == 1) {
+        for (j = 0; j < 2; ++j) {
+            for (i = 0; i < sizes[1]; ++i) {
+                if (fwrite(sam + offsets[(2 * i) + j], 1, record_len(sam, sam_len, offsets[(2 * i) + j]), output_file) == 0) {
+                    ret = -1;
+                    }
+                }
+            }
+        }
+    free(offsets);
+    fclose(fp);
+    return ret;
+    }
@@ -0,0 +1,39 @@
+#ifndef _FAMILYINDEX_H
+#define _FAMILYINDEX_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spill.h"
+
+
+typedef struct familyindexmember_t {
+    uint64_t offset[2]; // of the record of each segment within the sam
+    uint64_t hash; // of the qname
+    } FamilyIndexMember;
+
+
+typedef struct familyindex_t {
+    FILE *fp;
+    const char *sam; // start of the mapping that every recorded segment lies within
+    size_t sam_len;
+    uint64_t offset; // bytes written so far
+    FamilyIndexMember *members; // of the family currently being collected
+    size_t members_len;
+    size_t max_members_len;
+    Spill *qnames; // qname hash to family offset, sorted into the footer by family_index_finish
+    } FamilyIndex;
+
+
+
+FamilyIndex *family_index_new(const char *filename, const char *sam, size_t sam_len, size_t max_memory);
+int family_index_member(FamilyIndex *fi, const char *qname0, size_t qname_len, const char *qname1);
+int family_index_family(FamilyIndex *fi, const char *key, size_t key_size);
+int family_index_finish(FamilyIndex *fi);
+void family_index_destroy(FamilyIndex *fi);
+int family_index_lookup(const char *filename, const char *sam, size_t sam_len, const char *qname, FILE *output_file);
+
+
+#endif
@@ -6,28 +6,15 @@
 #include <stdbool.h>
 
 #include "hash.h"
+#include "profile.h"
 
 
 // static uint32_t perl_hash(const void *key, size_t length);
-static uint32_t fnv1a_hash(const void *key, size_t length);
 static int resize_buckets(HashTable *ht, uint32_t size);
 static int resize_entries(HashTable *ht, uint32_t size);
 
 
 
-static uint32_t fnv1a_hash(const void *key, size_t length) {
-    register size_t i = 0;
-    register uint32_t hash = 2166136261;
-    register const uint32_t fnv_prime = 16777619;
-    for (i = 0; i < length; ++i) {
-        hash = (hash ^ ((unsigned char *)key)[i]) * fnv_prime;
-        }
-    
-    return hash;
-    }
-
-
-
 static int cmp_uint32(const void *p1, const void *p2) {
     return *(uint32_t *)p1 - *(uint32_t *)p2;
     }
@@ -63,7 +50,7 @@ HashTable *hash_new(uint32_t size) {
         }
     
     ht->bucket_resize = 0.7;
-    ht->hash_function = &fnv1a_hash;
+    ht->hash_function = DEFAULT_HASH_FUNCTION;
     
     if (resize_buckets(ht, size) == -1 || resize_entries(ht, ht->len_buckets) == -1) {
         hash_destroy(ht);
@@ -124,7 +111,7 @@ int hash_put(HashTable *ht, const void *key, size_t key_size, const void *data,
             }
         }
     
-    bucket = ht->hash_function(key, key_size) & (ht->len_buckets - 1);
+    bucket = ht->hash_function(key, key_size, ht->seed) & (ht->len_buckets - 1);
     if (ht->buckets[bucket] == UINT32_MAX) {
         ++ht->buckets_occupied;
         }
@@ -147,7 +134,7 @@ void *hash_get(HashTable *ht, const void *key, size_t key_size, size_t *data_siz
     HashEntry *entry = NULL;
     
     //fprintf(stderr, "get\n");
-    bucket = ht->hash_function(key, key_size) & (ht->len_buckets - 1);
+    bucket = ht->hash_function(key, key_size, ht->seed) & (ht->len_buckets - 1);
     for (i = ht->buckets[bucket]; i != UINT32_MAX; i = entry->next) {
         entry = ht->entries + i;
         if (key_size == entry->key_size && memcmp(key, entry->key, key_size) == 0) {
@@ -162,12 +149,18 @@ void *hash_get(HashTable *ht, const void *key, size_t key_size, size_t *data_siz
 
 void *hash_pop(HashTable *ht, const void *key, size_t key_size, size_t *data_size) {
     uint32_t i = 0, bucket = 0;
+#ifdef ELDUDERINO_PROFILE
+    uint32_t probes = 0;
+#endif
     HashEntry *entry = NULL, *previous = NULL;
     
     //fprintf(stderr, "pop\n");
-    bucket = ht->hash_function(key, key_size) & (ht->len_buckets - 1);
+    bucket = ht->hash_function(key, key_size, ht->seed) & (ht->len_buckets - 1);
     for (i = ht->buckets[bucket]; i != UINT32_MAX; i = entry->next) {
         entry = ht->entries + i;
+#ifdef ELDUDERINO_PROFILE
+        ++probes;
+#endif
         if (key_size == entry->key_size && memcmp(key, entry->key, key_size) == 0) {
             if (previous == NULL) {
                 if ((ht->buckets[bucket] = entry->next) == UINT32_MAX) {
@@ -183,16 +176,114 @@ void *hash_pop(HashTable *ht, const void *key, size_t key_size, size_t *data_siz
             *data_size = entry->data_size;
             void *data = (void *)entry->data;
             memset(entry, 0, sizeof(HashEntry)); // this could be changed to just zero *key in production code but_vaidate would fail in this situation
+            PROFILE_PROBES(hash_probes, probes);
             return data;
             }
         
         previous = entry;
         }
+    PROFILE_PROBES(hash_probes, probes);
     return NULL;
     }
 
 
 
+uint32_t hash_key(HashTable *ht, const void *key, size_t key_size) {
+    // The hash of key, which stays valid for hash_pop_or_put however the table is resized meanwhile
+    return ht->hash_function(key, key_size, ht->seed);
+    }
+
+
+
+void hash_prefetch_bucket(HashTable *ht, uint32_t hash) {
+    // First of the two dependent loads of a lookup, the second being hash_prefetch_chain which
+    // should follow once this has had time to arrive
+    __builtin_prefetch(ht->buckets + (hash & (ht->len_buckets - 1)));
+    }
+
+
+
+void hash_prefetch_chain(HashTable *ht, uint32_t hash) {
+    uint32_t i = ht->buckets[hash & (ht->len_buckets - 1)];
+    
+    if (i != UINT32_MAX) {
+        __builtin_prefetch(ht->entries + i);
+        }
+    }
+
+
+
+int hash_pop_or_put(HashTable *ht, uint32_t hash, const void *key, size_t key_size, const void *data, size_t data_size, const void **popped, size_t *popped_size) {
+    /*
+     * Pops the entry matching key if there is one, otherwise puts key and data, in a single walk of
+     * the chain. hash is from hash_key. Returns 1 with the popped data, 0 if key was put or -1 if the
+     * table could not be grown.
+     */
+    uint32_t i = 0, bucket = 0;
+#ifdef ELDUDERINO_PROFILE
+    uint32_t probes = 0;
+#endif
+    HashEntry *entry = NULL, *previous = NULL;
+    
+    bucket = hash & (ht->len_buckets - 1);
+    for (i = ht->buckets[bucket]; i != UINT32_MAX; i = entry->next) {
+        entry = ht->entries + i;
+#ifdef ELDUDERINO_PROFILE
+        ++probes;
+#endif
+        if (key_size == entry->key_size && memcmp(key, entry->key, key_size) == 0) {
+            if (previous == NULL) {
+                if ((ht->buckets[bucket] = entry->next) == UINT32_MAX) {
+                    --ht->buckets_occupied;
+                    }
+                }
+            else {
+                previous->next = entry->next;
+                }
+            
+            ht->available_entries[--ht->entries_occupied] = i;
+            
+            *popped = entry->data;
+            *popped_size = entry->data_size;
+            memset(entry, 0, sizeof(HashEntry));
+            PROFILE_PROBES(hash_probes, probes);
+            return 1;
+            }
+        
+        previous = entry;
+        }
+    PROFILE_PROBES(hash_probes, probes);
+    
+    if (ht->buckets_occupied > ht->len_buckets * ht->bucket_resize) {
+        if ((resize_buckets(ht, ht->len_buckets * 2)) == -1) {
+            return -1;
+            }
+        bucket = hash & (ht->len_buckets - 1);
+        }
+    
+    if (ht->entries_occupied == ht->len_entries) {
+        if ((resize_entries(ht, ht->len_entries * 2)) == -1) {
+            return -1;
+            }
+        }
+    
+    if (ht->buckets[bucket] == UINT32_MAX) {
+        ++ht->buckets_occupied;
+        }
+    
+    i = ht->available_entries[ht->entries_occupied++];
+    entry = ht->entries + i;
+    entry->key = key;
+    entry->key_size = key_size;
+    entry->data = data;
+    entry->data_size = data_size;
+    entry->next = ht->buckets[bucket];
+    ht->buckets[bucket] = i;
+    return 0;
+    }
+
+
+
 int hash_validate(HashTable *ht, FILE *fp) {
     uint32_t i = 0, buckets_occupied = 0, *available = NULL, j = 0;
     HashEntry *entry = NULL, zero_entry;
@@ -320,7 +411,7 @@ static int resize_buckets(HashTable *ht, uint32_t size) {
     for (i = 0; i < ht->len_entries; ++i) {
         entry = ht->entries + i;
         if (entry->key != NULL) {
-            bucket = ht->hash_function(entry->key, entry->key_size) & (ht->len_buckets - 1);
+            bucket = ht->hash_function(entry->key, entry->key_size, ht->seed) & (ht->len_buckets - 1);
             if (ht->buckets[bucket] == UINT32_MAX) {
                 ++ht->buckets_occupied;
                 }
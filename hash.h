@@ -4,13 +4,11 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 
-#ifndef _HASH_FUNCTION_T
-#define _HASH_FUNCTION_T
-typedef uint32_t (*hash_function_t)(const void *key, size_t length);
-#endif
+#include "hashfunc.h"
 
 
 typedef struct hashentry_t {
@@ -31,7 +29,8 @@ typedef struct hashtable_t {
     uint32_t entries_occupied;
     uint32_t *available_entries;
     float bucket_resize;
-    hash_function_t hash_function;
+    hash_function_t hash_function; // these two may only be changed while the table is empty
+    uint64_t seed;
     } HashTable;
 
 
@@ -41,6 +40,10 @@ void hash_destroy(HashTable *ht);
 int hash_put(HashTable *ht, const void *key, size_t key_size, const void *data, size_t data_size);
 void *hash_get(HashTable *ht, const void *key, size_t key_size, size_t *data_size);
 void *hash_pop(HashTable *ht, const void *key, size_t key_size, size_t *data_size);
+uint32_t hash_key(HashTable *ht, const void *key, size_t key_size);
+void hash_prefetch_bucket(HashTable *ht, uint32_t hash);
+void hash_prefetch_chain(HashTable *ht, uint32_t hash);
+int hash_pop_or_put(HashTable *ht, uint32_t hash, const void *key, size_t key_size, const void *data, size_t data_size, const void **popped, size_t *popped_size);
 void hash_summary_fprintf(HashTable *ht, FILE *fp);
 void hash_contents_fprintf(HashTable *ht, FILE *fp);
 int hash_validate(HashTable *ht, FILE *fp);
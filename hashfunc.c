@@ -0,0 +1,106 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "hashfunc.h"
+
+
+static uint64_t wymix(uint64_t a, uint64_t b);
+static uint64_t read64(const unsigned char *p);
+static uint64_t read32(const unsigned char *p);
+
+
+const NamedHashFunction HASH_FUNCTIONS[] = {{"wyhash", wy_hash},
+                                            {"fnv1a", fnv1a_hash},
+                                            {NULL, NULL}};
+
+static const uint64_t WY_SECRET[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+
+
+hash_function_t hash_function_named(const char *name) {
+    // NULL if there is no such function
+    int i = 0;
+
+    for (i = 0; HASH_FUNCTIONS[i].name != NULL; ++i) {
+        if (strcmp(HASH_FUNCTIONS[i].name, name) == 0) {
+            return HASH_FUNCTIONS[i].function;
+            }
+        }
+    return NULL;
+    }
+
+
+
+uint32_t fnv1a_hash(const void *key, size_t length, uint64_t seed) {
+    // One byte per multiply, the seed is folded into the offset basis
+    register size_t i = 0;
+    register uint32_t hash = 2166136261 ^ (uint32_t)(seed ^ (seed >> 32));
+    register const uint32_t fnv_prime = 16777619;
+
+    for (i = 0; i < length; ++i) {
+        hash = (hash ^ ((unsigned char *)key)[i]) * fnv_prime;
+        }
+
+    return hash;
+    }
+
+
+
+static uint64_t wymix(uint64_t a, uint64_t b) {
+    // Folds the 128 bit product, every bit of which depends on every bit of both inputs
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+    }
+
+
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v;
+    }
+
+
+
+static uint64_t read32(const unsigned char *p) {
+    uint32_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v;
+    }
+
+
+
+uint32_t wy_hash(const void *key, size_t length, uint64_t seed) {
+    /*
+     * wyhash, consuming 16 bytes per 64 bit multiply. Qnames and position keys are 20 to 60 bytes
+     * so only the 16 byte loop and the overlapping reads of the final 16 bytes are exercised, the
+     * 48 byte loop of the original is not needed. Keys of 16 bytes or less are read as overlapping
+     * 4 byte words.
+     */
+    const unsigned char *p = (const unsigned char *)key;
+    size_t i = length;
+    uint64_t a = 0, b = 0, r = 0;
+    __uint128_t m = 0;
+
+    seed ^= wymix(seed ^ WY_SECRET[0], WY_SECRET[1]);
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (read32(p) << 32) | read32(p + ((length >> 3) << 2));
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - ((length >> 3) << 2));
+            }
+        else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            }
+        }
+    else {
+        for (; i > 16; i -= 16, p += 16) {
+            seed = wymix(read64(p) ^ WY_SECRET[1], read64(p + 8) ^ seed);
+            }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+        }
+
+    m = (__uint128_t)(a ^ WY_SECRET[1]) * (b ^ seed);
+    r = wymix((uint64_t)m ^ WY_SECRET[0] ^ length, (uint64_t)(m >> 64) ^ WY_SECRET[1]);
+    return (uint32_t)(r ^ (r >> 32));
+    }
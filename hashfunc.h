@@ -0,0 +1,31 @@
+#ifndef _HASHFUNC_H
+#define _HASHFUNC_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+
+#define DEFAULT_HASH_FUNCTION wy_hash
+
+
+// Every function of the family takes a seed so that keys colliding under one seed are unlikely to
+// collide under another
+typedef uint32_t (*hash_function_t)(const void *key, size_t length, uint64_t seed);
+
+
+typedef struct namedhashfunction_t {
+    const char *name;
+    hash_function_t function;
+    } NamedHashFunction;
+
+
+extern const NamedHashFunction HASH_FUNCTIONS[]; // terminated by a NULL name
+
+
+
+uint32_t fnv1a_hash(const void *key, size_t length, uint64_t seed);
+uint32_t wy_hash(const void *key, size_t length, uint64_t seed);
+hash_function_t hash_function_named(const char *name);
+
+
+#endif
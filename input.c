@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "input.h"
+
+
+static int fill(SamInput *in, size_t end);
+static void advise_ahead(SamInput *in, size_t offset);
+static void release_pages(SamInput *in, size_t first, size_t end);
+
+
+
+SamInput *input_new(int fd, size_t len, bool mapped) {
+    // The reservation for pread is never committed beyond the pages that are filled
+    SamInput *in = NULL;
+
+    if ((in = (SamInput *)calloc(1, sizeof(SamInput))) == NULL) {
+        return NULL;
+        }
+    in->fd = fd;
+    in->len = len;
+    in->mapped = mapped;
+    in->page_size = sysconf(_SC_PAGESIZE);
+    in->words_len = (((len + in->page_size - 1) / in->page_size) + 63) / 64;
+    if (mapped) {
+        in->sam = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        in->read = len;
+        }
+    else {
+        in->sam = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        }
+    if (in->sam == MAP_FAILED) {
+        free(in);
+        return NULL;
+        }
+    if ((in->released = calloc(in->words_len, sizeof(uint64_t))) == NULL ||
+        (in->referenced = calloc(in->words_len, sizeof(uint64_t))) == NULL) {
+        input_destroy(in);
+        return NULL;
+        }
+    return in;
+    }
+
+
+
+static int fill(SamInput *in, size_t end) {
+    // Reads the reservation up to end, a no-op if mapped
+    ssize_t n = 0;
+
+    while (in->read < end) {
+        if ((n = pread(in->fd, in->sam + in->read, end - in->read, in->read)) == -1 && errno == EINTR) {
+            continue;
+            }
+        if (n <= 0) {
+            return -1;
+            }
+        in->read += n;
+        }
+    return 0;
+    }
+
+
+
+static void advise_ahead(SamInput *in, size_t offset) {
+    // Starts reading the chunk beyond offset in the background, the kernel's own readahead being far
+    // smaller than a chunk
+    size_t start = offset - (offset % in->page_size), len = INPUT_CHUNK;
+
+    if (start >= in->len) {
+        return;
+        }
+    if (len > in->len - start) {
+        len = in->len - start;
+        }
+    if (in->mapped) {
+        madvise(in->sam + start, len, MADV_WILLNEED);
+        }
+    else {
+        posix_fadvise(in->fd, start, len, POSIX_FADV_WILLNEED);
+        }
+    }
+
+
+
+int input_next(SamInput *in, const char **records, size_t *len) {
+    // Returns 1 with the next chunk of whole records, 0 once all have been returned or -1 on a read
+    // error. Every chunk stays valid until it is released by input_release.
+    size_t end = in->fed, chunk_end = in->fed;
+    const char *newline = NULL;
+
+    if (in->fed == in->len) {
+        return 0;
+        }
+    if (in->fed == 0) {
+        posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (in->mapped) {
+            madvise(in->sam, in->len, MADV_SEQUENTIAL);
+            }
+        }
+
+    // Ends after the last newline within the chunk, extended by further chunks if a record is longer
+    while (newline == NULL && chunk_end < in->len) {
+        chunk_end = chunk_end + INPUT_CHUNK < in->len ? chunk_end + INPUT_CHUNK : in->len;
+        if (fill(in, chunk_end) == -1) {
+            return -1;
+            }
+        newline = chunk_end < in->len ? memrchr(in->sam + end, '\n', chunk_end - end) : NULL;
+        end = chunk_end;
+        }
+    if (newline != NULL) {
+        end = newline + 1 - in->sam;
+        }
+    advise_ahead(in, chunk_end);
+
+    *records = in->sam + in->fed;
+    *len = end - in->fed;
+    in->fed = end;
+    return 1;
+    }
+
+
+
+void input_reference(void *context, const char *start, const char *end) {
+    // dedupe_reference_t that keeps the pages holding start to end from being released
+    SamInput *in = context;
+    size_t page = 0, last = 0;
+
+    if (start == NULL || end <= start || start < in->sam || end > in->sam + in->len) {
+        return;
+        }
+    last = (end - 1 - in->sam) / in->page_size;
+    for (page = (start - in->sam) / in->page_size; page <= last; ++page) {
+        in->referenced[page / 64] |= 1ULL << (page % 64);
+        }
+    }
+
+
+
+static void release_pages(SamInput *in, size_t first, size_t end) {
+    // Drops the pages from the mapping and from the page cache
+    size_t offset = first * in->page_size, len = (end - first) * in->page_size;
+
+    madvise(in->sam + offset, len, MADV_DONTNEED);
+    posix_fadvise(in->fd, offset, len, POSIX_FADV_DONTNEED);
+    }
+
+
+
+void input_release(SamInput *in) {
+    /*
+     * Releases every page wholly behind the feed that was not reported by input_reference since the
+     * previous call, consecutive pages together. A released page of a reservation reads as zeros so
+     * every record that will be read again must have been reported.
+     */
+    size_t limit = in->fed / in->page_size, page = 0, start = SIZE_MAX, w = 0;
+    uint64_t bit = 0;
+
+    for (page = in->first_unreleased * 64; page < limit; ++page) {
+        w = page / 64;
+        bit = 1ULL << (page % 64);
+        if (bit == 1 && in->released[w] == UINT64_MAX) {
+            // Most words are wholly released once the feed has passed them
+            if (start != SIZE_MAX) {
+                release_pages(in, start, page);
+                start = SIZE_MAX;
+                }
+            page += 63;
+            }
+        else if ((in->released[w] | in->referenced[w]) & bit) {
+            if (start != SIZE_MAX) {
+                release_pages(in, start, page);
+                start = SIZE_MAX;
+                }
+            }
+        else {
+            start = start == SIZE_MAX ? page : start;
+            in->released[w] |= bit;
+            }
+        }
+    if (start != SIZE_MAX) {
+        release_pages(in, start, limit);
+        }
+
+    for (; in->first_unreleased < in->words_len && in->released[in->first_unreleased] == UINT64_MAX; ++in->first_unreleased);
+    memset(in->referenced, 0, in->words_len * sizeof(uint64_t));
+    }
+
+
+
+void input_destroy(SamInput *in) {
+    if (in == NULL) {
+        return;
+        }
+    if (in->sam != MAP_FAILED && in->sam != NULL) {
+        munmap(in->sam, in->len);
+        }
+    free(in->released);
+    free(in->referenced);
+    free(in);
+    }
@@ -0,0 +1,39 @@
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define INPUT_CHUNK (64 * 1024 * 1024) // unit of feeding and readahead, a multiple of the page size
+
+
+// The whole sam at a fixed address, either mapped or an anonymous reservation filled by pread as it
+// is fed. Pages behind the feed that hold no referenced record are released so that a long run
+// does not hold the page cache of the whole file.
+typedef struct saminput_t {
+    int fd;
+    char *sam;
+    size_t len;
+    bool mapped;
+    size_t read; // bytes of the reservation filled by pread, all of them if mapped
+    size_t fed; // bytes returned by input_next
+    size_t page_size;
+    size_t words_len; // of each bitmap, one bit per page
+    uint64_t *released; // pages that have been dropped
+    uint64_t *referenced; // pages reported by input_reference since the last input_release
+    size_t first_unreleased; // word of released before which every page has been dropped
+    } SamInput;
+
+
+
+SamInput *input_new(int fd, size_t len, bool mapped);
+int input_next(SamInput *in, const char **records, size_t *len);
+void input_reference(void *context, const char *start, const char *end);
+void input_release(SamInput *in);
+void input_destroy(SamInput *in);
+
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "json.h"
+
+
+static void json_key(JsonWriter *jw, const char *key);
+
+
+
+void json_init(JsonWriter *jw, FILE *fp) {
+    jw->fp = fp;
+    jw->depth = 0;
+    jw->empty[0] = true;
+    jw->array[0] = false;
+    }
+
+
+
+void json_resume(JsonWriter *jw, FILE *fp, bool empty) {
+    // Continues an object whose opening brace and any members have already been written to fp
+    json_init(jw, fp);
+    jw->depth = 1;
+    jw->empty[1] = empty;
+    jw->array[1] = false;
+    }
+
+
+
+static void json_key(JsonWriter *jw, const char *key) {
+    // Separates a value from the previous one and writes its key if within an object
+    if (jw->depth > 0) {
+        if (jw->array[jw->depth]) {
+            fprintf(jw->fp, "%s", jw->empty[jw->depth] ? "" : ", ");
+            }
+        else {
+            fprintf(jw->fp, "%s\n%*s\"%s\": ", jw->empty[jw->depth] ? "" : ",", 4 * jw->depth, "", key);
+            }
+        }
+    jw->empty[jw->depth] = false;
+    }
+
+
+
+void json_begin_object(JsonWriter *jw, const char *key) {
+    json_key(jw, key);
+    fprintf(jw->fp, "{");
+    ++jw->depth;
+    jw->empty[jw->depth] = true;
+    jw->array[jw->depth] = false;
+    }
+
+
+
+void json_begin_array(JsonWriter *jw, const char *key) {
+    json_key(jw, key);
+    fprintf(jw->fp, "[");
+    ++jw->depth;
+    jw->empty[jw->depth] = true;
+    jw->array[jw->depth] = true;
+    }
+
+
+
+void json_end(JsonWriter *jw) {
+    if (jw->array[jw->depth]) {
+        fprintf(jw->fp, "]");
+        }
+    else if (jw->empty[jw->depth]) {
+        fprintf(jw->fp, "}");
+        }
+    else {
+        fprintf(jw->fp, "\n%*s}", 4 * (jw->depth - 1), "");
+        }
+    --jw->depth;
+    }
+
+
+
+void json_uint(JsonWriter *jw, const char *key, uint64_t value) {
+    json_key(jw, key);
+    fprintf(jw->fp, "%llu", (unsigned long long)value);
+    }
+
+
+
+void json_double(JsonWriter *jw, const char *key, double value, int precision) {
+    // Rates of nothing are null rather than nan, which is not valid json
+    json_key(jw, key);
+    if (isfinite(value)) {
+        fprintf(jw->fp, "%.*f", precision, value);
+        }
+    else {
+        fprintf(jw->fp, "null");
+        }
+    }
+
+
+
+void json_null(JsonWriter *jw, const char *key) {
+    json_key(jw, key);
+    fprintf(jw->fp, "null");
+    }
@@ -0,0 +1,33 @@
+#ifndef _JSON_H
+#define _JSON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define JSON_MAX_DEPTH 8
+
+
+// Streaming writer of indented json, objects have one member per line and arrays are written on one
+// line. Keys are written as given and so must not need escaping.
+typedef struct jsonwriter_t {
+    FILE *fp;
+    int depth;
+    bool empty[JSON_MAX_DEPTH]; // nothing has yet been written within the object or array at each depth
+    bool array[JSON_MAX_DEPTH];
+    } JsonWriter;
+
+
+
+void json_init(JsonWriter *jw, FILE *fp);
+void json_resume(JsonWriter *jw, FILE *fp, bool empty);
+void json_begin_object(JsonWriter *jw, const char *key);
+void json_begin_array(JsonWriter *jw, const char *key);
+void json_end(JsonWriter *jw);
+void json_uint(JsonWriter *jw, const char *key, uint64_t value);
+void json_double(JsonWriter *jw, const char *key, double value, int precision);
+void json_null(JsonWriter *jw, const char *key);
+
+
+#endif
@@ -0,0 +1,870 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "elduderino.h"
+#include "region.h"
+#include "input.h"
+#include "merge.h"
+#include "familyindex.h"
+#include "stats.h"
+#include "profile.h"
+#include "shard.h"
+
+
+#define MERGE_RUNS 256 // runs of merged records fed at once
+
+
+typedef struct sample_t {
+    char **input_filenames; // position sorted sams that are merged as they are fed, usually only one
+    size_t inputs_len;
+    char *output_filename; // NULL or "-" for stdout
+    char *stats_filename;
+    char *family_index_filename; // written, or read by --print-family-members, if set
+    bool pread_input; // read the sam with pread rather than mapping it
+    size_t output_shards; // output is spread across this many files if set
+    char error_message[256]; // set if the sample failed
+    } Sample;
+
+
+typedef struct manifest_t {
+    const DedupeOptions *options;
+    Regions *regions;
+    Sample *samples;
+    size_t len;
+    size_t next; // next sample to be claimed by a worker
+    pthread_mutex_t lock;
+    } Manifest;
+
+
+bool endswith(const char *text, const char *suffix);
+int run_sample(const DedupeOptions *sample_options, Regions *regions, Sample *sample, Stats *merged);
+int select_regions(Sample *sample, SamInput *input, Regions *regions, RecordSpan **spans, size_t *spans_len);
+int feed_spans(Dedupe *dd, const char *sam, RecordSpan *spans, size_t spans_len);
+int feed_input(Sample *sample, Dedupe *dd, SamInput *input);
+int feed_merged(Sample *sample, Dedupe *dd, SamMerge *merge);
+int open_inputs(Sample *sample, SamInput ***inputs, size_t *total_len);
+void close_inputs(SamInput **inputs, size_t len);
+int lookup_family(Sample *sample, const char *qname, const char *sam, size_t sam_len, FILE *output_file);
+void read_manifest(const char *manifest_filename, Manifest *manifest);
+char *replace_suffix(const char *filename, const char *suffix, const char *replacement);
+void *manifest_worker(void *arg);
+
+
+
+int main (int argc, char **argv) {
+    /*
+     * Command line front end to the library, maps the sam file and feeds it to a single context.
+     */
+    const char *output_filename = NULL, *stats_filename = NULL, *manifest_filename = NULL, *family_index_filename = NULL;
+
+    DedupeOptions options = {0};
+    Regions regions = {0};
+    Sample sample = {0};
+    Manifest manifest = {0};
+    Stats merged = {0}, *shard = NULL;
+    pthread_t *threads = NULL;
+    long threads_len = 0, output_shards = 0, i = 0;
+    bool failed = false, merge_failed = false, pread_input = false;
+
+    // variable needed by strtol
+    char *endptr = NULL;
+    long val = 0;
+    // variables needed by getopt_long
+    int option_index = 0, c = 0;
+    static struct option long_options[] = {{"output", required_argument, 0, 'o'},
+                                           {"stats", required_argument, 0, 's'},
+                                           {"umi", required_argument, 0, 'u'},
+                                           {"min-family-size", required_argument, 0, 'm'},
+                                           {"optical-duplicate-distance", required_argument, 0, 'p'},
+                                           {"print-family-members", required_argument, 0, 'P'},
+                                           {"max-memory", required_argument, 0, 'M'},
+                                           {"collated", no_argument, 0, 'c'},
+                                           {"profile", no_argument, 0, 'f'},
+                                           {"progress", required_argument, 0, 'g'},
+                                           {"heartbeat", required_argument, 0, 'H'},
+                                           {"manifest", required_argument, 0, 'F'},
+                                           {"threads", required_argument, 0, 't'},
+                                           {"region", required_argument, 0, 'r'},
+                                           {"targets", required_argument, 0, 'T'},
+                                           {"family-index", required_argument, 0, 'I'},
+                                           {"stats-only", no_argument, 0, 'S'},
+                                           {"no-mmap", no_argument, 0, 'N'},
+                                           {"hash", required_argument, 0, 'x'},
+                                           {"hash-seed", required_argument, 0, 'X'},
+                                           {"mark-duplicates", no_argument, 0, 'D'},
+                                           {"output-shards", required_argument, 0, 'O'},
+                                           {"duplex", no_argument, 0, 'd'},
+                                           {"likelihood-consensus", no_argument, 0, 'L'},
+                                           {0, 0, 0, 0}};
+
+    // Parse optional arguments
+    while (c != -1) {
+        c = getopt_long(argc, argv, "o:s:u:m:p:P:M:cfg:H:F:t:r:T:I:SNx:X:DO:dL", long_options, &option_index);
+
+        switch (c) {
+            case 'P':
+                options.print_family_members = optarg;
+                break;
+
+            case 'o':
+                output_filename = optarg;
+                break;
+
+            case 's':
+                if (!endswith(optarg, ".json")) {
+                    fprintf(stderr, "Error: Stats file must be of type json\n");
+                    exit(EXIT_FAILURE);
+                    }
+                stats_filename = optarg;
+                break;
+
+            case 'm':
+                errno = 0;
+                val = strtol(optarg, &endptr, 10);
+                if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg)) {
+                    fprintf(stderr, "Error: Invalid --min-family-size\n");
+                    exit(EXIT_FAILURE);
+                    }
+                options.min_family_size = (size_t)val;
+                break;
+
+            case 'c':
+                options.collated = true;
+                break;
+
+            case 'S':
+                options.stats_only = true;
+                break;
+
+            case 'D':
+                options.mark_duplicates = true;
+                break;
+
+            case 'd':
+                options.duplex = true;
+                break;
+
+            case 'L':
+                options.likelihood_consensus = true;
+                break;
+
+            case 'N':
+                pread_input = true;
+                break;
+
+            case 'x':
+                if (hash_function_named(optarg) == NULL) {
+                    fprintf(stderr, "Error: Invalid --hash %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                    }
+                options.hash_function = optarg;
+                break;
+
+            case 'X':
+                errno = 0;
+                options.hash_seed = strtoull(optarg, &endptr, 0);
+                if (errno != 0 || endptr == optarg || *endptr != '\0') {
+                    fprintf(stderr, "Error: Invalid --hash-seed\n");
+                    exit(EXIT_FAILURE);
+                    }
+                break;
+
+            case 'f':
+#ifdef ELDUDERINO_PROFILE
+                profile.enabled = true;
+#else
+                fprintf(stderr, "Error: --profile requires elduderino to be built with make PROFILE=1\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+
+            case 'g':
+                errno = 0;
+                val = strtol(optarg, &endptr, 10);
+                if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg) || val < 1 || val > INT_MAX) {
+                    fprintf(stderr, "Error: Invalid --progress\n");
+                    exit(EXIT_FAILURE);
+                    }
+                options.progress_interval = (int)val;
+                options.print_progress = true;
+                break;
+
+            case 'H':
+                options.heartbeat_filename = optarg;
+                break;
+
+            case 'F':
+                manifest_filename = optarg;
+                break;
+
+            case 'I':
+                family_index_filename = optarg;
+                break;
+
+            case 'r':
+                if (regions_parse(&regions, optarg) == -1) {
+                    fprintf(stderr, "Error: Invalid --region %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                    }
+                break;
+
+            case 'T':
+                if (regions_read_bed(&regions, optarg) == -1) {
+                    fprintf(stderr, "Error: Unable to read bed file %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                    }
+                break;
+
+            case 't':
+                errno = 0;
+                val = strtol(optarg, &endptr, 10);
+                if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg) || val < 1 || val > 1024) {
+                    fprintf(stderr, "Error: Invalid --threads\n");
+                    exit(EXIT_FAILURE);
+                    }
+                threads_len = val;
+                break;
+
+            case 'O':
+                errno = 0;
+                val = strtol(optarg, &endptr, 10);
+                if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg) || val < 1 || val > 1024) {
+                    fprintf(stderr, "Error: Invalid --output-shards\n");
+                    exit(EXIT_FAILURE);
+                    }
+                output_shards = val;
+                break;
+
+            case 'M':
+                errno = 0;
+                val = strtol(optarg, &endptr, 10);
+                if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg) || val < 1) {
+                    fprintf(stderr, "Error: Invalid --max-memory\n");
+                    exit(EXIT_FAILURE);
+                    }
+                options.max_memory = (size_t)val * 1024 * 1024;
+                break;
+
+            case 'p':
+                if (strcmp(optarg, "disable") == 0) {
+                    options.optical_duplicate_distance = -1;
+                    }
+                else {
+                    errno = 0;
+                    val = strtol(optarg, &endptr, 10);
+                    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == optarg) || val < 0 || val > INT_MAX - 1) {
+                        fprintf(stderr, "Error: Invalid --optical-duplicate-distance\n");
+                        exit(EXIT_FAILURE);
+                        }
+                    options.optical_duplicate_distance = (int)val + 1;
+                    }
+                break;
+
+            case 'u':
+                if (strcmp(optarg, "thruplex") != 0 && strcmp(optarg, "thruplex_hv") != 0 && strcmp(optarg, "prism") != 0 && strcmp(optarg, "") != 0) {
+                    fprintf(stderr, "Error: Unsupported umi type: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                    }
+                options.umi = optarg;
+                break;
+
+            case '?':
+                // unknown option, getopt_long already printed an error message.
+                exit(EXIT_FAILURE);
+            }
+        }
+
+    // Marked duplicates are written as the input sam was, consensus as fastq
+    if (output_filename != NULL && strcmp(output_filename, "-") != 0 && !endswith(output_filename, options.mark_duplicates ? ".sam" : ".fastq")) {
+        fprintf(stderr, "Error: Output file must be of type %s\n", options.mark_duplicates ? "sam" : "fastq");
+        exit(EXIT_FAILURE);
+        }
+    
+    // Regions are found with an index of a position sorted sam
+    if (regions.len > 0 && options.collated) {
+        fprintf(stderr, "Error: --region and --targets cannot be used with --collated\n");
+        exit(EXIT_FAILURE);
+        }
+    regions_sort(&regions);
+    
+    // Without a mapping the sam is only readable as it is fed
+    if (pread_input && (regions.len > 0 || (options.print_family_members != NULL && family_index_filename != NULL))) {
+        fprintf(stderr, "Error: --no-mmap cannot be used with --region, --targets or reading a --family-index\n");
+        exit(EXIT_FAILURE);
+        }
+    
+    // Only stats are written, consensus is never built
+    if (options.stats_only && (output_filename != NULL || options.print_family_members != NULL)) {
+        fprintf(stderr, "Error: --stats-only cannot be used with --output or --print-family-members\n");
+        exit(EXIT_FAILURE);
+        }
+    if (options.mark_duplicates && (options.stats_only || options.print_family_members != NULL)) {
+        fprintf(stderr, "Error: --mark-duplicates cannot be used with --stats-only or --print-family-members\n");
+        exit(EXIT_FAILURE);
+        }
+    
+    // Each shard is a named file of consensus pairs
+    if (output_shards > 0 && (options.stats_only || options.mark_duplicates || options.print_family_members != NULL ||
+                              (manifest_filename == NULL && (output_filename == NULL || strcmp(output_filename, "-") == 0)))) {
+        fprintf(stderr, "Error: --output-shards requires --output or --manifest and cannot be used with --stats-only, --mark-duplicates or --print-family-members\n");
+        exit(EXIT_FAILURE);
+        }
+
+    if (manifest_filename != NULL) {
+        // Every sample has its own output and stats, progress and profiles would be interleaved. --stats
+        // instead names the combined stats of every sample.
+        if (argc - optind != 0 || output_filename != NULL) {
+            fprintf(stderr, "Error: Input, output and stats files are given by the manifest\n");
+            exit(EXIT_FAILURE);
+            }
+        if (options.print_family_members != NULL || options.progress_interval > 0 || options.heartbeat_filename != NULL || family_index_filename != NULL) {
+            fprintf(stderr, "Error: --manifest cannot be combined with --print-family-members, --progress, --heartbeat or --family-index\n");
+            exit(EXIT_FAILURE);
+            }
+#ifdef ELDUDERINO_PROFILE
+        if (profile.enabled && threads_len != 1) {
+            fprintf(stderr, "Error: --profile with --manifest requires --threads 1\n");
+            exit(EXIT_FAILURE);
+            }
+#endif
+        
+        manifest.options = &options;
+        read_manifest(manifest_filename, &manifest);
+        for (i = 0; i < manifest.len; ++i) {
+            manifest.samples[i].pread_input = pread_input;
+            manifest.samples[i].output_shards = output_shards;
+            }
+        manifest.regions = &regions;
+        pthread_mutex_init(&manifest.lock, NULL);
+        
+        if (threads_len == 0) {
+            threads_len = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        if (threads_len > (long)manifest.len) {
+            threads_len = manifest.len;
+            }
+        if (threads_len < 1) {
+            threads_len = 1;
+            }
+        if ((threads = malloc(threads_len * sizeof(pthread_t))) == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory for threads\n");
+            exit(EXIT_FAILURE);
+            }
+        for (i = 0; i < threads_len; ++i) {
+            if (pthread_create(threads + i, NULL, manifest_worker, &manifest) != 0) {
+                fprintf(stderr, "Error: Unable to start thread\n");
+                exit(EXIT_FAILURE);
+                }
+            }
+        for (i = 0; i < threads_len; ++i) {
+            pthread_join(threads[i], (void **)&shard);
+            if (shard == NULL || stats_merge(&merged, shard) == -1) {
+                merge_failed = true;
+                }
+            if (shard != NULL) {
+                stats_destroy(shard);
+                free(shard);
+                }
+            }
+        
+        // Samples are independent, a failure is reported without affecting any other sample
+        for (i = 0; i < manifest.len; ++i) {
+            if (manifest.samples[i].error_message[0] != '\0') {
+                fprintf(stderr, "Error: %s: %s\n", manifest.samples[i].input_filenames[0], manifest.samples[i].error_message);
+                failed = true;
+                }
+            free(manifest.samples[i].input_filenames[0]);
+            free(manifest.samples[i].input_filenames);
+            free(manifest.samples[i].output_filename);
+            free(manifest.samples[i].stats_filename);
+            }
+        if (stats_filename != NULL) {
+            if (merge_failed) {
+                fprintf(stderr, "Error: Unable to allocate memory for statistics\n");
+                failed = true;
+                }
+            else if (stats_write(&merged, stats_filename) == -1) {
+                fprintf(stderr, "Error: Unable to write %s, it must be absent, empty or contain a single json object\n", stats_filename);
+                failed = true;
+                }
+            }
+        stats_destroy(&merged);
+        pthread_mutex_destroy(&manifest.lock);
+        free(manifest.samples);
+        free(threads);
+        regions_destroy(&regions);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+    if (argc - optind < 1) {
+        fprintf(stderr, "Error: No input file supplied\n");
+        exit(EXIT_FAILURE);
+        }
+    sample.input_filenames = argv + optind;
+    sample.inputs_len = argc - optind;
+    for (i = 0; i < (long)sample.inputs_len; ++i) {
+        if (!endswith(sample.input_filenames[i], ".sam")) {
+            fprintf(stderr, "Error: Input file must be of type sam\n");
+            exit(EXIT_FAILURE);
+            }
+        }
+    
+    // Several inputs are only ever read in merged position order
+    if (sample.inputs_len > 1 && (regions.len > 0 || options.collated || family_index_filename != NULL)) {
+        fprintf(stderr, "Error: Multiple input files cannot be used with --region, --targets, --collated or --family-index\n");
+        exit(EXIT_FAILURE);
+        }
+    sample.output_filename = (char *)output_filename;
+    sample.stats_filename = (char *)(stats_filename != NULL ? stats_filename : "stats.json");
+    sample.family_index_filename = (char *)family_index_filename;
+    sample.pread_input = pread_input;
+    sample.output_shards = output_shards;
+    
+    if (run_sample(&options, &regions, &sample, NULL) == -1) {
+        fprintf(stderr, "Error: %s\n", sample.error_message);
+        exit(EXIT_FAILURE);
+        }
+    regions_destroy(&regions);
+    }
+
+
+
+int run_sample(const DedupeOptions *sample_options, Regions *regions, Sample *sample, Stats *merged) {
+    // Dedupes one sam file, or several merged by position, or only the regions if any, into its own
+    // output and stats, returns -1 with error_message set on failure. The stats are also added to
+    // merged if it is set.
+    DedupeOptions options = *sample_options;
+    Dedupe *dd = NULL;
+    int ret = -1;
+    size_t sam_len = 0, error_len = sizeof(sample->error_message), spans_len = 0, i = 0;
+    SamInput **inputs = NULL;
+    SamMerge *merge = NULL;
+    MergeCursor *first = NULL;
+    RecordSpan *spans = NULL;
+    ShardedOutput *shards = NULL;
+    
+    if (open_inputs(sample, &inputs, &sam_len) == -1) {
+        // error_message set by open_inputs
+        }
+    else if (regions->len > 0 && select_regions(sample, inputs[0], regions, &spans, &spans_len) == -1) {
+        // error_message set by select_regions
+        }
+    else if (regions->len > 0 && spans_len == 0) {
+        snprintf(sample->error_message, error_len, "No records within the requested regions");
+        }
+    else if (sample->inputs_len > 1 && (merge = merge_new(inputs, sample->inputs_len)) == NULL) {
+        snprintf(sample->error_message, error_len, "Unable to allocate memory to merge inputs");
+        }
+    else if (merge != NULL && merge_start(merge) == -1) {
+        snprintf(sample->error_message, error_len, "%s: %s", sample->input_filenames[merge->failed], merge->error);
+        }
+    else if (sample->output_shards > 0 && (shards = shards_open(sample->output_filename, sample->output_shards)) == NULL) {
+        snprintf(sample->error_message, error_len, "Unable to open %zu output shards of %s for writing", sample->output_shards, sample->output_filename);
+        }
+    else if (!options.stats_only && shards == NULL && sample->output_filename != NULL && strcmp(sample->output_filename, "-") != 0 &&
+             (options.output_file = fopen(sample->output_filename, "w")) == NULL) {
+        snprintf(sample->error_message, error_len, "Unable to open %s for writing", sample->output_filename);
+        }
+    else {
+        if (options.output_file == NULL) {
+            options.output_file = stdout;
+            }
+        if (shards != NULL) {
+            options.output = shards_write;
+            options.output_context = shards;
+            }
+        options.input_size = sam_len;
+        if (regions->len > 0) {
+            for (options.input_size = 0, i = 0; i < spans_len; ++i) {
+                options.input_size += spans[i].len;
+                }
+            // The first fed buffer may hold only a few records, so the guess is made from the sam itself
+            if (options.optical_duplicate_distance == 0) {
+                options.optical_duplicate_distance = guess_optical_distance(inputs[0]->sam + spans[0].offset, inputs[0]->sam + sam_len);
+                options.optical_duplicate_distance = options.optical_duplicate_distance ? options.optical_duplicate_distance : -1;
+                }
+            }
+        // Likewise a merged run may begin with a single record, the guess is made from the first
+        // chunk of the input it is taken from as it would be were that input the only one
+        if (merge != NULL && merge->heap_len > 0 && options.optical_duplicate_distance == 0) {
+            first = merge->cursors + merge->heap[0];
+            options.optical_duplicate_distance = guess_optical_distance(first->record, first->chunk_end);
+            options.optical_duplicate_distance = options.optical_duplicate_distance ? options.optical_duplicate_distance : -1;
+            }
+        
+        // The inputs stay valid until the context is destroyed, except for chunks that are no longer
+        // referenced which feed_input or feed_merged releases
+        if (options.print_family_members != NULL && sample->family_index_filename != NULL) {
+            ret = lookup_family(sample, options.print_family_members, inputs[0]->sam, sam_len, options.output_file);
+            }
+        else if (sample->family_index_filename != NULL &&
+                 (options.family_index = family_index_new(sample->family_index_filename, inputs[0]->sam, sam_len, options.max_memory / 4)) == NULL) {
+            snprintf(sample->error_message, error_len, "Unable to open %s for writing", sample->family_index_filename);
+            }
+        else if ((dd = dedupe_new(&options)) == NULL) {
+            snprintf(sample->error_message, error_len, "%s", dedupe_error_message(NULL));
+            }
+        else if (regions->len > 0 && feed_spans(dd, inputs[0]->sam, spans, spans_len) == -1) {
+            snprintf(sample->error_message, error_len, "%s", dedupe_error_message(dd));
+            }
+        else if (merge != NULL && feed_merged(sample, dd, merge) == -1) {
+            // error_message set by feed_merged
+            }
+        else if (regions->len == 0 && merge == NULL && feed_input(sample, dd, inputs[0]) == -1) {
+            // error_message set by feed_input
+            }
+        else if (!dd->started) {
+            snprintf(sample->error_message, error_len, "Empty sam file");
+            }
+        else if (dedupe_flush(dd) == -1) {
+            snprintf(sample->error_message, error_len, "%s", dedupe_error_message(dd));
+            }
+        else if (dd->done) {
+            // --print-family-members found its family, nothing else is written
+            ret = 0;
+            }
+        else if (options.family_index != NULL && family_index_finish(options.family_index) == -1) {
+            snprintf(sample->error_message, error_len, "Unable to write family index %s", sample->family_index_filename);
+            }
+        else if (dedupe_write_stats(dd, sample->stats_filename) == -1) {
+            snprintf(sample->error_message, error_len, "%s", dedupe_error_message(dd));
+            }
+        else if (merged != NULL && stats_merge(merged, &dd->stats) == -1) {
+            snprintf(sample->error_message, error_len, "Unable to allocate memory for statistics");
+            }
+        else {
+            ret = 0;
+            }
+        }
+    
+    dedupe_destroy(dd);
+    family_index_destroy(options.family_index);
+    free(spans);
+    if (options.output_file != NULL && options.output_file != stdout) {
+        fclose(options.output_file);
+        }
+    if (shards_close(shards) == -1 && ret == 0) {
+        snprintf(sample->error_message, error_len, "Unable to write output shards of %s", sample->output_filename);
+        ret = -1;
+        }
+    merge_destroy(merge);
+    close_inputs(inputs, sample->inputs_len);
+    return ret;
+    }
+
+
+
+int open_inputs(Sample *sample, SamInput ***inputs, size_t *total_len) {
+    // Opens every input sam, returns -1 with error_message set on failure. Those that were opened
+    // are closed by close_inputs.
+    size_t error_len = sizeof(sample->error_message), sam_len = 0, i = 0;
+    int sam_fd = -1;
+    
+    if ((*inputs = calloc(sample->inputs_len, sizeof(SamInput *))) == NULL) {
+        snprintf(sample->error_message, error_len, "Unable to allocate memory for inputs");
+        return -1;
+        }
+    for (*total_len = 0, i = 0; i < sample->inputs_len; ++i) {
+        if ((sam_fd = open(sample->input_filenames[i], O_RDONLY)) == -1) {
+            snprintf(sample->error_message, error_len, "Unable to open %s", sample->input_filenames[i]);
+            return -1;
+            }
+        if ((sam_len = (size_t)lseek(sam_fd, 0, SEEK_END)) == 0) {
+            snprintf(sample->error_message, error_len, sample->inputs_len > 1 ? "Empty sam file %s" : "Empty sam file", sample->input_filenames[i]);
+            close(sam_fd);
+            return -1;
+            }
+        if (((*inputs)[i] = input_new(sam_fd, sam_len, !sample->pread_input)) == NULL) {
+            snprintf(sample->error_message, error_len, sample->pread_input ? "Unable to reserve memory for sam file" : "Unable to memory map sam file");
+            close(sam_fd);
+            return -1;
+            }
+        *total_len += sam_len;
+        }
+    return 0;
+    }
+
+
+
+void close_inputs(SamInput **inputs, size_t len) {
+    size_t i = 0;
+    
+    if (inputs == NULL) {
+        return;
+        }
+    for (i = 0; i < len && inputs[i] != NULL; ++i) {
+        close(inputs[i]->fd);
+        input_destroy(inputs[i]);
+        }
+    free(inputs);
+    }
+
+
+
+int select_regions(Sample *sample, SamInput *input, Regions *regions, RecordSpan **spans, size_t *spans_len) {
+    // Finds the records of the regions using the sidecar index, which is built and saved alongside
+    // the sam if missing or stale
+    SamIndex *index = NULL;
+    struct stat sam_stat;
+    char *index_filename = NULL;
+    size_t error_len = sizeof(sample->error_message);
+    int ret = 0;
+    
+    if (fstat(input->fd, &sam_stat) == -1) {
+        snprintf(sample->error_message, error_len, "Unable to stat %s", sample->input_filenames[0]);
+        return -1;
+        }
+    if ((index_filename = malloc(strlen(sample->input_filenames[0]) + 6)) == NULL) {
+        snprintf(sample->error_message, error_len, "Unable to allocate memory for index filename");
+        return -1;
+        }
+    sprintf(index_filename, "%s.eidx", sample->input_filenames[0]);
+    
+    if ((index = sam_index_read(index_filename, input->len, &sam_stat)) == NULL) {
+        if ((index = sam_index_build(input->sam, input->len, &sam_stat)) == NULL) {
+            snprintf(sample->error_message, error_len, "Unable to index %s, it must be sorted by position", sample->input_filenames[0]);
+            free(index_filename);
+            return -1;
+            }
+        if (sam_index_write(index, index_filename) == -1) {
+            fprintf(stderr, "elduderino: Unable to write index %s\n", index_filename);
+            }
+        }
+    
+    if (region_records(input->sam, input->len, index, regions, spans, spans_len) == -1) {
+        snprintf(sample->error_message, error_len, "Unable to read regions of %s", sample->input_filenames[0]);
+        ret = -1;
+        }
+    sam_index_destroy(index);
+    free(index_filename);
+    return ret;
+    }
+
+
+
+int feed_input(Sample *sample, Dedupe *dd, SamInput *input) {
+    // Feeds the whole sam a chunk at a time, after each chunk releasing those behind it that no
+    // record still waiting to be deduped lies within
+    const char *records = NULL;
+    size_t len = 0;
+    int ret = 0;
+    
+    while (!dd->done && (ret = input_next(input, &records, &len)) == 1) {
+        if (dedupe_feed(dd, records, len) == -1) {
+            snprintf(sample->error_message, sizeof(sample->error_message), "%s", dedupe_error_message(dd));
+            return -1;
+            }
+        dedupe_references(dd, input_reference, input);
+        input_release(input);
+        }
+    if (ret == -1) {
+        snprintf(sample->error_message, sizeof(sample->error_message), "Unable to read %s", sample->input_filenames[0]);
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+int feed_merged(Sample *sample, Dedupe *dd, SamMerge *merge) {
+    // Feeds the inputs merged by position, the runs of records of single inputs that a merge returns
+    // being fed together. As feed_input does, each input is released once the records of its chunk
+    // have all been fed and before its next chunk is read.
+    RecordRun runs[MERGE_RUNS];
+    size_t runs_len = 0;
+    int ret = 1;
+    
+    // The header of the first input comes first, as it would in a single sam
+    runs[0].records = merge->header;
+    runs[0].len = merge->header_len;
+    runs[0].source = 0;
+    runs_len = merge->header_len > 0;
+    while (!dd->done && ret == 1) {
+        do {
+            if ((ret = merge_next(merge, &runs[runs_len].records, &runs[runs_len].len, &runs[runs_len].source)) == 1) {
+                ++runs_len;
+                }
+            } while (ret == 1 && runs_len < MERGE_RUNS && merge->drained == NULL);
+        if (ret == -1) {
+            snprintf(sample->error_message, sizeof(sample->error_message), "%s: %s", sample->input_filenames[merge->failed], merge->error);
+            return -1;
+            }
+        if (dedupe_feed_runs(dd, runs, runs_len) == -1) {
+            snprintf(sample->error_message, sizeof(sample->error_message), "%s", dedupe_error_message(dd));
+            return -1;
+            }
+        if (merge->drained != NULL) {
+            dedupe_references(dd, input_reference, merge->drained);
+            input_release(merge->drained);
+            }
+        runs_len = 0;
+        }
+    return 0;
+    }
+
+
+
+int feed_spans(Dedupe *dd, const char *sam, RecordSpan *spans, size_t spans_len) {
+    // Feeds the records, coalescing those that are adjacent within the sam. The header comes first so
+    // that they read as a sam of their own.
+    size_t i = 0, start = 0, end = 0;
+    const char *line_end = NULL;
+    
+    while (end < spans[0].offset && sam[end] == '@' && (line_end = memchr(sam + end, '\n', spans[0].offset - end)) != NULL) {
+        end = line_end + 1 - sam;
+        }
+    if (end > 0 && dedupe_feed(dd, sam, end) == -1) {
+        return -1;
+        }
+    
+    while (i < spans_len) {
+        start = spans[i].offset;
+        end = spans[i].offset + spans[i].len;
+        for (++i; i < spans_len && spans[i].offset == end; ++i) {
+            end += spans[i].len;
+            }
+        if (dedupe_feed(dd, sam + start, end - start) == -1) {
+            return -1;
+            }
+        }
+    return 0;
+    }
+
+
+
+int lookup_family(Sample *sample, const char *qname, const char *sam, size_t sam_len, FILE *output_file) {
+    // Prints the family of qname using an index written by a previous run rather than deduping the sam
+    size_t error_len = sizeof(sample->error_message);
+    
+    switch (family_index_lookup(sample->family_index_filename, sam, sam_len, qname, output_file)) {
+        case 1:
+            return 0;
+        
+        case 0:
+            snprintf(sample->error_message, error_len, "No family of %s in %s", qname, sample->family_index_filename);
+            return -1;
+        
+        default:
+            snprintf(sample->error_message, error_len, "Unable to read family index %s, it must be written by a run of this sam", sample->family_index_filename);
+            return -1;
+        }
+    }
+
+
+
+void *manifest_worker(void *arg) {
+    // Claims and runs samples until none remain, returns the stats of its samples for the caller to
+    // merge and free or NULL if they could not be allocated
+    Manifest *manifest = arg;
+    Stats *shard = calloc(1, sizeof(Stats));
+    size_t i = 0;
+    
+    while (true) {
+        pthread_mutex_lock(&manifest->lock);
+        i = manifest->next++;
+        pthread_mutex_unlock(&manifest->lock);
+        if (i >= manifest->len) {
+            break;
+            }
+        run_sample(manifest->options, manifest->regions, manifest->samples + i, shard);
+        }
+    return shard;
+    }
+
+
+
+void read_manifest(const char *manifest_filename, Manifest *manifest) {
+    /*
+     * One sample per line, the input sam optionally followed by the output fastq and stats json
+     * separated by whitespace. These default to the input with .sam replaced by .fastq and
+     * .stats.json. Output of --mark-duplicates is instead a sam that defaults to .marked.sam. Blank
+     * lines and lines beginning with # are ignored.
+     */
+    FILE *fp = NULL;
+    char *line = NULL, *field[4] = {NULL}, *saveptr = NULL;
+    size_t line_len = 0, max_len = 0, line_number = 0;
+    int n = 0;
+    Sample *sample = NULL;
+    const char *output_suffix = manifest->options->mark_duplicates ? ".sam" : ".fastq";
+    
+    if ((fp = fopen(manifest_filename, "r")) == NULL) {
+        fprintf(stderr, "Error: Unable to open %s\n", manifest_filename);
+        exit(EXIT_FAILURE);
+        }
+    
+    while (getline(&line, &line_len, fp) != -1) {
+        ++line_number;
+        for (n = 0; n < 4; ++n) {
+            field[n] = strtok_r(n ? NULL : line, " \t\r\n", &saveptr);
+            if (field[n] == NULL) {
+                break;
+                }
+            }
+        if (n == 0 || field[0][0] == '#') {
+            continue;
+            }
+        if (n > 3 || !endswith(field[0], ".sam") || (n > 1 && !endswith(field[1], output_suffix)) || (n > 2 && !endswith(field[2], ".json"))) {
+            fprintf(stderr, "Error: Invalid line %zu of manifest %s\n", line_number, manifest_filename);
+            exit(EXIT_FAILURE);
+            }
+        
+        if (manifest->len == max_len) {
+            max_len = max_len ? max_len * 2 : 64;
+            if ((manifest->samples = realloc(manifest->samples, max_len * sizeof(Sample))) == NULL) {
+                fprintf(stderr, "Error: Unable to allocate memory for manifest\n");
+                exit(EXIT_FAILURE);
+                }
+            }
+        sample = manifest->samples + manifest->len++;
+        memset(sample, 0, sizeof(Sample));
+        sample->inputs_len = 1;
+        if ((sample->input_filenames = malloc(sizeof(char *))) != NULL) {
+            sample->input_filenames[0] = strdup(field[0]);
+            }
+        sample->output_filename = n > 1 ? strdup(field[1]) : replace_suffix(field[0], ".sam", manifest->options->mark_duplicates ? ".marked.sam" : ".fastq");
+        sample->stats_filename = n > 2 ? strdup(field[2]) : replace_suffix(field[0], ".sam", ".stats.json");
+        if (sample->input_filenames == NULL || sample->input_filenames[0] == NULL || sample->output_filename == NULL || sample->stats_filename == NULL) {
+            fprintf(stderr, "Error: Unable to allocate memory for manifest\n");
+            exit(EXIT_FAILURE);
+            }
+        }
+    free(line);
+    fclose(fp);
+    
+    if (manifest->len == 0) {
+        fprintf(stderr, "Error: Empty manifest\n");
+        exit(EXIT_FAILURE);
+        }
+    }
+
+
+
+char *replace_suffix(const char *filename, const char *suffix, const char *replacement) {
+    // Returns a newly allocated copy of filename, which ends with suffix, ending instead with replacement
+    size_t len = strlen(filename) - strlen(suffix);
+    char *replaced = NULL;
+    
+    if ((replaced = malloc(len + strlen(replacement) + 1)) != NULL) {
+        memcpy(replaced, filename, len);
+        strcpy(replaced + len, replacement);
+        }
+    return replaced;
+    }
+
+
+
+bool endswith(const char *text, const char *suffix) {
+    int offset = strlen(text) - strlen(suffix);
+    return (offset >= 0 && strcmp(text + offset, suffix) == 0);
+    }
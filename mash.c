@@ -5,11 +5,11 @@
 #include <stdio.h>
 
 #include "mash.h"
+#include "profile.h"
 
 
 
 // static uint32_t perl_hash(const void *key, size_t length);
-static uint32_t fnv1a_hash(const void *key, size_t length);
 static int resize_buckets(MashTable *mt, uint32_t size);
 static int resize_entries(MashTable *mt, uint32_t size);
 static int resize_keys(MashTable *mt, size_t max_key_len);
@@ -17,20 +17,6 @@ static int resize_data(MashTable *mt, size_t max_data_len);
 
 
 
-static uint32_t fnv1a_hash(const void *key, size_t length) {
-    register size_t i = 0;
-    register uint32_t hash = 2166136261;
-    register const uint32_t fnv_prime = 16777619;
-    
-    for (i = 0; i < length; ++i) {
-        hash = (hash ^ ((unsigned char *)key)[i]) * fnv_prime;
-        }
-    
-    return hash;
-    }
-
-
-
 // static uint32_t perl_hash(const void *key, size_t length) {
 //     register size_t i = length;
 //     register uint32_t hash = 0;
@@ -58,7 +44,7 @@ MashTable *mash_new(uint32_t size) {
         }
     
     mt->bucket_resize = 0.7;
-    mt->hash_function = &fnv1a_hash;
+    mt->hash_function = DEFAULT_HASH_FUNCTION;
     
     if (resize_buckets(mt, size) == -1 || resize_entries(mt, mt->len_buckets) == -1) {
         mash_destroy(mt);
@@ -80,6 +66,13 @@ void mash_destroy(MashTable *mt) {
 
 
 
+size_t mash_memory(MashTable *mt) {
+    return (mt->len_buckets * sizeof(uint32_t)) + 
+           (mt->len_entries * (sizeof(MashEntry) + sizeof(uint32_t) + mt->max_key_len + mt->max_data_len));
+    }
+
+
+
 void mash_summary_fprintf(MashTable *mt, FILE *fp) {
     fprintf(fp, "%li / %li Buckets\n", (long)mt->buckets_occupied, (long)mt->len_buckets);
     fprintf(fp, "%li / %li Entries\n", (long)mt->entries_occupied, (long)mt->len_entries);
@@ -138,7 +131,7 @@ int mash_put(MashTable *mt, const void *key, size_t key_size, const void *data,
             }
         }
     
-    bucket = mt->hash_function(key, key_size) & (mt->len_buckets - 1);
+    bucket = mt->hash_function(key, key_size, mt->seed) & (mt->len_buckets - 1);
     if (mt->buckets[bucket] == UINT32_MAX) {
         ++mt->buckets_occupied;
         }
@@ -158,18 +151,26 @@ int mash_put(MashTable *mt, const void *key, size_t key_size, const void *data,
 
 void *mash_get(MashTable *mt, const void *key, size_t key_size, size_t *data_size) {
     uint32_t i = 0, bucket = 0;
+#ifdef ELDUDERINO_PROFILE
+    uint32_t probes = 0;
+#endif
     MashEntry *entry = NULL;
     
-    bucket = mt->hash_function(key, key_size) & (mt->len_buckets - 1);
+    bucket = mt->hash_function(key, key_size, mt->seed) & (mt->len_buckets - 1);
     i = mt->buckets[bucket];
     while (i != UINT32_MAX) {
         entry = mt->entries + i;
+#ifdef ELDUDERINO_PROFILE
+        ++probes;
+#endif
         if (key_size == entry->key_size && memcmp(key, mt->keys + (i * mt->max_key_len), key_size) == 0) {
             *data_size = entry->data_size;
+            PROFILE_PROBES(mash_probes, probes);
             return mt->data + (i * mt->max_data_len);
             }
         i = entry->next;
         }
+    PROFILE_PROBES(mash_probes, probes);
     return NULL;
     }
 
@@ -177,12 +178,18 @@ void *mash_get(MashTable *mt, const void *key, size_t key_size, size_t *data_siz
 
 void *mash_pop(MashTable *mt, const void *key, size_t key_size, size_t *data_size) {
     uint32_t i = 0, bucket = 0;
+#ifdef ELDUDERINO_PROFILE
+    uint32_t probes = 0;
+#endif
     MashEntry *entry = NULL, *previous = NULL;
     
-    bucket = mt->hash_function(key, key_size) & (mt->len_buckets - 1);
+    bucket = mt->hash_function(key, key_size, mt->seed) & (mt->len_buckets - 1);
     i = mt->buckets[bucket];
     while (i != UINT32_MAX) {
         entry = mt->entries + i;
+#ifdef ELDUDERINO_PROFILE
+        ++probes;
+#endif
         if (key_size == entry->key_size && memcmp(key, mt->keys + (i * mt->max_key_len), key_size) == 0) {
             if (previous == NULL) {
                 if ((mt->buckets[bucket] = entry->next) == UINT32_MAX) {
@@ -196,12 +203,14 @@ void *mash_pop(MashTable *mt, const void *key, size_t key_size, size_t *data_siz
             mt->available_entries[--mt->entries_occupied] = i;
             entry->key_size = 0;
             *data_size = entry->data_size;
+            PROFILE_PROBES(mash_probes, probes);
             return mt->data + (i * mt->max_data_len);
             }
         
         previous = entry;
         i = entry->next;
         }
+    PROFILE_PROBES(mash_probes, probes);
     return NULL;
     }
 
@@ -269,7 +278,7 @@ static int resize_buckets(MashTable *mt, uint32_t size) {
         for (i = 0; i < mt->len_entries; ++i) {
             entry = mt->entries + i;
             if (entry->key_size != 0) {
-                bucket = mt->hash_function(mt->keys + (i * mt->max_key_len), entry->key_size) & (mt->len_buckets - 1);
+                bucket = mt->hash_function(mt->keys + (i * mt->max_key_len), entry->key_size, mt->seed) & (mt->len_buckets - 1);
                 if (mt->buckets[bucket] == UINT32_MAX) {
                     ++mt->buckets_occupied;
                     }
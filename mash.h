@@ -6,10 +6,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 
-#ifndef _HASH_FUNCTION_T
-#define _HASH_FUNCTION_T
-typedef uint32_t (*hash_function_t)(const void *key, size_t length);
-#endif
+#include "hashfunc.h"
 
 
 typedef struct mashentry_t {
@@ -32,7 +29,8 @@ typedef struct mashtable_t {
     void *data;
     size_t max_data_len;
     float bucket_resize;
-    hash_function_t hash_function;
+    hash_function_t hash_function; // these two may only be changed while the table is empty
+    uint64_t seed;
     } MashTable;
 
 
@@ -42,6 +40,7 @@ void mash_destroy(MashTable *ht);
 int mash_put(MashTable *ht, const void *key, size_t key_size, const void *data, size_t data_size);
 void *mash_get(MashTable *ht, const void *key, size_t key_size, size_t *data_size);
 void *mash_pop(MashTable *ht, const void *key, size_t key_size, size_t *data_size);
+size_t mash_memory(MashTable *mt);
 void mash_summary_fprintf(MashTable *ht, FILE *fp);
 void mash_contents_fprintf(MashTable *ht, FILE *fp);
 void *mash_popall(MashTable *mt, const void **key, size_t *key_size, size_t *data_size, uint32_t *bucket);
@@ -0,0 +1,337 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "merge.h"
+
+
+static int refill(SamMerge *m, size_t i);
+static int read_header(SamMerge *m, size_t i);
+static int add_contig(SamMerge *m, const char *name, size_t len);
+static const char *next_field(const char *field, const char *end);
+static int read_key(SamMerge *m, size_t i);
+static bool key_less(const SamMerge *m, size_t a, size_t b);
+static void sift_down(SamMerge *m, size_t slot);
+
+
+
+SamMerge *merge_new(SamInput **inputs, size_t len) {
+    // Every input stays valid until the merge is destroyed
+    SamMerge *m = NULL;
+    size_t i = 0;
+
+    if ((m = (SamMerge *)calloc(1, sizeof(SamMerge))) == NULL) {
+        return NULL;
+        }
+    if ((m->cursors = calloc(len, sizeof(MergeCursor))) == NULL || (m->heap = calloc(len, sizeof(size_t))) == NULL) {
+        merge_destroy(m);
+        return NULL;
+        }
+    m->len = len;
+    for (i = 0; i < len; ++i) {
+        m->cursors[i].input = inputs[i];
+        }
+    return m;
+    }
+
+
+
+static int refill(SamMerge *m, size_t i) {
+    // Moves the cursor to the next chunk of its input, returns 0 if there are none or -1 on a read error
+    MergeCursor *c = m->cursors + i;
+    size_t len = 0;
+    int ret = 0;
+
+    if ((ret = input_next(c->input, &c->record, &len)) == 1) {
+        c->chunk_end = c->record + len;
+        }
+    else if (ret == -1) {
+        m->failed = i;
+        m->error = "Unable to read input";
+        }
+    return ret;
+    }
+
+
+
+static int read_header(SamMerge *m, size_t i) {
+    /*
+     * Moves the cursor past the header lines. The @SQ lines of the first input name the contigs, those
+     * of every other input must be the same. Returns 1 if a record follows, 0 if there are none or -1
+     * on failure.
+     */
+    MergeCursor *c = m->cursors + i;
+    const char *line_end = NULL, *field = NULL, *name_end = NULL;
+    size_t contigs_len = 0;
+    int ret = 0;
+
+    if ((ret = refill(m, i)) != 1) {
+        return ret;
+        }
+    if (i == 0) {
+        m->header = c->record;
+        }
+    while (c->record < c->chunk_end || (ret = refill(m, i)) == 1) {
+        if (*c->record != '@') {
+            break;
+            }
+        if ((line_end = memchr(c->record, '\n', c->chunk_end - c->record)) == NULL) {
+            line_end = c->chunk_end;
+            }
+        if (line_end - c->record > 4 && memcmp(c->record, "@SQ\t", 4) == 0) {
+            for (field = c->record + 4; field != NULL && (line_end - field < 3 || memcmp(field, "SN:", 3) != 0); field = next_field(field, line_end));
+            if (field == NULL) {
+                m->failed = i;
+                m->error = "@SQ header line without a name";
+                return -1;
+                }
+            field += 3;
+            if ((name_end = memchr(field, '\t', line_end - field)) == NULL) {
+                name_end = line_end;
+                }
+            if (i == 0 && add_contig(m, field, name_end - field) == -1) {
+                m->failed = i;
+                m->error = "Unable to allocate memory for contigs";
+                return -1;
+                }
+            if (i > 0 && (contigs_len >= m->contigs_len || m->contigs[contigs_len].len != (size_t)(name_end - field) ||
+                          memcmp(m->contigs[contigs_len].name, field, name_end - field) != 0)) {
+                m->failed = i;
+                m->error = "@SQ header lines differ from those of the first input";
+                return -1;
+                }
+            ++contigs_len;
+            }
+        c->record = line_end < c->chunk_end ? line_end + 1 : line_end;
+        }
+    if (ret == -1) {
+        return -1;
+        }
+
+    if (m->contigs_len == 0) {
+        m->failed = i;
+        m->error = "No @SQ header lines, contigs cannot be ordered";
+        return -1;
+        }
+    if (contigs_len != m->contigs_len) {
+        m->failed = i;
+        m->error = "@SQ header lines differ from those of the first input";
+        return -1;
+        }
+    if (i == 0) {
+        m->header_len = c->record - m->header;
+        }
+    return ret;
+    }
+
+
+
+static int add_contig(SamMerge *m, const char *name, size_t len) {
+    // The header may be released, the name is copied
+    void *ptr = NULL;
+
+    if (m->contigs_len == m->max_contigs_len) {
+        m->max_contigs_len = m->max_contigs_len ? m->max_contigs_len * 2 : 64;
+        if ((ptr = realloc(m->contigs, m->max_contigs_len * sizeof(ContigName))) == NULL) {
+            return -1;
+            }
+        m->contigs = (ContigName *)ptr;
+        }
+    if ((m->contigs[m->contigs_len].name = malloc(len)) == NULL) {
+        return -1;
+        }
+    memcpy(m->contigs[m->contigs_len].name, name, len);
+    m->contigs[m->contigs_len++].len = len;
+    return 0;
+    }
+
+
+
+static const char *next_field(const char *field, const char *end) {
+    // NULL if field is the last before end
+    const char *tab = memchr(field, '\t', end - field);
+    return tab != NULL ? tab + 1 : NULL;
+    }
+
+
+
+static int read_key(SamMerge *m, size_t i) {
+    // Finds the contig and position of the record at the cursor, which must not be before the previous
+    // record of the input. Runs of a contig are long so the contig of the previous record is tried first.
+    MergeCursor *c = m->cursors + i;
+    const char *end = NULL, *rname = NULL, *pos = NULL, *endptr = NULL;
+    size_t rname_len = 0;
+    int32_t contig = c->contig;
+    long val = 0;
+
+    if ((end = memchr(c->record, '\n', c->chunk_end - c->record)) == NULL) {
+        end = c->chunk_end;
+        }
+    if ((rname = next_field(c->record, end)) == NULL || (rname = next_field(rname, end)) == NULL || (pos = next_field(rname, end)) == NULL) {
+        m->failed = i;
+        m->error = "Truncated record";
+        return -1;
+        }
+    rname_len = pos - 1 - rname;
+
+    if (rname_len == 1 && *rname == '*') {
+        contig = UNPLACED_CONTIG;
+        }
+    else if (contig >= (int32_t)m->contigs_len || m->contigs[contig].len != rname_len || memcmp(m->contigs[contig].name, rname, rname_len) != 0) {
+        for (contig = 0; contig < (int32_t)m->contigs_len; ++contig) {
+            if (m->contigs[contig].len == rname_len && memcmp(m->contigs[contig].name, rname, rname_len) == 0) {
+                break;
+                }
+            }
+        if (contig == (int32_t)m->contigs_len) {
+            m->failed = i;
+            m->error = "Record on a contig missing from the @SQ header lines";
+            return -1;
+            }
+        }
+
+    errno = 0;
+    val = strtol(pos, (char **)&endptr, 10);
+    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN)) || (errno != 0 && val == 0) || (endptr == pos) || val < 0 || val > INT32_MAX) {
+        m->failed = i;
+        m->error = "Invalid pos in sam file";
+        return -1;
+        }
+
+    if (contig < c->contig || (contig == c->contig && (int32_t)val < c->pos)) {
+        m->failed = i;
+        m->error = "Sam file must be sorted by position";
+        return -1;
+        }
+    c->contig = contig;
+    c->pos = (int32_t)val;
+    return 0;
+    }
+
+
+
+static bool key_less(const SamMerge *m, size_t a, size_t b) {
+    // Records at the same position are taken from inputs in the order given
+    const MergeCursor *ca = m->cursors + a, *cb = m->cursors + b;
+
+    if (ca->contig != cb->contig) {
+        return ca->contig < cb->contig;
+        }
+    if (ca->pos != cb->pos) {
+        return ca->pos < cb->pos;
+        }
+    return a < b;
+    }
+
+
+
+static void sift_down(SamMerge *m, size_t slot) {
+    size_t cursor = m->heap[slot], child = 0;
+
+    while ((child = 2 * slot + 1) < m->heap_len) {
+        if (child + 1 < m->heap_len && key_less(m, m->heap[child + 1], m->heap[child])) {
+            ++child;
+            }
+        if (!key_less(m, m->heap[child], cursor)) {
+            break;
+            }
+        m->heap[slot] = m->heap[child];
+        slot = child;
+        }
+    m->heap[slot] = cursor;
+    }
+
+
+
+int merge_start(SamMerge *m) {
+    // Reads the headers and the first record of every input, returns -1 with failed and error set on
+    // failure
+    size_t i = 0, slot = 0;
+    int ret = 0;
+
+    for (i = 0; i < m->len; ++i) {
+        if ((ret = read_header(m, i)) == -1 || (ret == 1 && read_key(m, i) == -1)) {
+            return -1;
+            }
+        if (ret == 1) {
+            m->heap[m->heap_len++] = i;
+            }
+        }
+    for (slot = m->heap_len / 2; slot-- > 0;) {
+        sift_down(m, slot);
+        }
+    return 0;
+    }
+
+
+
+int merge_next(SamMerge *m, const char **records, size_t *len, size_t *input) {
+    /*
+     * Returns 1 with the next run of records that are consecutive within one input, whose index is
+     * set in input, 0 once all have been returned or -1 with failed and error set on failure. A run
+     * ends at the first record that another input has one before, or at the end of a chunk in which
+     * case drained is set. All records of drained have then been returned and it may be released
+     * before the next call.
+     */
+    MergeCursor *c = NULL;
+    const char *next = NULL;
+    size_t top = 0, other = SIZE_MAX;
+    int ret = 0;
+
+    // The input of the previous run is still at the top of the heap
+    if (m->drained != NULL) {
+        m->drained = NULL;
+        if ((ret = refill(m, m->heap[0])) == -1 || (ret == 1 && read_key(m, m->heap[0]) == -1)) {
+            return -1;
+            }
+        if (ret == 0) {
+            m->heap[0] = m->heap[--m->heap_len];
+            }
+        }
+    if (m->heap_len == 0) {
+        return 0;
+        }
+    sift_down(m, 0);
+
+    // The least record of every other input is that of a child of the top
+    top = m->heap[0];
+    if (m->heap_len > 1) {
+        other = m->heap_len > 2 && key_less(m, m->heap[2], m->heap[1]) ? m->heap[2] : m->heap[1];
+        }
+    c = m->cursors + top;
+    *records = c->record;
+    do {
+        next = memchr(c->record, '\n', c->chunk_end - c->record);
+        c->record = next != NULL ? next + 1 : c->chunk_end;
+        } while (c->record < c->chunk_end && (ret = read_key(m, top)) == 0 && (other == SIZE_MAX || key_less(m, top, other)));
+    if (ret == -1) {
+        return -1;
+        }
+
+    *len = c->record - *records;
+    *input = top;
+    if (c->record == c->chunk_end) {
+        m->drained = c->input;
+        }
+    return 1;
+    }
+
+
+
+void merge_destroy(SamMerge *m) {
+    size_t i = 0;
+
+    if (m == NULL) {
+        return;
+        }
+    for (i = 0; i < m->contigs_len; ++i) {
+        free(m->contigs[i].name);
+        }
+    free(m->contigs);
+    free(m->cursors);
+    free(m->heap);
+    free(m);
+    }
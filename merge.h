@@ -0,0 +1,55 @@
+#ifndef _MERGE_H
+#define _MERGE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "input.h"
+
+
+#define UNPLACED_CONTIG INT32_MAX // contig of records with an rname of *, sorted after every other
+
+
+// The next record of one input and the key it is merged by
+typedef struct mergecursor_t {
+    SamInput *input;
+    const char *record; // next record to be returned
+    const char *chunk_end; // end of the chunk of input holding record
+    int32_t contig; // index of the rname of record within the @SQ header lines
+    int32_t pos;
+    } MergeCursor;
+
+
+typedef struct contigname_t {
+    char *name;
+    size_t len;
+    } ContigName;
+
+
+// Records of several coordinate sorted sams in the order of a single sorted sam. Contigs are ordered
+// as in the @SQ header lines, which must be the same in every input.
+typedef struct sammerge_t {
+    MergeCursor *cursors;
+    size_t len;
+    size_t *heap; // cursors that are not exhausted, the least key first
+    size_t heap_len;
+    ContigName *contigs;
+    size_t contigs_len;
+    size_t max_contigs_len;
+    const char *header; // of the first input, which lies at a fixed address and so is contiguous
+    size_t header_len;
+    SamInput *drained; // input whose chunk ended with the records last returned, NULL if none
+    size_t failed; // input that caused merge_start or merge_next to fail
+    const char *error; // why
+    } SamMerge;
+
+
+
+SamMerge *merge_new(SamInput **inputs, size_t len);
+int merge_start(SamMerge *m);
+int merge_next(SamMerge *m, const char **records, size_t *len, size_t *input);
+void merge_destroy(SamMerge *m);
+
+
+#endif
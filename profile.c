@@ -0,0 +1,70 @@
+#ifdef ELDUDERINO_PROFILE
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "profile.h"
+
+
+Profile profile = {0};
+
+static const char *stage_names[PROFILE_STAGES] = {"parse", "unpaired", "paired", "dedupe", "sort", "consensus", "output", "spill"};
+static const char *counter_names[PROFILE_COUNTERS] = {"records", "bytes", "pairs", "families", "spilled_pairs"};
+
+static void write_histogram(JsonWriter *jw, const char *name, uint64_t *histogram);
+
+
+
+uint64_t profile_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+    }
+
+
+
+static void write_histogram(JsonWriter *jw, const char *name, uint64_t *histogram) {
+    int i = 0;
+
+    json_begin_array(jw, name);
+    for (i = 0; i < PROBE_BINS; ++i) {
+        json_uint(jw, NULL, histogram[i]);
+        }
+    json_end(jw);
+    }
+
+
+
+void profile_write(JsonWriter *jw) {
+    // Writes the profile as a member of the stats json object
+    int i = 0;
+
+    json_begin_object(jw, "profile");
+    json_begin_object(jw, "stage_seconds");
+    for (i = 0; i < PROFILE_STAGES; ++i) {
+        json_double(jw, stage_names[i], profile.stage_ns[i] / 1e9, 6);
+        }
+    json_end(jw);
+    json_begin_object(jw, "stage_calls");
+    for (i = 0; i < PROFILE_STAGES; ++i) {
+        json_uint(jw, stage_names[i], profile.stage_calls[i]);
+        }
+    json_end(jw);
+    json_begin_object(jw, "counters");
+    for (i = 0; i < PROFILE_COUNTERS; ++i) {
+        json_uint(jw, counter_names[i], profile.counters[i]);
+        }
+    json_end(jw);
+    write_histogram(jw, "unpaired_probes", profile.hash_probes);
+    write_histogram(jw, "paired_probes", profile.mash_probes);
+    json_uint(jw, "peak_unpaired", profile.peak_unpaired);
+    json_uint(jw, "peak_paired", profile.peak_paired);
+    json_uint(jw, "peak_paired_bytes", profile.peak_paired_bytes);
+    json_uint(jw, "peak_open_families", profile.peak_open_families);
+    json_end(jw);
+    }
+
+
+#endif
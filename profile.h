@@ -0,0 +1,80 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+// Stage timers, counters, hash probe histograms and peak table sizes. These are only compiled
+// in when ELDUDERINO_PROFILE is defined (make PROFILE=1), otherwise every macro expands to nothing.
+
+#ifdef ELDUDERINO_PROFILE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "json.h"
+
+
+// Stage times are inclusive, ie dedupe contains sort, consensus and output
+typedef enum {
+    STAGE_PARSE,
+    STAGE_UNPAIRED,
+    STAGE_PAIRED,
+    STAGE_DEDUPE,
+    STAGE_SORT,
+    STAGE_CONSENSUS,
+    STAGE_OUTPUT,
+    STAGE_SPILL,
+    PROFILE_STAGES
+    } ProfileStage;
+
+
+typedef enum {
+    COUNT_RECORDS,
+    COUNT_BYTES,
+    COUNT_PAIRS,
+    COUNT_FAMILIES,
+    COUNT_SPILLED,
+    PROFILE_COUNTERS
+    } ProfileCounter;
+
+
+#define PROBE_BINS 16 // the last bin holds all longer probes
+
+
+typedef struct profile_t {
+    bool enabled;
+    uint64_t stage_ns[PROFILE_STAGES];
+    uint64_t stage_calls[PROFILE_STAGES];
+    uint64_t counters[PROFILE_COUNTERS];
+    uint64_t hash_probes[PROBE_BINS]; // entries compared per unpaired lookup
+    uint64_t mash_probes[PROBE_BINS]; // entries compared per paired lookup
+    uint64_t peak_unpaired;
+    uint64_t peak_paired;
+    uint64_t peak_paired_bytes;
+    uint64_t peak_open_families;
+    } Profile;
+
+
+extern Profile profile;
+
+uint64_t profile_now(void);
+void profile_write(JsonWriter *jw);
+
+
+#define PROFILE_START(timer) uint64_t timer = profile_now()
+#define PROFILE_STOP(stage, timer) do { profile.stage_ns[stage] += profile_now() - (timer); ++profile.stage_calls[stage]; } while (0)
+#define PROFILE_COUNT(counter, n) (profile.counters[counter] += (n))
+#define PROFILE_PROBES(histogram, n) (++profile.histogram[(n) < PROBE_BINS ? (n) : PROBE_BINS - 1])
+#define PROFILE_PEAK(field, n) do { if ((uint64_t)(n) > profile.field) { profile.field = (uint64_t)(n); } } while (0)
+
+#else
+
+#define PROFILE_START(timer)
+#define PROFILE_STOP(stage, timer)
+#define PROFILE_COUNT(counter, n)
+#define PROFILE_PROBES(histogram, n)
+#define PROFILE_PEAK(field, n)
+
+#endif
+
+
+#endif
@@ -0,0 +1,696 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "region.h"
+
+
+/*
+ * Restricts processing to regions of a coordinate sorted sam. A sidecar index records the offset of
+ * the first record of every 16kb bin so that each region can be reached without reading what comes
+ * before it. A pair belongs to a region if its leftmost mate, the one that appears first in the
+ * sam, is positioned within it. Mates positioned beyond the region are found by seeking to their
+ * RNEXT and PNEXT.
+ */
+
+
+typedef struct samfields_t {
+    const char *qname;
+    size_t qname_len;
+    int flag;
+    const char *rname;
+    size_t rname_len;
+    int32_t pos;
+    const char *rnext;
+    size_t rnext_len;
+    int32_t pnext;
+    } SamFields;
+
+
+typedef struct matelocation_t {
+    size_t contig;
+    int32_t pos;
+    const char *qname;
+    size_t qname_len;
+    } MateLocation;
+
+
+static const uint16_t NON_PRIMARY = 0x100 | 0x800; // SECONDARY | SUPPPLEMENTARY
+static const uint16_t BOTH_UNMAPPED = 0x4 | 0x8; // UNMAPPED | MATE_UNMAPPED
+
+static const char *parse_fields(const char *record, const char *sam_end, SamFields *fields);
+static int cmp_name(const char *name, const char *text, size_t text_len);
+static int cmp_regions(const void *p1, const void *p2);
+static int cmp_mates(const void *p1, const void *p2);
+static int cmp_spans(const void *p1, const void *p2);
+static int add_region(Regions *regions, const char *rname, size_t rname_len, int32_t start, int32_t end);
+static bool in_regions(Regions *regions, const char *rname, size_t rname_len, int32_t pos);
+static SamIndex *new_index(size_t sam_len, const struct stat *sam_stat);
+static int add_contig(SamIndex *index, const char *rname, size_t rname_len);
+static bool find_contig(SamIndex *index, const char *rname, size_t rname_len, size_t *contig);
+static int add_entry(SamIndex *index, size_t contig, int32_t bin_start, size_t offset);
+static bool index_offset(SamIndex *index, size_t contig, int32_t pos, size_t *offset);
+static int add_span(RecordSpan **spans, size_t *spans_len, size_t *max_spans_len, size_t offset, size_t len);
+
+
+
+static const char *parse_fields(const char *record, const char *sam_end, SamFields *fields) {
+    // Splits the first eight fields of a record, returns the start of the next record or NULL if
+    // there are too few fields
+    const char *line_end = memchr(record, '\n', sam_end - record), *field = record, *tab = NULL;
+    const char *starts[8] = {NULL};
+    size_t lens[8] = {0};
+    int i = 0;
+
+    if (line_end == NULL) {
+        line_end = sam_end;
+        }
+    for (i = 0; i < 8; ++i) {
+        if ((tab = memchr(field, '\t', line_end - field)) == NULL) {
+            if (i < 7) {
+                return NULL;
+                }
+            tab = line_end;
+            }
+        starts[i] = field;
+        lens[i] = tab - field;
+        field = tab + 1;
+        }
+
+    fields->qname = starts[0];
+    fields->qname_len = lens[0];
+    fields->flag = (int)strtol(starts[1], NULL, 10);
+    fields->rname = starts[2];
+    fields->rname_len = lens[2];
+    fields->pos = (int32_t)strtol(starts[3], NULL, 10);
+    fields->rnext = starts[6];
+    fields->rnext_len = lens[6];
+    fields->pnext = (int32_t)strtol(starts[7], NULL, 10);
+    return line_end < sam_end ? line_end + 1 : sam_end;
+    }
+
+
+
+static int cmp_name(const char *name, const char *text, size_t text_len) {
+    // Compares a nul terminated name with a name within the sam
+    int ret = strncmp(name, text, text_len);
+
+    if (ret == 0 && name[text_len] != '\0') {
+        ret = 1;
+        }
+    return ret;
+    }
+
+
+
+static int cmp_regions(const void *p1, const void *p2) {
+    const Region *r1 = p1, *r2 = p2;
+    int ret = strcmp(r1->rname, r2->rname);
+
+    if (ret == 0) {
+        ret = (r1->start > r2->start) - (r1->start < r2->start);
+        }
+    return ret;
+    }
+
+
+
+static int cmp_mates(const void *p1, const void *p2) {
+    const MateLocation *m1 = p1, *m2 = p2;
+
+    if (m1->contig != m2->contig) {
+        return m1->contig > m2->contig ? 1 : -1;
+        }
+    return (m1->pos > m2->pos) - (m1->pos < m2->pos);
+    }
+
+
+
+static int cmp_spans(const void *p1, const void *p2) {
+    const RecordSpan *s1 = p1, *s2 = p2;
+
+    return (s1->offset > s2->offset) - (s1->offset < s2->offset);
+    }
+
+
+
+static int add_region(Regions *regions, const char *rname, size_t rname_len, int32_t start, int32_t end) {
+    Region *region = NULL;
+
+    if (regions->len == regions->max_len) {
+        regions->max_len = regions->max_len ? regions->max_len * 2 : 16;
+        if ((regions->regions = realloc(regions->regions, regions->max_len * sizeof(Region))) == NULL) {
+            return -1;
+            }
+        }
+
+    region = regions->regions + regions->len;
+    if ((region->rname = malloc(rname_len + 1)) == NULL) {
+        return -1;
+        }
+    memcpy(region->rname, rname, rname_len);
+    region->rname[rname_len] = '\0';
+    region->start = start;
+    region->end = end;
+    ++regions->len;
+    return 0;
+    }
+
+
+
+int regions_parse(Regions *regions, const char *text) {
+    // Adds a region given as rname:start-end, one based and inclusive, or as rname alone for the
+    // whole contig. The last colon is used as contig names may themselves contain colons.
+    const char *colon = strrchr(text, ':');
+    char *endptr = NULL;
+    long start = 0, end = 0;
+
+    if (colon != NULL && isdigit(colon[1])) {
+        errno = 0;
+        start = strtol(colon + 1, &endptr, 10);
+        if (*endptr == '-' && isdigit(endptr[1])) {
+            end = strtol(endptr + 1, &endptr, 10);
+            if (errno == 0 && *endptr == '\0' && start >= 1 && end >= start && end <= INT32_MAX && colon > text) {
+                return add_region(regions, text, colon - text, (int32_t)start, (int32_t)end);
+                }
+            }
+        return -1;
+        }
+
+    if (*text == '\0') {
+        return -1;
+        }
+    return add_region(regions, text, strlen(text), 1, INT32_MAX);
+    }
+
+
+
+int regions_read_bed(Regions *regions, const char *filename) {
+    // Adds every region of a bed file, whose starts are zero based and ends exclusive
+    FILE *fp = NULL;
+    char *line = NULL, *rname = NULL, *start = NULL, *end = NULL, *endptr = NULL, *saveptr = NULL;
+    size_t line_len = 0;
+    long start_val = 0, end_val = 0;
+    int ret = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        return -1;
+        }
+
+    while (ret == 0 && getline(&line, &line_len, fp) != -1) {
+        if ((rname = strtok_r(line, "\t\r\n", &saveptr)) == NULL || *rname == '#' ||
+            strncmp(rname, "track", 5) == 0 || strncmp(rname, "browser", 7) == 0) {
+            continue;
+            }
+        start = strtok_r(NULL, "\t\r\n", &saveptr);
+        end = strtok_r(NULL, "\t\r\n", &saveptr);
+        if (start == NULL || end == NULL) {
+            ret = -1;
+            break;
+            }
+
+        errno = 0;
+        start_val = strtol(start, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || endptr == start) {
+            ret = -1;
+            break;
+            }
+        end_val = strtol(end, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || endptr == end || start_val < 0 || end_val <= start_val || end_val > INT32_MAX) {
+            ret = -1;
+            break;
+            }
+        ret = add_region(regions, rname, strlen(rname), (int32_t)start_val + 1, (int32_t)end_val);
+        }
+
+    free(line);
+    fclose(fp);
+    return ret;
+    }
+
+
+
+void regions_sort(Regions *regions) {
+    // Sorts and merges overlapping or adjacent regions so that each position is within at most one
+    size_t i = 0, j = 0;
+
+    if (regions->len == 0) {
+        return;
+        }
+
+    qsort(regions->regions, regions->len, sizeof(Region), cmp_regions);
+    for (i = 1; i < regions->len; ++i) {
+        if (strcmp(regions->regions[i].rname, regions->regions[j].rname) == 0 &&
+            (int64_t)regions->regions[i].start <= (int64_t)regions->regions[j].end + 1) {
+            if (regions->regions[i].end > regions->regions[j].end) {
+                regions->regions[j].end = regions->regions[i].end;
+                }
+            free(regions->regions[i].rname);
+            }
+        else {
+            regions->regions[++j] = regions->regions[i];
+            }
+        }
+    regions->len = j + 1;
+    }
+
+
+
+static bool in_regions(Regions *regions, const char *rname, size_t rname_len, int32_t pos) {
+    // Binary search for the last region starting at or before rname:pos
+    size_t low = 0, high = regions->len, mid = 0;
+    int ret = 0;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        ret = -cmp_name(regions->regions[mid].rname, rname, rname_len);
+        if (ret == 0) {
+            ret = (pos > regions->regions[mid].start) - (pos < regions->regions[mid].start);
+            }
+        if (ret < 0) {
+            high = mid;
+            }
+        else {
+            low = mid + 1;
+            }
+        }
+
+    return low > 0 && cmp_name(regions->regions[low - 1].rname, rname, rname_len) == 0 && pos <= regions->regions[low - 1].end;
+    }
+
+
+
+void regions_destroy(Regions *regions) {
+    size_t i = 0;
+
+    for (i = 0; i < regions->len; ++i) {
+        free(regions->regions[i].rname);
+        }
+    free(regions->regions);
+    regions->regions = NULL;
+    regions->len = regions->max_len = 0;
+    }
+
+
+
+static SamIndex *new_index(size_t sam_len, const struct stat *sam_stat) {
+    SamIndex *index = NULL;
+
+    if ((index = calloc(1, sizeof(SamIndex))) == NULL) {
+        return NULL;
+        }
+    if ((index->contig_lookup = hash_new(64)) == NULL) {
+        free(index);
+        return NULL;
+        }
+    index->sam_len = sam_len;
+    index->sam_mtime = (int64_t)sam_stat->st_mtime;
+    index->sam_inode = (uint64_t)sam_stat->st_ino;
+    return index;
+    }
+
+
+
+static int add_contig(SamIndex *index, const char *rname, size_t rname_len) {
+    char *name = NULL;
+
+    if ((index->contigs = realloc(index->contigs, (index->contigs_len + 1) * sizeof(char *))) == NULL ||
+        (name = malloc(rname_len + 1)) == NULL) {
+        return -1;
+        }
+    memcpy(name, rname, rname_len);
+    name[rname_len] = '\0';
+    index->contigs[index->contigs_len] = name;
+
+    // The index of the contig is stored as the data size, the name as data only marks it as present
+    if (hash_put(index->contig_lookup, name, rname_len, name, index->contigs_len) == -1) {
+        return -1;
+        }
+    ++index->contigs_len;
+    return 0;
+    }
+
+
+
+static bool find_contig(SamIndex *index, const char *rname, size_t rname_len, size_t *contig) {
+    return hash_get(index->contig_lookup, rname, rname_len, contig) != NULL;
+    }
+
+
+
+static int add_entry(SamIndex *index, size_t contig, int32_t bin_start, size_t offset) {
+    if (index->len == index->max_len) {
+        index->max_len = index->max_len ? index->max_len * 2 : 1024;
+        if ((index->entries = realloc(index->entries, index->max_len * sizeof(SamIndexEntry))) == NULL) {
+            return -1;
+            }
+        }
+    index->entries[index->len].contig = contig;
+    index->entries[index->len].bin_start = bin_start;
+    index->entries[index->len].offset = offset;
+    ++index->len;
+    return 0;
+    }
+
+
+
+SamIndex *sam_index_build(const char *sam, size_t sam_len, const struct stat *sam_stat) {
+    // Returns NULL if the sam is malformed or not sorted by position
+    SamIndex *index = NULL;
+    const char *record = NULL, *next = NULL, *sam_end = sam + sam_len;
+    SamFields fields = {0};
+    size_t contig = 0;
+    int32_t bin_start = 0, last_pos = 0;
+    bool have_contig = false;
+
+    if ((index = new_index(sam_len, sam_stat)) == NULL) {
+        return NULL;
+        }
+
+    for (record = sam; record < sam_end; record = next) {
+        if (*record == '@') {
+            next = memchr(record, '\n', sam_end - record);
+            next = next != NULL ? next + 1 : sam_end;
+            continue;
+            }
+        if ((next = parse_fields(record, sam_end, &fields)) == NULL) {
+            sam_index_destroy(index);
+            return NULL;
+            }
+
+        if (!have_contig || cmp_name(index->contigs[contig], fields.rname, fields.rname_len) != 0) {
+            // A contig seen before means that the sam is not sorted
+            if (find_contig(index, fields.rname, fields.rname_len, &contig) || add_contig(index, fields.rname, fields.rname_len) == -1) {
+                sam_index_destroy(index);
+                return NULL;
+                }
+            contig = index->contigs_len - 1;
+            have_contig = true;
+            last_pos = INT32_MIN;
+            bin_start = INT32_MIN;
+            }
+        if (fields.pos < last_pos) {
+            sam_index_destroy(index);
+            return NULL;
+            }
+        last_pos = fields.pos;
+
+        if ((fields.pos >> INDEX_BIN_SHIFT) << INDEX_BIN_SHIFT != bin_start) {
+            bin_start = (fields.pos >> INDEX_BIN_SHIFT) << INDEX_BIN_SHIFT;
+            if (add_entry(index, contig, bin_start, record - sam) == -1) {
+                sam_index_destroy(index);
+                return NULL;
+                }
+            }
+        }
+    return index;
+    }
+
+
+
+SamIndex *sam_index_read(const char *filename, size_t sam_len, const struct stat *sam_stat) {
+    // Returns NULL if the index is missing, malformed or of a sam of a different size, modification
+    // time or inode. The time is compared to the second, the resolution of some filesystems.
+    SamIndex *index = NULL;
+    FILE *fp = NULL;
+    char *line = NULL, *rname = NULL, *bin_start = NULL, *offset = NULL, *saveptr = NULL;
+    size_t line_len = 0, contig = 0;
+    unsigned long long indexed_len = 0, indexed_inode = 0;
+    long long indexed_mtime = 0;
+    bool ok = false;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        return NULL;
+        }
+
+    if (fscanf(fp, "@elduderino_index\t2\t%llu\t%lld\t%llu\n", &indexed_len, &indexed_mtime, &indexed_inode) == 3 && indexed_len == sam_len &&
+        indexed_mtime == (long long)sam_stat->st_mtime && indexed_inode == (unsigned long long)sam_stat->st_ino && (index = new_index(sam_len, sam_stat)) != NULL) {
+        ok = true;
+        while (ok && getline(&line, &line_len, fp) != -1) {
+            rname = strtok_r(line, "\t\n", &saveptr);
+            bin_start = strtok_r(NULL, "\t\n", &saveptr);
+            offset = strtok_r(NULL, "\t\n", &saveptr);
+            if (rname == NULL || bin_start == NULL || offset == NULL) {
+                ok = false;
+                break;
+                }
+            if (!find_contig(index, rname, strlen(rname), &contig)) {
+                if (add_contig(index, rname, strlen(rname)) == -1) {
+                    ok = false;
+                    break;
+                    }
+                contig = index->contigs_len - 1;
+                }
+            ok = add_entry(index, contig, (int32_t)strtol(bin_start, NULL, 10), (size_t)strtoull(offset, NULL, 10)) == 0 &&
+                 index->entries[index->len - 1].offset < sam_len;
+            }
+        }
+
+    free(line);
+    fclose(fp);
+    if (!ok && index != NULL) {
+        sam_index_destroy(index);
+        index = NULL;
+        }
+    return index;
+    }
+
+
+
+int sam_index_write(SamIndex *index, const char *filename) {
+    // Written to a temporary file alongside and renamed into place, so that samples sharing an input
+    // never read an index that another is part way through writing
+    FILE *fp = NULL;
+    char *temp_filename = NULL;
+    size_t i = 0;
+    int fd = -1, ret = 0;
+
+    if ((temp_filename = malloc(strlen(filename) + 8)) == NULL) {
+        return -1;
+        }
+    sprintf(temp_filename, "%s.XXXXXX", filename);
+    if ((fd = mkstemp(temp_filename)) == -1) {
+        free(temp_filename);
+        return -1;
+        }
+    // mkstemp creates the file readable by its owner alone
+    if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(temp_filename);
+        free(temp_filename);
+        return -1;
+        }
+    fprintf(fp, "@elduderino_index\t2\t%llu\t%lld\t%llu\n", (unsigned long long)index->sam_len, (long long)index->sam_mtime, (unsigned long long)index->sam_inode);
+    for (i = 0; i < index->len; ++i) {
+        fprintf(fp, "%s\t%i\t%llu\n", index->contigs[index->entries[i].contig], (int)index->entries[i].bin_start, (unsigned long long)index->entries[i].offset);
+        }
+    if (fclose(fp) != 0 || rename(temp_filename, filename) == -1) {
+        unlink(temp_filename);
+        ret = -1;
+        }
+    free(temp_filename);
+    return ret;
+    }
+
+
+
+void sam_index_destroy(SamIndex *index) {
+    size_t i = 0;
+
+    hash_destroy(index->contig_lookup);
+    for (i = 0; i < index->contigs_len; ++i) {
+        free(index->contigs[i]);
+        }
+    free(index->contigs);
+    free(index->entries);
+    free(index);
+    }
+
+
+
+static bool index_offset(SamIndex *index, size_t contig, int32_t pos, size_t *offset) {
+    // Offset of the first record of the bin containing pos, or of the next bin with any records
+    size_t low = 0, high = index->len, mid = 0;
+    SamIndexEntry *entry = NULL;
+
+    // First entry after contig:pos
+    while (low < high) {
+        mid = (low + high) / 2;
+        entry = index->entries + mid;
+        if (entry->contig > contig || (entry->contig == contig && entry->bin_start > pos)) {
+            high = mid;
+            }
+        else {
+            low = mid + 1;
+            }
+        }
+
+    if (low > 0 && index->entries[low - 1].contig == contig) {
+        *offset = index->entries[low - 1].offset;
+        return true;
+        }
+    if (low < index->len && index->entries[low].contig == contig) {
+        *offset = index->entries[low].offset;
+        return true;
+        }
+    return false;
+    }
+
+
+
+static int add_span(RecordSpan **spans, size_t *spans_len, size_t *max_spans_len, size_t offset, size_t len) {
+    if (*spans_len == *max_spans_len) {
+        *max_spans_len = *max_spans_len ? *max_spans_len * 2 : 1024;
+        if ((*spans = realloc(*spans, *max_spans_len * sizeof(RecordSpan))) == NULL) {
+            return -1;
+            }
+        }
+    (*spans)[*spans_len].offset = offset;
+    (*spans)[*spans_len].len = len;
+    ++*spans_len;
+    return 0;
+    }
+
+
+
+int region_records(const char *sam, size_t sam_len, SamIndex *index, Regions *regions, RecordSpan **spans, size_t *spans_len) {
+    /*
+     * Fills spans, in sam order, with every primary record of each pair whose leftmost mate lies
+     * within regions, which must have been sorted. Returns -1 if the sam is malformed or memory
+     * cannot be allocated.
+     */
+    const char *record = NULL, *next = NULL, *sam_end = sam + sam_len, *mate_rname = NULL;
+    SamFields fields = {0};
+    MateLocation *mates = NULL;
+    size_t max_spans_len = 0, mates_len = 0, max_mates_len = 0, i = 0, j = 0, contig = 0, mate_contig = 0, offset = 0, cursor = 0, first_at_pos = 0;
+    size_t mate_rname_len = 0;
+    int32_t mate_pos = 0;
+    bool leftmost = false, mate_known = false;
+    Region *region = NULL;
+    void *ptr = NULL;
+
+    *spans = NULL;
+    *spans_len = 0;
+
+    for (i = 0; i < regions->len; ++i) {
+        region = regions->regions + i;
+        if (!find_contig(index, region->rname, strlen(region->rname), &contig) || !index_offset(index, contig, region->start, &offset)) {
+            continue;
+            }
+
+        for (record = sam + offset; record < sam_end; record = next) {
+            if ((next = parse_fields(record, sam_end, &fields)) == NULL) {
+                free(mates);
+                return -1;
+                }
+            if (fields.pos > region->end || cmp_name(region->rname, fields.rname, fields.rname_len) != 0) {
+                break;
+                }
+            if (fields.pos < region->start || (fields.flag & NON_PRIMARY) || (fields.flag & BOTH_UNMAPPED) == BOTH_UNMAPPED) {
+                continue;
+                }
+
+            // Where is the mate? Without RNEXT it is treated as being at the same position
+            mate_rname = fields.rname;
+            mate_rname_len = fields.rname_len;
+            mate_contig = contig;
+            mate_pos = fields.pnext;
+            mate_known = true;
+            if (fields.rnext_len == 1 && *fields.rnext == '*') {
+                mate_pos = fields.pos;
+                }
+            else if (!(fields.rnext_len == 1 && *fields.rnext == '=')) {
+                mate_rname = fields.rnext;
+                mate_rname_len = fields.rnext_len;
+                mate_known = find_contig(index, mate_rname, mate_rname_len, &mate_contig);
+                }
+            leftmost = !mate_known || contig < mate_contig || (contig == mate_contig && fields.pos <= mate_pos);
+
+            if (leftmost) {
+                if (add_span(spans, spans_len, &max_spans_len, record - sam, next - record) == -1) {
+                    free(mates);
+                    return -1;
+                    }
+                // Mates beyond the end of the region are looked up afterwards
+                if (mate_known && (mate_contig != contig || mate_pos > region->end)) {
+                    if (mates_len == max_mates_len) {
+                        max_mates_len = max_mates_len ? max_mates_len * 2 : 1024;
+                        if ((ptr = realloc(mates, max_mates_len * sizeof(MateLocation))) == NULL) {
+                            free(mates);
+                            return -1;
+                            }
+                        mates = ptr;
+                        }
+                    mates[mates_len].contig = mate_contig;
+                    mates[mates_len].pos = mate_pos;
+                    mates[mates_len].qname = fields.qname;
+                    mates[mates_len].qname_len = fields.qname_len;
+                    ++mates_len;
+                    }
+                }
+            else if (in_regions(regions, mate_rname, mate_rname_len, mate_pos)) {
+                if (add_span(spans, spans_len, &max_spans_len, record - sam, next - record) == -1) {
+                    free(mates);
+                    return -1;
+                    }
+                }
+            }
+        }
+
+    // Mates sorted into sam order so that the cursor only moves forward. The cursor is the first
+    // record at the previous mate's position, as several mates may share a position.
+    qsort(mates, mates_len, sizeof(MateLocation), cmp_mates);
+    for (i = 0; i < mates_len; ++i) {
+        if (!index_offset(index, mates[i].contig, mates[i].pos, &offset)) {
+            continue;
+            }
+        if (offset < cursor) {
+            offset = cursor;
+            }
+
+        first_at_pos = SIZE_MAX;
+        for (record = sam + offset; record < sam_end; record = next) {
+            if ((next = parse_fields(record, sam_end, &fields)) == NULL) {
+                free(mates);
+                return -1;
+                }
+            if (cmp_name(index->contigs[mates[i].contig], fields.rname, fields.rname_len) != 0 || fields.pos > mates[i].pos) {
+                break;
+                }
+            if (fields.pos < mates[i].pos) {
+                continue;
+                }
+            if (first_at_pos == SIZE_MAX) {
+                first_at_pos = record - sam;
+                }
+            if (!(fields.flag & NON_PRIMARY) && fields.qname_len == mates[i].qname_len && memcmp(fields.qname, mates[i].qname, fields.qname_len) == 0) {
+                if (add_span(spans, spans_len, &max_spans_len, record - sam, next - record) == -1) {
+                    free(mates);
+                    return -1;
+                    }
+                break;
+                }
+            }
+        if (first_at_pos != SIZE_MAX) {
+            cursor = first_at_pos;
+            }
+        }
+    free(mates);
+
+    // A record may have been found both as a mate and within a later region
+    qsort(*spans, *spans_len, sizeof(RecordSpan), cmp_spans);
+    for (i = 0, j = 0; i < *spans_len; ++i) {
+        if (j == 0 || (*spans)[i].offset != (*spans)[j - 1].offset) {
+            (*spans)[j++] = (*spans)[i];
+            }
+        }
+    *spans_len = j;
+    return 0;
+    }
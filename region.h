@@ -0,0 +1,68 @@
+#ifndef _REGION_H
+#define _REGION_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hash.h"
+
+
+#define INDEX_BIN_SHIFT 14 // positions per index entry, 16kb as in the bai linear index
+
+
+typedef struct region_t {
+    char *rname;
+    int32_t start; // one based, inclusive
+    int32_t end;
+    } Region;
+
+
+typedef struct regions_t {
+    Region *regions; // sorted by rname then start and merged by regions_sort
+    size_t len;
+    size_t max_len;
+    } Regions;
+
+
+typedef struct samindexentry_t {
+    size_t contig; // index into contigs
+    int32_t bin_start; // first position of the bin
+    size_t offset; // of the first record within the bin
+    } SamIndexEntry;
+
+
+typedef struct samindex_t {
+    size_t sam_len; // size, modification time and inode of the indexed sam, used to detect a stale index
+    int64_t sam_mtime;
+    uint64_t sam_inode;
+    char **contigs; // in order of appearance in the sam
+    size_t contigs_len;
+    HashTable *contig_lookup; // name to index into contigs, stored as the data size
+    SamIndexEntry *entries; // ordered as in the sam
+    size_t len;
+    size_t max_len;
+    } SamIndex;
+
+
+typedef struct recordspan_t {
+    size_t offset;
+    size_t len; // including the newline
+    } RecordSpan;
+
+
+
+int regions_parse(Regions *regions, const char *text);
+int regions_read_bed(Regions *regions, const char *filename);
+void regions_sort(Regions *regions);
+void regions_destroy(Regions *regions);
+SamIndex *sam_index_build(const char *sam, size_t sam_len, const struct stat *sam_stat);
+SamIndex *sam_index_read(const char *filename, size_t sam_len, const struct stat *sam_stat);
+int sam_index_write(SamIndex *index, const char *filename);
+void sam_index_destroy(SamIndex *index);
+int region_records(const char *sam, size_t sam_len, SamIndex *index, Regions *regions, RecordSpan **spans, size_t *spans_len);
+
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "shard.h"
+#include "hashfunc.h"
+
+
+static void *shard_writer(void *arg);
+static int shard_queue(Shard *shard);
+static int shard_finish(Shard *shard);
+static size_t shard_of(const ShardedOutput *so, const char *data, size_t len);
+
+
+
+char *shard_filename(const char *filename, size_t shard) {
+    // Returns a newly allocated copy of filename with the shard number inserted before its suffix,
+    // out.fastq becomes out.0.fastq
+    const char *dot = strrchr(filename, '.'), *slash = strrchr(filename, '/');
+    size_t len = 0, max_len = strlen(filename) + 24;
+    char *sharded = NULL;
+
+    if (dot == NULL || (slash != NULL && dot < slash)) {
+        dot = filename + strlen(filename);
+        }
+    len = dot - filename;
+    if ((sharded = malloc(max_len)) != NULL) {
+        snprintf(sharded, max_len, "%.*s.%zu%s", (int)len, filename, shard, dot);
+        }
+    return sharded;
+    }
+
+
+
+ShardedOutput *shards_open(const char *filename, size_t len) {
+    // Opens len files named by shard_filename, each with its own writer thread. Returns NULL on
+    // failure, having closed anything already opened.
+    ShardedOutput *so = NULL;
+    Shard *shard = NULL;
+    char *sharded = NULL;
+    size_t i = 0, b = 0;
+
+    if ((so = calloc(1, sizeof(ShardedOutput))) == NULL) {
+        return NULL;
+        }
+    if ((so->shards = calloc(len, sizeof(Shard))) == NULL) {
+        free(so);
+        return NULL;
+        }
+
+    for (i = 0; i < len; ++i) {
+        shard = so->shards + i;
+        so->len = i + 1;
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->cond, NULL);
+        for (b = 0; b < SHARD_BUFFERS; ++b) {
+            if ((shard->buffers[b] = malloc(SHARD_BUFFER_SIZE)) == NULL) {
+                shards_close(so);
+                return NULL;
+                }
+            shard->max_lens[b] = SHARD_BUFFER_SIZE;
+            }
+        if ((sharded = shard_filename(filename, i)) == NULL || (shard->fp = fopen(sharded, "w")) == NULL) {
+            free(sharded);
+            shards_close(so);
+            return NULL;
+            }
+        free(sharded);
+        if (pthread_create(&shard->thread, NULL, shard_writer, shard) != 0) {
+            shards_close(so);
+            return NULL;
+            }
+        shard->started = true;
+        }
+    return so;
+    }
+
+
+
+static void *shard_writer(void *arg) {
+    // Writes queued buffers in order until the shard is finished and none remain
+    Shard *shard = arg;
+    size_t b = 0;
+    bool failed = false;
+
+    pthread_mutex_lock(&shard->lock);
+    while (true) {
+        while (shard->queued == 0 && !shard->finished) {
+            pthread_cond_wait(&shard->cond, &shard->lock);
+            }
+        if (shard->queued == 0) {
+            break;
+            }
+        b = shard->written;
+        pthread_mutex_unlock(&shard->lock);
+
+        // The buffer is not touched by shards_write until it is dequeued
+        failed = failed || fwrite(shard->buffers[b], 1, shard->lens[b], shard->fp) != shard->lens[b];
+
+        pthread_mutex_lock(&shard->lock);
+        shard->lens[b] = 0;
+        shard->written = (b + 1) % SHARD_BUFFERS;
+        --shard->queued;
+        shard->failed = failed;
+        pthread_cond_signal(&shard->cond);
+        }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+    }
+
+
+
+static int shard_queue(Shard *shard) {
+    // Hands the buffer being filled to the writer thread and waits for another to be free, returns -1
+    // if an earlier write failed
+    int ret = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    ++shard->queued;
+    pthread_cond_signal(&shard->cond);
+    while (shard->queued == SHARD_BUFFERS) {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+        }
+    shard->filling = (shard->written + shard->queued) % SHARD_BUFFERS;
+    ret = shard->failed ? -1 : 0;
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+    }
+
+
+
+static size_t shard_of(const ShardedOutput *so, const char *data, size_t len) {
+    // Both reads of a pair are given the qname of the family, which follows the @ of the first record
+    const char *end = NULL;
+
+    if (len < 2 || (end = memchr(data + 1, ' ', len - 1)) == NULL) {
+        return 0;
+        }
+    return DEFAULT_HASH_FUNCTION(data + 1, end - data - 1, 0) % so->len;
+    }
+
+
+
+int shards_write(void *context, const char *data, size_t len) {
+    // Output callback of the library, data is one or more whole fastq records of a single pair
+    ShardedOutput *so = context;
+    Shard *shard = so->shards + shard_of(so, data, len);
+    size_t b = shard->filling;
+    void *ptr = NULL;
+
+    if (shard->lens[b] + len > shard->max_lens[b]) {
+        if (shard->lens[b] > 0 && shard_queue(shard) == -1) {
+            return -1;
+            }
+        b = shard->filling;
+        // Only a record larger than a whole buffer grows it
+        if (len > shard->max_lens[b]) {
+            if ((ptr = realloc(shard->buffers[b], len)) == NULL) {
+                return -1;
+                }
+            shard->buffers[b] = ptr;
+            shard->max_lens[b] = len;
+            }
+        }
+    memcpy(shard->buffers[b] + shard->lens[b], data, len);
+    shard->lens[b] += len;
+    return 0;
+    }
+
+
+
+static int shard_finish(Shard *shard) {
+    // Queues the partly filled buffer, waits for everything to be written and closes the file
+    int ret = 0;
+
+    if (shard->started) {
+        pthread_mutex_lock(&shard->lock);
+        if (shard->lens[shard->filling] > 0) {
+            ++shard->queued;
+            }
+        shard->finished = true;
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_join(shard->thread, NULL);
+        ret = shard->failed ? -1 : 0;
+        }
+    if (shard->fp != NULL && fclose(shard->fp) != 0) {
+        ret = -1;
+        }
+    return ret;
+    }
+
+
+
+int shards_close(ShardedOutput *so) {
+    // Returns -1 if any shard could not be written, every shard is closed regardless
+    size_t i = 0, b = 0;
+    int ret = 0;
+
+    if (so == NULL) {
+        return 0;
+        }
+    for (i = 0; i < so->len; ++i) {
+        if (shard_finish(so->shards + i) == -1) {
+            ret = -1;
+            }
+        for (b = 0; b < SHARD_BUFFERS; ++b) {
+            free(so->shards[i].buffers[b]);
+            }
+        pthread_mutex_destroy(&so->shards[i].lock);
+        pthread_cond_destroy(&so->shards[i].cond);
+        }
+    free(so->shards);
+    free(so);
+    return ret;
+    }
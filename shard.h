@@ -0,0 +1,49 @@
+#ifndef _SHARD_H
+#define _SHARD_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+
+#define SHARD_BUFFER_SIZE (1024 * 1024) // bytes of output handed to a writer thread at once
+#define SHARD_BUFFERS 4 // per shard, one is filled while the others wait to be written
+
+
+// One output file and the thread that writes it. Buffers form a ring, those from written onwards
+// are full and queued for the thread, the one after them is being filled.
+typedef struct shard_t {
+    FILE *fp;
+    pthread_t thread;
+    bool started; // thread is running
+    char *buffers[SHARD_BUFFERS];
+    size_t lens[SHARD_BUFFERS];
+    size_t max_lens[SHARD_BUFFERS];
+    size_t filling; // buffer being filled by shards_write
+    size_t written; // next buffer to be written by the thread
+    size_t queued; // full buffers, including the one being written
+    bool finished; // nothing further will be queued
+    bool failed; // a write failed, nothing further is written
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    } Shard;
+
+
+// Fastq output spread across files so that each can be read by its own aligner. Both records of a
+// pair share the consensus qname, which selects the shard, and are therefore written together.
+typedef struct shardedoutput_t {
+    Shard *shards;
+    size_t len;
+    } ShardedOutput;
+
+
+
+ShardedOutput *shards_open(const char *filename, size_t len);
+char *shard_filename(const char *filename, size_t shard);
+int shards_write(void *context, const char *data, size_t len);
+int shards_close(ShardedOutput *so);
+
+
+#endif
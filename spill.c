@@ -0,0 +1,360 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "spill.h"
+
+
+// Records are stored as a header followed by the key and then the data, both padded to
+// 8 bytes in memory so that the data can safely hold pointers. On disk the padding is omitted.
+typedef struct spillheader_t {
+    uint32_t key_size;
+    uint32_t data_size;
+    } SpillHeader;
+
+#define PADDED(n) (((n) + 7) & ~(size_t)7)
+#define RECORD_KEY(record) ((record) + sizeof(SpillHeader))
+#define RECORD_DATA(record) ((record) + sizeof(SpillHeader) + PADDED(((SpillHeader *)(record))->key_size))
+#define RECORD_LEN(key_size, data_size) (sizeof(SpillHeader) + PADDED(key_size) + PADDED(data_size))
+
+
+static int cmp_records(const void *p1, const void *p2);
+static int sort_buffer(Spill *sp);
+static int write_run(Spill *sp);
+static int read_run_record(SpillRun *run);
+static char *source_record(Spill *sp, size_t source);
+static void advance_source(Spill *sp, size_t source);
+static void sift_down(Spill *sp, size_t i);
+static void reset(Spill *sp);
+
+
+
+static int cmp_records(const void *p1, const void *p2) {
+    const char *r1 = *(const char **)p1, *r2 = *(const char **)p2;
+    uint32_t len1 = ((SpillHeader *)r1)->key_size, len2 = ((SpillHeader *)r2)->key_size;
+    int ret = memcmp(RECORD_KEY(r1), RECORD_KEY(r2), len1 < len2 ? len1 : len2);
+
+    if (ret == 0) {
+        ret = (len1 > len2) - (len1 < len2);
+        }
+    return ret;
+    }
+
+
+
+Spill *spill_new(size_t max_memory) {
+    Spill *sp = NULL;
+
+    if ((sp = (Spill *)calloc(1, sizeof(Spill))) == NULL) {
+        return NULL;
+        }
+    sp->max_buffer_len = max_memory;
+    return sp;
+    }
+
+
+
+void spill_destroy(Spill *sp) {
+    reset(sp);
+    free(sp->buffer);
+    free(sp->sorted);
+    free(sp->runs);
+    free(sp->heap);
+    free(sp);
+    }
+
+
+
+int spill_put(Spill *sp, const void *key, size_t key_size, const void *data, size_t data_size) {
+    size_t len = RECORD_LEN(key_size, data_size), new_len = 0;
+    SpillHeader *header = NULL;
+    void *ptr = NULL;
+
+    // Records cannot be added part way through a merge
+    if (sp->merging) {
+        return -1;
+        }
+
+    if (sp->buffer_used > 0 && sp->buffer_used + len > sp->max_buffer_len) {
+        if (write_run(sp) == -1) {
+            return -1;
+            }
+        }
+
+    if (sp->buffer_used + len > sp->buffer_len) {
+        new_len = sp->buffer_len ? sp->buffer_len * 2 : 4096;
+        while (new_len < sp->buffer_used + len) {
+            new_len *= 2;
+            }
+        if ((ptr = realloc(sp->buffer, new_len)) == NULL) {
+            return -1;
+            }
+        sp->buffer = ptr;
+        sp->buffer_len = new_len;
+        }
+
+    header = (SpillHeader *)(sp->buffer + sp->buffer_used);
+    header->key_size = (uint32_t)key_size;
+    header->data_size = (uint32_t)data_size;
+    memcpy(RECORD_KEY((char *)header), key, key_size);
+    memcpy(RECORD_DATA((char *)header), data, data_size);
+    sp->buffer_used += len;
+    ++sp->records;
+    return 0;
+    }
+
+
+
+void *spill_pop(Spill *sp, const void **key, size_t *key_size, size_t *data_size) {
+    // Returns every record in key order, records with identical keys being returned consecutively.
+    // The returned pointers remain valid until the next call. Once all records have been returned
+    // NULL is returned and the spill is empty and ready for reuse. NULL is also returned if the merge
+    // fails, in which case failed is set and the remaining records are discarded.
+    size_t i = 0;
+    char *record = NULL;
+    void *ptr = NULL;
+
+    if (!sp->merging) {
+        sp->failed = false;
+        if (sp->records == 0) {
+            return NULL;
+            }
+
+        if (sort_buffer(sp) == -1 || (ptr = realloc(sp->heap, (sp->runs_len + 1) * sizeof(size_t))) == NULL) {
+            sp->failed = true;
+            reset(sp);
+            return NULL;
+            }
+        sp->heap = (size_t *)ptr;
+
+        // Disk runs are sources 0 to runs_len - 1, the in memory buffer is source runs_len
+        sp->heap_len = 0;
+        for (i = 0; i < sp->runs_len; ++i) {
+            if (read_run_record(sp->runs + i) == -1) {
+                sp->failed = true;
+                }
+            else if (sp->runs[i].record != NULL) {
+                sp->heap[sp->heap_len++] = i;
+                }
+            }
+        sp->next_record = 0;
+        if (sp->sorted_len > 0) {
+            sp->heap[sp->heap_len++] = sp->runs_len;
+            }
+        for (i = sp->heap_len / 2; i > 0; --i) {
+            sift_down(sp, i - 1);
+            }
+        sp->merging = true;
+        }
+    else {
+        // Advance the source of the previously returned record only now so that its pointers
+        // remained valid until this call
+        advance_source(sp, sp->heap[0]);
+        }
+
+    if (sp->heap_len == 0 || sp->failed) {
+        reset(sp);
+        return NULL;
+        }
+
+    record = source_record(sp, sp->heap[0]);
+    *key = RECORD_KEY(record);
+    *key_size = ((SpillHeader *)record)->key_size;
+    *data_size = ((SpillHeader *)record)->data_size;
+    return RECORD_DATA(record);
+    }
+
+
+
+static int sort_buffer(Spill *sp) {
+    size_t n = 0, offset = 0;
+    SpillHeader *header = NULL;
+    void *ptr = NULL;
+
+    for (offset = 0; offset < sp->buffer_used; ++n) {
+        header = (SpillHeader *)(sp->buffer + offset);
+        offset += RECORD_LEN(header->key_size, header->data_size);
+        }
+
+    if (n > sp->max_sorted_len) {
+        if ((ptr = realloc(sp->sorted, n * sizeof(char *))) == NULL) {
+            return -1;
+            }
+        sp->sorted = (char **)ptr;
+        sp->max_sorted_len = n;
+        }
+
+    for (n = 0, offset = 0; offset < sp->buffer_used; ++n) {
+        sp->sorted[n] = sp->buffer + offset;
+        header = (SpillHeader *)(sp->buffer + offset);
+        offset += RECORD_LEN(header->key_size, header->data_size);
+        }
+    sp->sorted_len = n;
+
+    qsort(sp->sorted, n, sizeof(char *), cmp_records);
+    return 0;
+    }
+
+
+
+static int write_run(Spill *sp) {
+    size_t i = 0;
+    SpillHeader *header = NULL;
+    SpillRun *run = NULL;
+    void *ptr = NULL;
+
+    if (sort_buffer(sp) == -1) {
+        return -1;
+        }
+
+    if ((ptr = realloc(sp->runs, (sp->runs_len + 1) * sizeof(SpillRun))) == NULL) {
+        return -1;
+        }
+    sp->runs = (SpillRun *)ptr;
+    run = sp->runs + sp->runs_len;
+    memset(run, 0, sizeof(SpillRun));
+
+    if ((run->fp = tmpfile()) == NULL) {
+        return -1;
+        }
+    ++sp->runs_len;
+
+    for (i = 0; i < sp->sorted_len; ++i) {
+        header = (SpillHeader *)sp->sorted[i];
+        if (fwrite(header, sizeof(SpillHeader), 1, run->fp) != 1 ||
+            fwrite(RECORD_KEY(sp->sorted[i]), 1, header->key_size, run->fp) != header->key_size ||
+            fwrite(RECORD_DATA(sp->sorted[i]), 1, header->data_size, run->fp) != header->data_size) {
+            return -1;
+            }
+        }
+    if (fflush(run->fp) != 0) {
+        return -1;
+        }
+    rewind(run->fp);
+
+    sp->buffer_used = 0;
+    sp->sorted_len = 0;
+    return 0;
+    }
+
+
+
+static int read_run_record(SpillRun *run) {
+    SpillHeader header = {0};
+    size_t len = 0;
+    void *ptr = NULL;
+
+    // Only a clean end of file between records ends the run, a truncated header is an error
+    if ((len = fread(&header, 1, sizeof(SpillHeader), run->fp)) != sizeof(SpillHeader)) {
+        free(run->record);
+        run->record = NULL;
+        run->record_len = 0;
+        return len == 0 && feof(run->fp) ? 0 : -1;
+        }
+
+    len = RECORD_LEN(header.key_size, header.data_size);
+    if (len > run->record_len) {
+        if ((ptr = realloc(run->record, len)) == NULL) {
+            return -1;
+            }
+        run->record = ptr;
+        run->record_len = len;
+        }
+
+    memcpy(run->record, &header, sizeof(SpillHeader));
+    if (fread(RECORD_KEY(run->record), 1, header.key_size, run->fp) != header.key_size ||
+        fread(RECORD_DATA(run->record), 1, header.data_size, run->fp) != header.data_size) {
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+static char *source_record(Spill *sp, size_t source) {
+    if (source < sp->runs_len) {
+        return sp->runs[source].record;
+        }
+    return sp->sorted[sp->next_record];
+    }
+
+
+
+static void advance_source(Spill *sp, size_t source) {
+    bool exhausted = false;
+
+    if (source < sp->runs_len) {
+        if (read_run_record(sp->runs + source) == -1) {
+            sp->failed = true;
+            return;
+            }
+        exhausted = sp->runs[source].record == NULL;
+        }
+    else {
+        exhausted = ++sp->next_record == sp->sorted_len;
+        }
+
+    if (exhausted) {
+        sp->heap[0] = sp->heap[--sp->heap_len];
+        }
+    if (sp->heap_len > 0) {
+        sift_down(sp, 0);
+        }
+    }
+
+
+
+static void sift_down(Spill *sp, size_t i) {
+    size_t smallest = 0, left = 0, right = 0, swap = 0;
+    char *r1 = NULL, *r2 = NULL;
+
+    while (true) {
+        smallest = i;
+        left = (2 * i) + 1;
+        right = left + 1;
+        if (left < sp->heap_len) {
+            r1 = source_record(sp, sp->heap[left]);
+            r2 = source_record(sp, sp->heap[smallest]);
+            if (cmp_records(&r1, &r2) < 0) {
+                smallest = left;
+                }
+            }
+        if (right < sp->heap_len) {
+            r1 = source_record(sp, sp->heap[right]);
+            r2 = source_record(sp, sp->heap[smallest]);
+            if (cmp_records(&r1, &r2) < 0) {
+                smallest = right;
+                }
+            }
+        if (smallest == i) {
+            break;
+            }
+        swap = sp->heap[i];
+        sp->heap[i] = sp->heap[smallest];
+        sp->heap[smallest] = swap;
+        i = smallest;
+        }
+    }
+
+
+
+static void reset(Spill *sp) {
+    size_t i = 0;
+
+    for (i = 0; i < sp->runs_len; ++i) {
+        if (sp->runs[i].fp != NULL) {
+            fclose(sp->runs[i].fp);
+            }
+        free(sp->runs[i].record);
+        }
+    sp->runs_len = 0;
+    sp->buffer_used = 0;
+    sp->sorted_len = 0;
+    sp->records = 0;
+    sp->heap_len = 0;
+    sp->next_record = 0;
+    sp->merging = false;
+    }
+
@@ -0,0 +1,44 @@
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef struct spillrun_t {
+    FILE *fp;
+    char *record; // current record of this run, NULL once exhausted
+    size_t record_len;
+    } SpillRun;
+
+
+typedef struct spill_t {
+    char *buffer; // records waiting to be sorted and written as a run
+    size_t buffer_len;
+    size_t buffer_used;
+    size_t max_buffer_len; // memory budget, once exceeded the buffer is written to disk
+    char **sorted; // used to sort the records in buffer
+    size_t sorted_len;
+    size_t max_sorted_len;
+    size_t records; // total records held in memory and on disk
+    SpillRun *runs;
+    size_t runs_len;
+    size_t *heap; // indices of runs ordered by their current record during merge
+    size_t heap_len;
+    size_t next_record; // next record of the in memory run during merge
+    bool merging;
+    bool failed; // the last merge ended early because a run could not be read, records were lost
+    } Spill;
+
+
+
+Spill *spill_new(size_t max_memory);
+void spill_destroy(Spill *sp);
+int spill_put(Spill *sp, const void *key, size_t key_size, const void *data, size_t data_size);
+void *spill_pop(Spill *sp, const void **key, size_t *key_size, size_t *data_size);
+
+
+#endif
+
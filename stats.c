@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "json.h"
+#include "profile.h"
+
+
+static char *read_object(const char *filename, size_t *len, bool *empty, int *error);
+static void write_saturation(JsonWriter *jw, const Stats *stats);
+static double estimate_library_size(double pairs, double families);
+
+
+
+int histogram_add(Histogram *histogram, uint64_t value, uint64_t count) {
+    size_t low = 0, high = histogram->sparse_len, mid = 0;
+    void *ptr = NULL;
+
+    if (value < HISTOGRAM_DENSE_BINS) {
+        histogram->dense[value] += count;
+        return 0;
+        }
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (histogram->sparse[mid].value < value) {
+            low = mid + 1;
+            }
+        else {
+            high = mid;
+            }
+        }
+    if (low < histogram->sparse_len && histogram->sparse[low].value == value) {
+        histogram->sparse[low].count += count;
+        return 0;
+        }
+
+    if (histogram->sparse_len == histogram->max_sparse_len) {
+        histogram->max_sparse_len = histogram->max_sparse_len ? histogram->max_sparse_len * 2 : 16;
+        if ((ptr = realloc(histogram->sparse, histogram->max_sparse_len * sizeof(HistogramBin))) == NULL) {
+            return -1;
+            }
+        histogram->sparse = (HistogramBin *)ptr;
+        }
+    memmove(histogram->sparse + low + 1, histogram->sparse + low, (histogram->sparse_len - low) * sizeof(HistogramBin));
+    histogram->sparse[low].value = value;
+    histogram->sparse[low].count = count;
+    ++histogram->sparse_len;
+    return 0;
+    }
+
+
+
+int histogram_merge(Histogram *into, const Histogram *from) {
+    size_t i = 0;
+
+    for (i = 0; i < HISTOGRAM_DENSE_BINS; ++i) {
+        into->dense[i] += from->dense[i];
+        }
+    for (i = 0; i < from->sparse_len; ++i) {
+        if (histogram_add(into, from->sparse[i].value, from->sparse[i].count) == -1) {
+            return -1;
+            }
+        }
+    return 0;
+    }
+
+
+
+bool histogram_next(const Histogram *histogram, size_t *position, uint64_t *value, uint64_t *count) {
+    // Iterates over the non-zero bins in order of value, position must start at 0
+    for (; *position < HISTOGRAM_DENSE_BINS; ++*position) {
+        if (histogram->dense[*position]) {
+            *value = *position;
+            *count = histogram->dense[(*position)++];
+            return true;
+            }
+        }
+    if (*position - HISTOGRAM_DENSE_BINS < histogram->sparse_len) {
+        *value = histogram->sparse[*position - HISTOGRAM_DENSE_BINS].value;
+        *count = histogram->sparse[*position - HISTOGRAM_DENSE_BINS].count;
+        ++*position;
+        return true;
+        }
+    return false;
+    }
+
+
+
+void histogram_destroy(Histogram *histogram) {
+    free(histogram->sparse);
+    histogram->sparse = NULL;
+    histogram->sparse_len = 0;
+    histogram->max_sparse_len = 0;
+    }
+
+
+
+int stats_add_family(Stats *stats, uint64_t family_size, uint32_t subsample_hash) {
+    if (histogram_add(&stats->family_sizes, family_size, 1) == -1) {
+        return -1;
+        }
+    ++stats->subsampled_families[((uint64_t)subsample_hash * SATURATION_BINS) >> 32];
+    ++stats->total_families;
+    return 0;
+    }
+
+
+
+int stats_merge(Stats *into, const Stats *from) {
+    size_t b = 0;
+
+    if (histogram_merge(&into->family_sizes, &from->family_sizes) == -1) {
+        return -1;
+        }
+    for (b = 0; b < SATURATION_BINS; ++b) {
+        into->subsampled_families[b] += from->subsampled_families[b];
+        }
+    into->total_reads += from->total_reads;
+    into->total_families += from->total_families;
+    into->pcr_duplicates += from->pcr_duplicates;
+    into->optical_duplicates += from->optical_duplicates;
+    into->sequencing_total += from->sequencing_total;
+    into->sequencing_errors += from->sequencing_errors;
+    into->pcr_total += from->pcr_total;
+    into->pcr_errors += from->pcr_errors;
+    into->orphans += from->orphans;
+    into->optical = into->optical || from->optical;
+    return 0;
+    }
+
+
+
+void stats_destroy(Stats *stats) {
+    histogram_destroy(&stats->family_sizes);
+    }
+
+
+
+static char *read_object(const char *filename, size_t *len, bool *empty, int *error) {
+    /*
+     * Returns the contents of an existing stats file up to but excluding the closing brace of its
+     * object, and whether that object has no members. NULL with error unset if there is no file to
+     * extend, which is also the case for anything but a regular file such as /dev/stdout.
+     */
+    FILE *fp = NULL;
+    struct stat st;
+    char *text = NULL;
+
+    *error = 0;
+    *len = 0;
+    if ((fp = fopen(filename, "r")) == NULL) {
+        *error = errno != ENOENT;
+        return NULL;
+        }
+    if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fclose(fp);
+        return NULL;
+        }
+
+    if ((text = malloc(st.st_size)) == NULL || fread(text, 1, st.st_size, fp) != (size_t)st.st_size) {
+        *error = 1;
+        }
+    fclose(fp);
+
+    // The object may end with a nested object, only its own closing brace is removed
+    for (*len = st.st_size; !*error && *len > 0 && isspace((unsigned char)text[*len - 1]); --*len);
+    if (!*error && *len > 0) {
+        if (text[*len - 1] != '}') {
+            *error = 1;
+            }
+        for (--*len; !*error && *len > 0 && isspace((unsigned char)text[*len - 1]); --*len);
+        if (*len == 0) {
+            *error = 1;
+            }
+        }
+    if (*error || *len == 0) {
+        free(text);
+        return NULL;
+        }
+    *empty = text[*len - 1] == '{';
+    return text;
+    }
+
+
+
+int stats_write(const Stats *stats, const char *filename) {
+    /*
+     * Adds the statistics as members of the json object in filename, which is created if it does not
+     * exist. Returns -1 if the file cannot be written or does not contain a single object.
+     */
+    FILE *fp = NULL;
+    JsonWriter jw;
+    char *existing = NULL, key[32];
+    size_t existing_len = 0, position = 0;
+    uint64_t total_reads = 0, total_families = 0, value = 0, count = 0;
+    bool empty = true;
+    int error = 0;
+
+    existing = read_object(filename, &existing_len, &empty, &error);
+    if (error || (fp = fopen(filename, "w")) == NULL) {
+        free(existing);
+        return -1;
+        }
+    if (existing != NULL) {
+        fwrite(existing, 1, existing_len, fp);
+        json_resume(&jw, fp, empty);
+        free(existing);
+        }
+    else {
+        json_init(&jw, fp);
+        json_begin_object(&jw, NULL);
+        }
+
+    while (histogram_next(&stats->family_sizes, &position, &value, &count)) {
+        total_families += count;
+        total_reads += value * count;
+        }
+    json_begin_object(&jw, "family_sizes");
+    for (position = 0; histogram_next(&stats->family_sizes, &position, &value, &count);) {
+        snprintf(key, sizeof(key), "%llu", (unsigned long long)value);
+        json_double(&jw, key, (double)count / total_families, 6);
+        }
+    json_end(&jw);
+    json_double(&jw, "mean_family_size", (double)total_reads / total_families, 2);
+
+    json_double(&jw, "duplicate_rate", (double)(stats->optical_duplicates + stats->pcr_duplicates) / stats->total_reads, 4);
+    if (stats->optical) {
+        json_double(&jw, "duplicate_rate_optical", (double)stats->optical_duplicates / stats->total_reads, 4);
+        json_double(&jw, "duplicate_rate_pcr", (double)stats->pcr_duplicates / stats->total_reads, 4);
+        }
+
+    json_double(&jw, "sequencing_error_rate", (double)stats->sequencing_errors / stats->sequencing_total, 4);
+    json_double(&jw, "pcr_error_rate", (double)stats->pcr_errors / stats->pcr_total, 4);
+    json_uint(&jw, "orphaned_reads", stats->orphans);
+    write_saturation(&jw, stats);
+#ifdef ELDUDERINO_PROFILE
+    if (profile.enabled) {
+        profile_write(&jw);
+        }
+#endif
+    json_end(&jw);
+    fprintf(fp, "\n");
+
+    if (ferror(fp)) {
+        fclose(fp);
+        return -1;
+        }
+    return fclose(fp) == 0 ? 0 : -1;
+    }
+
+
+
+static void write_saturation(JsonWriter *jw, const Stats *stats) {
+    /*
+     * Library complexity. For each fraction of the read pairs, the families seen when that fraction is
+     * selected by subsample_hash and the number expected from family_sizes if each read pair were kept
+     * independently with that probability. Deeper sequencing is projected from the library size
+     * estimated as by Picard, which is unknown if every family is a singleton.
+     */
+    double pairs = 0, families = 0, fraction = 0, expected = 0, library_size = 0;
+    const int depths[] = {2, 4, 8, 16};
+    uint64_t subsampled = 0, value = 0, count = 0;
+    size_t position = 0, i = 0, b = 0;
+    char key[8];
+
+    while (histogram_next(&stats->family_sizes, &position, &value, &count)) {
+        families += count;
+        pairs += (double)value * count;
+        }
+
+    json_begin_object(jw, "saturation");
+    json_begin_array(jw, "fractions");
+    for (b = 0; b < SATURATION_BINS; ++b) {
+        json_double(jw, NULL, (double)(b + 1) / SATURATION_BINS, 2);
+        }
+    json_end(jw);
+    json_begin_array(jw, "subsampled_families");
+    for (b = 0; b < SATURATION_BINS; ++b) {
+        subsampled += stats->subsampled_families[b];
+        json_uint(jw, NULL, subsampled);
+        }
+    json_end(jw);
+    json_begin_array(jw, "expected_families");
+    for (b = 0; b < SATURATION_BINS; ++b) {
+        fraction = (double)(b + 1) / SATURATION_BINS;
+        for (expected = 0, position = 0; histogram_next(&stats->family_sizes, &position, &value, &count);) {
+            expected += count * (1 - pow(1 - fraction, (double)value));
+            }
+        json_double(jw, NULL, expected, 1);
+        }
+    json_end(jw);
+
+    if ((library_size = estimate_library_size(pairs, families)) > 0) {
+        json_double(jw, "estimated_library_size", library_size, 0);
+        json_begin_object(jw, "projected_families");
+        for (i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+            snprintf(key, sizeof(key), "%i", depths[i]);
+            json_double(jw, key, library_size * (1 - exp(-depths[i] * pairs / library_size)), 0);
+            }
+        json_end(jw);
+        }
+    else {
+        json_null(jw, "estimated_library_size");
+        json_null(jw, "projected_families");
+        }
+    json_end(jw);
+    }
+
+
+
+static double estimate_library_size(double pairs, double families) {
+    // Solves families / size = 1 - exp(-pairs / size) by bisection as Picard's
+    // EstimateLibraryComplexity does, returns 0 if there are no duplicates to estimate from
+    double low = 1, high = 100, mid = 0, f = 0;
+    int i = 0;
+
+    if (families == 0 || families >= pairs) {
+        return 0;
+        }
+    while ((families / (high * families)) - 1 + exp(-pairs / (high * families)) > 0) {
+        high *= 10;
+        }
+    for (i = 0; i <= 40; ++i) {
+        mid = (low + high) / 2;
+        if ((f = (families / (mid * families)) - 1 + exp(-pairs / (mid * families))) == 0) {
+            break;
+            }
+        else if (f > 0) {
+            low = mid;
+            }
+        else {
+            high = mid;
+            }
+        }
+    return families * (low + high) / 2;
+    }
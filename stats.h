@@ -0,0 +1,56 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define SATURATION_BINS 10 // library complexity is reported at every 10% of the read pairs
+#define HISTOGRAM_DENSE_BINS 256 // smaller values are counted in place, larger ones in a sorted sparse array
+
+
+typedef struct histogrambin_t {
+    uint64_t value;
+    uint64_t count;
+    } HistogramBin;
+
+
+typedef struct histogram_t {
+    uint64_t dense[HISTOGRAM_DENSE_BINS];
+    HistogramBin *sparse; // ordered by value
+    size_t sparse_len;
+    size_t max_sparse_len;
+    } Histogram;
+
+
+// One shard of statistics, zero initialised. Each thread counts into its own and shards are combined
+// with stats_merge.
+typedef struct stats_t {
+    Histogram family_sizes;
+    uint64_t subsampled_families[SATURATION_BINS]; // families by the bin of the lowest subsample hash of their members
+    uint64_t total_reads;
+    uint64_t total_families;
+    uint64_t pcr_duplicates;
+    uint64_t optical_duplicates;
+    uint64_t sequencing_total;
+    uint64_t sequencing_errors;
+    uint64_t pcr_total;
+    uint64_t pcr_errors;
+    uint64_t orphans; // primary reads whose mate never arrived
+    bool optical; // optical duplicates were detected and so are reported separately
+    } Stats;
+
+
+
+int histogram_add(Histogram *histogram, uint64_t value, uint64_t count);
+int histogram_merge(Histogram *into, const Histogram *from);
+bool histogram_next(const Histogram *histogram, size_t *position, uint64_t *value, uint64_t *count);
+void histogram_destroy(Histogram *histogram);
+int stats_add_family(Stats *stats, uint64_t family_size, uint32_t subsample_hash);
+int stats_merge(Stats *into, const Stats *from);
+int stats_write(const Stats *stats, const char *filename);
+void stats_destroy(Stats *stats);
+
+
+#endif